@@ -0,0 +1,103 @@
+#include "Synthetic_tree.h"
+#include "../utils/Transfer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// xorshift64*, fast and good enough for file contents
+class Random {
+public:
+	explicit Random(uint64_t seed) : state{seed ? seed : 1} {}
+	uint64_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545f4914f6cdd1dull;
+	}
+	uint64_t between(uint64_t low, uint64_t high) {
+		return low + (high > low ? next() % (high - low + 1) : 0);
+	}
+private:
+	uint64_t state;
+};
+
+void fill(Random& random, char* data, size_t n, bool compressible) {
+	if (!compressible) {
+		for (size_t i = 0; i < n; i += 8) {
+			const uint64_t r = random.next();
+			std::copy_n(reinterpret_cast<const char*>(&r), std::min<size_t>(8, n - i), data + i);
+		}
+		return;
+	}
+	constexpr std::array<std::string_view, 16> words{
+		"backup", "server", "client", "file ", "chunk", "\n", "checksum", "the ",
+		"return", " = ", "size_t", "{\n\t", "}\n", "std::", "path", ", "
+	};
+	for (size_t i = 0; i < n; ) {
+		const std::string_view w = words[random.next() % words.size()];
+		const size_t k = std::min(w.size(), n - i);
+		std::copy_n(w.data(), k, data + i);
+		i += k;
+	}
+}
+
+}
+
+Tree_shape small_files_tree(double scale) {
+	return {"small", std::max<size_t>(1, 20000 * scale), 512, 8 * 1024, 16, 2, true};
+}
+
+Tree_shape huge_files_tree(double scale) {
+	const uint64_t size = std::max<uint64_t>(1 << 20, (128ull << 20) * scale);
+	return {"huge", 4, size, size, 1, 0, false};
+}
+
+Tree_shape deep_tree(double scale) {
+	return {"deep", std::max<size_t>(1, 2000 * scale), 1024, 4 * 1024, 2, 16, true};
+}
+
+Generated_tree generate_tree(const fs::path& root, const Tree_shape& shape, uint64_t seed) {
+	Random random{seed};
+	Generated_tree tree;
+	tree.root = root;
+	// Leaves are numbered in base fanout, a digit per level
+	size_t leaves = 1;
+	for (size_t i = 0; i < shape.depth; ++i)
+		leaves *= shape.fanout;
+	std::vector<char> buffer(1 << 20);
+	for (size_t i = 0; i < shape.files; ++i) {
+		fs::path dir = root;
+		for (size_t leaf = i % leaves, level = 0; level < shape.depth; ++level, leaf /= shape.fanout)
+			dir /= "d" + std::to_string(leaf % shape.fanout);
+		fs::create_directories(dir);
+		const fs::path path = dir / ("f" + std::to_string(i));
+		const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+			throw std::runtime_error{"can't create " + path.string()};
+		const uint64_t size = random.between(shape.min_size, shape.max_size);
+		try {
+			for (uint64_t written = 0; written < size; ) {
+				const size_t n = std::min<uint64_t>(buffer.size(), size - written);
+				fill(random, buffer.data(), n, shape.compressible);
+				write_all(fd, buffer.data(), n);
+				written += n;
+			}
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+		tree.files.push_back(path);
+		tree.bytes += size;
+	}
+	return tree;
+}
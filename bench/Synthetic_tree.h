@@ -0,0 +1,38 @@
+#ifndef SYNTHETIC_TREE_H
+#define SYNTHETIC_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Shape of a generated tree of files. Directories branch fanout ways
+// down to depth levels, and files are spread over the leaves.
+struct Tree_shape {
+	std::string name;
+	size_t files;
+	uint64_t min_size;
+	uint64_t max_size;
+	size_t fanout;
+	size_t depth;
+	bool compressible;	// Text-like contents, otherwise random bytes
+};
+
+// Many small files, like a source checkout or a maildir
+Tree_shape small_files_tree(double scale);
+// A few files of hundreds of megabytes
+Tree_shape huge_files_tree(double scale);
+// Files at the bottom of a long chain of directories
+Tree_shape deep_tree(double scale);
+
+struct Generated_tree {
+	std::filesystem::path root;
+	std::vector<std::filesystem::path> files;
+	uint64_t bytes = 0;
+};
+
+// Writes the tree under root, the same for the same seed
+Generated_tree generate_tree(const std::filesystem::path& root, const Tree_shape&, uint64_t seed);
+
+#endif
@@ -0,0 +1,360 @@
+// Benchmarks of the scan, hash, manifest and transfer stages over
+// generated trees. Built from the sources of both ends, without their mains:
+//   g++ -std=c++20 -O2 -pthread -o backup_bench
+//     bench/*.cpp utils/*.cpp client/[A-Z]*.cpp server/[A-Z]*.cpp
+// Each measurement is printed to stdout as one line of JSON, for scripts
+// comparing builds, and in words to stderr. What both ends print is
+// dropped meanwhile. Trees are read from the page cache, having just been
+// written, and transfers exclude hashing.
+//
+// Usage: backup_bench [--dir DIR] [--scale X] [--trees small,huge,deep]
+//   [--stages scan,hash,manifest,transfer] [--port N]
+//   [--client Option=Value]... [--server Option=Value]...
+// Options given with --client and --server are passed on to each end
+// of the transfer, like lines of their configuration files. With
+// "Quiet = yes" an end leaves out its per-file lines even though they're dropped.
+
+#include "Synthetic_tree.h"
+#include "../client/Backup_session.h"
+#include "../client/Checksum_engine.h"
+#include "../client/Client_options.h"
+#include "../server/Chunk_store.h"
+#include "../server/Committer.h"
+#include "../server/Event_loop.h"
+#include "../server/Server_options.h"
+#include "../server/Session.h"
+#include "../server/Storage.h"
+#include "../utils/Hasher.h"
+#include "../utils/Log.h"
+#include "../utils/Manifest_codec.h"
+#include "../utils/Option_parser.h"
+#include "../utils/Path_handler.h"
+#include "../utils/Walker.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Settings {
+	fs::path dir = "/tmp/backup_bench";
+	double scale = 1;
+	std::vector<std::string> trees{"small", "huge", "deep"};
+	std::vector<std::string> stages{"scan", "hash", "manifest", "transfer"};
+	int port = 25499;
+	Options client;
+	Options server;
+};
+
+struct Result {
+	std::string stage;
+	std::string tree;
+	std::string variant;
+	size_t files;
+	uint64_t bytes;
+	double seconds;
+};
+
+FILE* results = stdout;
+
+void report(const Result& r) {
+	const double files_per_second = r.seconds > 0 ? r.files / r.seconds : 0;
+	const double mb_per_second = r.seconds > 0 ? r.bytes / r.seconds / 1e6 : 0;
+	std::fprintf(results, "{\"stage\":\"%s\",\"tree\":\"%s\",\"variant\":\"%s\",\"files\":%zu,"
+			"\"bytes\":%llu,\"seconds\":%.6f,\"files_per_second\":%.1f,\"mb_per_second\":%.1f}\n",
+		r.stage.c_str(), r.tree.c_str(), r.variant.c_str(), r.files,
+		static_cast<unsigned long long>(r.bytes), r.seconds, files_per_second, mb_per_second);
+	std::fflush(results);
+	std::cerr << r.stage << ' ' << r.tree << ' ' << r.variant << ": " << r.seconds << " s, "
+		<< static_cast<uint64_t>(files_per_second) << " files/s, "
+		<< static_cast<uint64_t>(mb_per_second) << " MB/s\n";
+}
+
+double seconds_of(const std::function<void()>& f) {
+	const auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool wanted(const std::vector<std::string>& list, const std::string& name) {
+	return std::find(list.begin(), list.end(), name) != list.end();
+}
+
+std::vector<std::string> split(const std::string& s) {
+	std::vector<std::string> out;
+	std::istringstream is{s};
+	for (std::string item; std::getline(is, item, ','); )
+		out.push_back(item);
+	return out;
+}
+
+size_t threads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void bench_scan(const Generated_tree& tree, const std::string& name, const fs::path& work) {
+	const std::vector<fs::path> roots{tree.root};
+	Walk_result walked;
+	report({"scan", name, "walk", tree.files.size(), 0,
+		seconds_of([&]{ walked = walk(roots, threads(), true); })});
+	report({"scan", name, "walk_into_pool", tree.files.size(), 0, seconds_of([&]{
+		Path_pool paths;
+		walk(roots, threads(), true, [&](std::string_view path, const struct stat&) { paths.intern(path); });
+	})});
+	report({"scan", name, "path_handler", tree.files.size(), 0, seconds_of([&]{
+		Path_handler handler{roots, work / "directories.txt"};
+		for (const Walked_file& f : walked.files)
+			handler.add_file(f.path);
+	})});
+	report({"scan", name, "add_recursively", tree.files.size(), 0, seconds_of([&]{
+		Path_handler handler{roots, work / "directories.txt"};
+		add_recursively(handler, tree.root);
+	})});
+}
+
+void bench_hash(const Generated_tree& tree, const std::string& name) {
+	for (Hash_algorithm a : {Hash_algorithm::crc32, Hash_algorithm::crc32c, Hash_algorithm::xxh64}) {
+		report({"hash", name, to_string(a), tree.files.size(), tree.bytes, seconds_of([&]{
+			for (const fs::path& f : tree.files)
+				checksum_of_file(a, f);
+		})});
+	}
+	const Hash_algorithm best = best_hash_algorithm();
+	report({"hash", name, to_string(best) + "-parallel", tree.files.size(), tree.bytes, seconds_of([&]{
+		Checksum_engine engine{threads(), best};
+		engine.checksums(tree.files);
+	})});
+}
+
+void bench_manifest(const Generated_tree& tree, const std::string& name) {
+	const Hash_algorithm algorithm = best_hash_algorithm();
+	std::vector<std::string> names;
+	for (const fs::path& f : tree.files)
+		names.push_back(f.lexically_relative(tree.root.parent_path()).generic_string());
+	const Checksum checksum{algorithm, 0x0123456789abcdefull};
+	// Batches as the client cuts them
+	constexpr size_t batch_entries = 4096;
+	std::vector<std::string> batches;
+	uint64_t bytes = 0;
+	const double encoding = seconds_of([&]{
+		Manifest_encoder encoder{algorithm};
+		for (const std::string& n : names) {
+			encoder.add(n, checksum);
+			if (encoder.pending() == batch_entries)
+				batches.push_back(encoder.encode_batch());
+		}
+		if (encoder.pending() > 0)
+			batches.push_back(encoder.encode_batch());
+	});
+	for (const std::string& b : batches)
+		bytes += b.size();
+	report({"manifest", name, "encode", names.size(), bytes, encoding});
+	report({"manifest", name, "decode", names.size(), bytes, seconds_of([&]{
+		Manifest_decoder decoder{algorithm};
+		std::vector<Manifest_entry> entries;
+		for (const std::string& b : batches) {
+			entries.clear();
+			decoder.decode_batch(std::string_view{b}.substr(frame_header_size), entries);
+		}
+	})});
+}
+
+// Serves backups until killed, as the server's main does
+[[noreturn]] void serve(const Options& given) {
+	try {
+		const Server_options options{given};
+		set_quiet(options.quiet());
+		Committer committer{options.durability(), options.io_uring()};
+		std::unique_ptr<Storage> storage;
+		if (options.storage() == "cas")
+			storage = std::make_unique<Cas_storage>(options.cas_path(), committer);
+		else
+			storage = std::make_unique<Plain_storage>(options.backup_path(), options.partial_path(),
+				options.chunk_index_path(), committer);
+		Session_context ctx{
+			options.backup_path(),
+			options.read_size(),
+			committer,
+			options.io_uring(),
+			std::move(storage),
+			Checksum_index{options.index_path()},
+			{},
+			Bandwidth_share{options.bandwidth_schedule()}
+		};
+		Event_loop loop{
+			options.port(),
+			options.max_connections(),
+			options.worker_threads(),
+			options.socket_tuning(),
+			ctx
+		};
+		loop.run();
+	} catch (const std::exception& e) {
+		std::cerr << "server error: " << e.what() << '\n';
+	}
+	_exit(1);
+}
+
+int connect_to(const Client_options& options) {
+	for (int attempt = 0; ; ++attempt) {
+		const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			throw std::runtime_error{"socket error"};
+		tune_socket(fd, options.socket_tuning());
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(options.port());
+		addr.sin_addr.s_addr = inet_addr(options.server_ip().c_str());
+		if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		// The server may still be starting
+		if (attempt == 50)
+			throw std::runtime_error{"can't connect to the benchmark server"};
+		std::this_thread::sleep_for(std::chrono::milliseconds{100});
+	}
+}
+
+// One backup run of the tree, as the client's main does
+size_t back_up(const Client_options& options, const Generated_tree& tree,
+		const std::vector<Checksum>& checksums) {
+	Backup_session session{[&options]{ return connect_to(options); }, options};
+	for (size_t i = 0; i < tree.files.size(); ++i)
+		session.add_entry(tree.files[i].native(), checksums[i]);
+	session.finish();
+	return session.files_sent();
+}
+
+void bench_transfer(const Generated_tree& tree, const std::string& name, const Settings& s, const fs::path& work) {
+	Options client = s.client;
+	client.data.emplace("ServerIP", "127.0.0.1");
+	client.data.emplace("Port", std::to_string(s.port));
+	client.data.emplace("SyncPath", tree.root.string());
+	client.data.emplace("DirectoryFile", (work / "directories.txt").string());
+	const Client_options options{client};
+	set_quiet(options.quiet());
+	Checksum_engine engine{options.hash_threads(), options.hash_algorithm()};
+	const std::vector<Checksum> checksums = engine.checksums(tree.files);
+	size_t sent = 0;
+	report({"transfer", name, "first", tree.files.size(), tree.bytes,
+		seconds_of([&]{ sent = back_up(options, tree, checksums); })});
+	if (sent != tree.files.size())
+		throw std::runtime_error{"only " + std::to_string(sent) + " file(s) of " + name + " sent"};
+	// Only the manifest goes over, every file being up to date
+	report({"transfer", name, "unchanged", tree.files.size(), 0,
+		seconds_of([&]{ sent = back_up(options, tree, checksums); })});
+	if (sent != 0)
+		throw std::runtime_error{std::to_string(sent) + " unchanged file(s) of " + name + " sent again"};
+}
+
+Settings parse_arguments(int argc, char* argv[]) {
+	Settings s;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (i + 1 == argc)
+			throw std::runtime_error{"no value for " + arg};
+		const std::string value = argv[++i];
+		if (arg == "--dir")
+			s.dir = value;
+		else if (arg == "--scale")
+			s.scale = std::stod(value);
+		else if (arg == "--trees")
+			s.trees = split(value);
+		else if (arg == "--stages")
+			s.stages = split(value);
+		else if (arg == "--port")
+			s.port = std::stoi(value);
+		else if (arg == "--client")
+			s.client.data.insert(parse_line(value));
+		else if (arg == "--server")
+			s.server.data.insert(parse_line(value));
+		else
+			throw std::runtime_error{"unknown argument " + arg};
+	}
+	return s;
+}
+
+}
+
+int main(int argc, char* argv[]) try {
+	const Settings s = parse_arguments(argc, argv);
+	// Both ends print their progress to stdout, which is kept for the results
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (!results || !std::freopen("/dev/null", "w", stdout))
+		throw std::runtime_error{"can't set aside stdout"};
+	fs::remove_all(s.dir);
+	const fs::path work = s.dir / "work";
+	fs::create_directories(work);
+
+	std::vector<std::pair<std::string, Generated_tree>> trees;
+	for (const std::string& name : s.trees) {
+		const Tree_shape shape = name == "small" ? small_files_tree(s.scale)
+			: name == "huge" ? huge_files_tree(s.scale)
+			: name == "deep" ? deep_tree(s.scale)
+			: throw std::runtime_error{"unknown tree " + name};
+		std::cerr << "Generating " << name << " tree\n";
+		trees.emplace_back(name, generate_tree(s.dir / "trees" / name, shape, trees.size() + 1));
+	}
+
+	for (const auto& [name, tree] : trees) {
+		if (wanted(s.stages, "scan"))
+			bench_scan(tree, name, work);
+		if (wanted(s.stages, "hash"))
+			bench_hash(tree, name);
+		if (wanted(s.stages, "manifest"))
+			bench_manifest(tree, name);
+	}
+
+	if (wanted(s.stages, "transfer")) {
+		const fs::path server_dir = s.dir / "server";
+		Options server = s.server;
+		server.data.emplace("Port", std::to_string(s.port));
+		server.data.emplace("BackupPath", (server_dir / "backup").string());
+		server.data.emplace("IndexPath", (server_dir / "index").string());
+		server.data.emplace("ChunkIndexPath", (server_dir / "chunks").string());
+		server.data.emplace("CasPath", (server_dir / "cas").string());
+		fs::create_directories(server_dir / "backup");
+		// Forked before any thread of the client side exists
+		const pid_t child = fork();
+		if (child == -1)
+			throw std::runtime_error{"failed fork() " + std::to_string(errno)};
+		if (child == 0) {
+			if (chdir(server_dir.c_str()) == -1 || !std::freopen("log.txt", "w", stderr))
+				_exit(1);
+			serve(server);
+		}
+		try {
+			for (const auto& [name, tree] : trees)
+				bench_transfer(tree, name, s, work);
+		} catch (...) {
+			kill(child, SIGKILL);
+			waitpid(child, nullptr, 0);
+			throw;
+		}
+		kill(child, SIGKILL);
+		waitpid(child, nullptr, 0);
+	}
+	fs::remove_all(s.dir);
+} catch (const std::exception& e) {
+	std::cerr << "error: " << e.what() << '\n';
+	return 1;
+}
@@ -0,0 +1,388 @@
+#include "Backup_session.h"
+#include "../utils/Log.h"
+#include "../utils/Metrics.h"
+#include "../utils/Rate_limiter.h"
+#include "../utils/Transfer.h"
+
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+Counter& entries_added = metrics().counter("backup_client_manifest_entries_total",
+	"Files offered to the server");
+Counter& uploaded_files = metrics().counter("backup_client_uploaded_files_total",
+	"Files uploaded, whole, resumed or as deltas");
+Counter& uploaded_bytes = metrics().counter("backup_client_uploaded_bytes_total",
+	"Sizes of the files uploaded");
+Histogram& send_latency = metrics().histogram("backup_client_send_file_microseconds",
+	"Time to read, compress and queue a file for sending");
+Histogram& session_latency = metrics().histogram("backup_client_session_microseconds",
+	"Duration of backup sessions, from connecting until the server acknowledged them");
+Gauge& upload_queue = metrics().gauge("backup_client_upload_queue_depth",
+	"Files the server asked for that no stream took yet");
+
+}
+
+Backup_session::Backup_session(std::function<int()> connect_to_server, const Client_options& options)
+	: connect{std::move(connect_to_server)}, sock{connect()}, stream{sock, options.socket_tuning()},
+		manifest{options.hash_algorithm()}, roots{options.sync_path()},
+		delta_threshold{options.delta_threshold()},
+		pack_threshold{options.pack_threshold()},
+		compression_level{options.compression_level()},
+		tuning{options.socket_tuning()},
+		started{std::chrono::steady_clock::now()},
+		joined_done{static_cast<std::ptrdiff_t>(options.streams()) - 1} {
+	for (fs::path& root : roots) {
+		root = root.lexically_normal();
+		if (!root.has_filename())
+			root = root.parent_path();	// Trailing separator
+	}
+	// Random, so that other clients can't join the session by guessing it
+	while (options.streams() > 1 && session_id == 0) {
+		if (getrandom(&session_id, sizeof(session_id), 0) != sizeof(session_id)) {
+			close(sock);
+			throw std::runtime_error{"failed getrandom() " + std::to_string(errno)};
+		}
+	}
+	stream.write(encode(Hello{
+		options.hash_algorithm(),
+		compression_level > 0 ? Compression::lz4 : Compression::none,
+		options.client_id(),
+		session_id
+	}));
+	for (size_t i = 0; i < options.streams(); ++i)
+		streams.push_back(std::make_unique<Upload_stream>());
+	streams[0]->frames = &stream;
+	receiver = std::thread{[this]{ receive(); }};
+	uploaders.emplace_back([this]{ upload(); });
+	for (size_t i = 1; i < streams.size(); ++i)
+		uploaders.emplace_back([this, &u = *streams[i]]{ upload_joined(u); });
+}
+
+Backup_session::~Backup_session() {
+	if (receiver.joinable()) {
+		// Not finished, unblock the threads before joining them
+		fail(nullptr);
+		receiver.join();
+		for (std::thread& t : uploaders)
+			t.join();
+	}
+	for (const auto& u : streams)
+		if (u->joined)
+			close(u->joined->fd());
+	close(sock);
+}
+
+void Backup_session::add_entry(std::string_view file, const Checksum& checksum) {
+	// Relative to the parent of its sync path,
+	// so that files of different sync paths don't collide
+	const fs::path path{file};
+	const size_t root = root_of(path);
+	const std::string name = remote_name(path, root);
+	{
+		std::lock_guard<std::mutex> lock{paths_mutex};
+		if (remote_names.intern(name) == entry_roots.size())
+			entry_roots.push_back(root);
+	}
+	// Batches are sent when full, or once they've waited long enough,
+	// so that the server can request files while hashing goes on
+	constexpr size_t max_batch_entries = 4096;
+	constexpr size_t max_batch_size = 256 * 1024;
+	constexpr std::chrono::milliseconds max_batch_delay{20};
+	if (manifest.pending() == 0)
+		batch_started = std::chrono::steady_clock::now();
+	manifest.add(name, checksum);
+	entries_added.add();
+	if (manifest.pending() >= max_batch_entries || manifest.pending_size() >= max_batch_size
+			|| std::chrono::steady_clock::now() - batch_started >= max_batch_delay)
+		send_batch();
+}
+
+bool Backup_session::skipped(std::string_view file) {
+	std::lock_guard<std::mutex> lock{paths_mutex};
+	if (skipped_names.empty())
+		return false;
+	const fs::path path{file};
+	return skipped_names.contains(remote_name(path, root_of(path)));
+}
+
+void Backup_session::send_batch() {
+	stream.write(manifest.encode_batch());
+}
+
+void Backup_session::finish() {
+	try {
+		if (manifest.pending() > 0)
+			send_batch();
+		stream.write(encode(Frame_type::manifest_end));
+		stream.flush();
+	} catch (...) {
+		fail(std::current_exception());
+	}
+	receiver.join();
+	for (std::thread& t : uploaders)
+		t.join();
+	if (error)
+		std::rethrow_exception(error);
+	if (!acked)
+		throw std::runtime_error{"server closed the connection"};
+	session_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - started).count());
+}
+
+void Backup_session::receive() try {
+	for (Frame f; stream.read(f); ) {
+		switch (f.type) {
+		case Frame_type::outdated_entry:
+			upload_queue.add();
+			requested.push(decode_outdated(f.payload));
+			break;
+		case Frame_type::outdated_end:
+			requested.close();
+			break;
+		case Frame_type::chunk_need:
+			chunk_needs.push(decode_chunk_need(f.payload));
+			break;
+		case Frame_type::ack:
+			acked = true;
+			return;
+		default:
+			throw std::runtime_error{"unexpected frame from server"};
+		}
+	}
+	requested.close();
+} catch (...) {
+	fail(std::current_exception());
+}
+
+void Backup_session::upload() try {
+	Upload_stream& u = *streams[0];
+	for (Outdated_entry e; next_requested(e); )
+		send_file(u, e);
+	send_pack(u);
+	// Files sent over further connections must be stored before the session ends
+	joined_done.wait();
+	{
+		std::lock_guard<std::mutex> lock{error_mutex};
+		if (failed)
+			return;
+	}
+	stream.write(encode(Frame_type::files_end));
+	stream.flush();
+} catch (...) {
+	fail(std::current_exception());
+}
+
+void Backup_session::upload_joined(Upload_stream& u) {
+	try {
+		Outdated_entry e;
+		if (next_requested(e)) {
+			// Only once the server asked for a file, by which time it knows the session
+			join(u);
+			do {
+				send_file(u, e);
+			} while (next_requested(e));
+			send_pack(u);
+			u.frames->write(encode(Frame_type::files_end));
+			Frame f;
+			if (!u.frames->read(f) || f.type != Frame_type::ack)
+				throw std::runtime_error{"server didn't acknowledge the files of a stream"};
+		}
+	} catch (...) {
+		fail(std::current_exception());
+	}
+	joined_done.count_down();
+}
+
+bool Backup_session::next_requested(Outdated_entry& e) {
+	if (!requested.pop(e))
+		return false;
+	upload_queue.sub();
+	return true;
+}
+
+void Backup_session::join(Upload_stream& u) {
+	const int fd = connect();
+	{
+		std::lock_guard<std::mutex> lock{streams_mutex};
+		u.joined.emplace(fd, tuning);
+		u.frames = &*u.joined;
+	}
+	{
+		// Failed before the connection could be shut down with the others
+		std::lock_guard<std::mutex> lock{error_mutex};
+		if (failed)
+			throw std::runtime_error{"session failed"};
+	}
+	u.frames->write(encode(Join{session_id}));
+}
+
+void Backup_session::send_file(Upload_stream& u, const Outdated_entry& entry) {
+	const std::string& name = entry.path;
+	fs::path localpath;
+	{
+		std::lock_guard<std::mutex> lock{paths_mutex};
+		const std::optional<Path_id> id = remote_names.find(name);
+		if (!id)
+			throw std::runtime_error{"server asked for unknown file \"" + name + '"'};
+		localpath = roots[entry_roots[*id]].parent_path() / name;
+	}
+	int file = open(localpath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file == -1) {
+		std::cerr << localpath << " doesn't exist!\n";
+		return;
+	}
+	Latency_timer timer{send_latency};
+	try {
+		size_t file_size = fs::file_size(localpath);
+
+		// VERBOSE
+		log_file(std::cout, "Sending ", localpath, " (", file_size, " bytes)");
+
+		bool complete = true;
+		if (entry.as_chunks || file_size >= delta_threshold) {
+			complete = send_delta(u, name, file, file_size);
+		} else if (file_size < pack_threshold) {
+			// Sent whole, even if an interrupted upload left some of it
+			complete = pack_file(u, name, file, file_size);
+		} else {
+			// Resume where an interrupted upload stopped, unless the file shrank since
+			const uint64_t offset = entry.offset <= file_size ? entry.offset : 0;
+
+			// VERBOSE
+			if (offset > 0)
+				log_file(std::cout, "Resuming at ", offset, " bytes");
+
+			u.frames->write(encode(File_header{name, file_size, offset}));
+			u.frames->write_file_chunks(file, offset, file_size - offset, compression_level);
+		}
+		if (!complete) {
+			// Left for the next backup, like a file that's gone
+			std::cerr << localpath << " changed while sending, skipped\n";
+			close(file);
+			std::lock_guard<std::mutex> lock{paths_mutex};
+			skipped_names.insert(name);
+			return;
+		}
+		uploaded_bytes.add(file_size);
+	} catch (...) {
+		close(file);
+		throw;
+	}
+	close(file);
+	++sent;
+	uploaded_files.add();
+}
+
+bool Backup_session::send_delta(Upload_stream& u, const std::string& name, int file, uint64_t size) {
+	Chunk_list list{name, size, chunk_file(file)};
+	uint64_t chunked = 0;
+	for (const Chunk& c : list.chunks)
+		chunked += c.length;
+	if (chunked != size)
+		return false;
+	u.frames->write(encode(list));
+	u.frames->flush();
+	const Chunk_need need = receive_need(u);
+	if (need.path != name || need.needed.size() != list.chunks.size())
+		throw std::runtime_error{"server answered for the wrong chunk list"};
+	size_t needed = 0;
+	for (size_t i = 0; i < list.chunks.size(); ++i) {
+		if (!need.needed[i])
+			continue;
+		u.frames->write_file_chunks(file, list.chunks[i].offset, list.chunks[i].length, compression_level);
+		++needed;
+	}
+
+	// VERBOSE
+	log_file(std::cout, "Sent ", needed, " of ", list.chunks.size(), " chunk(s) of ", name);
+	return true;
+}
+
+Chunk_need Backup_session::receive_need(Upload_stream& u) {
+	if (u.frames == &stream) {
+		// Read by the receiving thread, like everything on the session's own connection
+		Chunk_need need;
+		if (!chunk_needs.pop(need))
+			throw std::runtime_error{"server closed the connection"};
+		return need;
+	}
+	Frame f;
+	if (!u.frames->read(f))
+		throw std::runtime_error{"server closed the connection"};
+	if (f.type != Frame_type::chunk_need)
+		throw std::runtime_error{"unexpected frame from server"};
+	return decode_chunk_need(f.payload);
+}
+
+bool Backup_session::pack_file(Upload_stream& u, const std::string& name, int file, uint64_t size) {
+	const size_t record_size = 4 + name.size() + 8 + size;
+	if (u.pack.payload().size() + record_size > max_pack_payload)
+		send_pack(u);
+	u.contents.resize(size);
+	if (read_at(file, u.contents.data(), size, 0) != size)
+		return false;	// Shrank, the pack goes on without it
+	disk_read_limit().consume(size);
+	u.pack.str(name).u64(size).bytes(u.contents.data(), size);
+	return true;
+}
+
+void Backup_session::send_pack(Upload_stream& u) {
+	const std::string& raw = u.pack.payload();
+	if (raw.empty())
+		return;
+	// Compressed as one block, across files, unless it saves too little
+	std::string packed;
+	if (compression_level > 0 && looks_compressible(raw.data(), raw.size())) {
+		packed.resize(compress_bound(raw.size()));
+		packed.resize(compress(raw.data(), raw.size(), packed.data(),
+			raw.size() - raw.size() / 32, compression_level));
+	}
+	if (!packed.empty())
+		u.frames->write(Payload_writer{}.u32(raw.size()).bytes(packed.data(), packed.size())
+			.frame(Frame_type::compressed_pack));
+	else
+		u.frames->write(u.pack.frame(Frame_type::file_pack));
+	u.pack = Payload_writer{};
+}
+
+void Backup_session::fail(std::exception_ptr e) {
+	{
+		std::lock_guard<std::mutex> lock{error_mutex};
+		if (!error)
+			error = e;
+		failed = true;
+	}
+	shutdown(sock, SHUT_RDWR);
+	{
+		std::lock_guard<std::mutex> lock{streams_mutex};
+		for (const auto& u : streams)
+			if (u->joined)
+				shutdown(u->joined->fd(), SHUT_RDWR);
+	}
+	requested.close();
+	chunk_needs.close();
+}
+
+size_t Backup_session::root_of(const fs::path& file) const {
+	for (size_t i = 0; i < roots.size(); ++i) {
+		auto [r, f] = std::mismatch(roots[i].begin(), roots[i].end(), file.begin(), file.end());
+		if (r == roots[i].end())
+			return i;
+	}
+	throw std::runtime_error{"path \"" + file.string() + "\" not under given directories"};
+}
+
+std::string Backup_session::remote_name(const fs::path& file, size_t root) const {
+	return file.lexically_relative(roots[root].parent_path()).generic_string();
+}
@@ -0,0 +1,121 @@
+#ifndef BACKUP_SESSION_H
+#define BACKUP_SESSION_H
+
+#include "../utils/Blocking_queue.h"
+#include "../utils/Frame.h"
+#include "../utils/Manifest_codec.h"
+#include "../utils/Path_pool.h"
+#include "Client_options.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// One backup run against the server. Manifest entries are streamed as
+// they are added, while files the server asks for are uploaded on
+// separate threads, so uploads start before the scan is over.
+// With more than one stream, files are spread over further connections
+// that join the session, one uploading thread each.
+class Backup_session {
+public:
+	// Connects to the server with connect, which returns a connected socket
+	Backup_session(std::function<int()> connect, const Client_options&);
+	~Backup_session();
+
+	Backup_session(const Backup_session&) = delete;
+	Backup_session& operator=(const Backup_session&) = delete;
+
+	void add_entry(std::string_view file, const Checksum&);
+	// Ends the manifest and waits until the server stored every file it asked for.
+	// Rethrows the first error of the receiving and uploading threads.
+	void finish();
+
+	size_t files_sent() const { return sent; }
+	// Whether a file was left out because it changed while being sent,
+	// so that it isn't recorded as backed up
+	bool skipped(std::string_view file);
+private:
+	// A connection files are uploaded over, with its pack of small files
+	struct Upload_stream {
+		Frame_stream* frames = nullptr;	// The session's own, or joined
+		std::optional<Frame_stream> joined;	// Once connected
+		Payload_writer pack;	// Small files not yet sent
+		std::string contents;	// Of the file being packed
+	};
+
+	// Send the pending manifest entries as one batch
+	void send_batch();
+	void receive();
+	// Upload over the session's own connection, ending the session
+	void upload();
+	// Upload over a further connection, once there is something to send
+	void upload_joined(Upload_stream&);
+	// Pop a file the server asked for, false once there are no more
+	bool next_requested(Outdated_entry&);
+	void join(Upload_stream&);
+	void send_file(Upload_stream&, const Outdated_entry&);
+	// Send only the chunks of a file the server doesn't have,
+	// false if it changed before anything was sent
+	bool send_delta(Upload_stream&, const std::string& name, int file, uint64_t size);
+	Chunk_need receive_need(Upload_stream&);
+	// Add a small file to the pack, sending the pack first if it's full,
+	// false if it shrank and was left out
+	bool pack_file(Upload_stream&, const std::string& name, int file, uint64_t size);
+	void send_pack(Upload_stream&);
+	// Record the first error and unblock the other threads
+	void fail(std::exception_ptr);
+	// Index of the sync path a file is under
+	size_t root_of(const std::filesystem::path& file) const;
+	// Relative to the parent of its sync path
+	std::string remote_name(const std::filesystem::path& file, size_t root) const;
+
+	std::function<int()> connect;
+	int sock;
+	Frame_stream stream;
+	uint64_t session_id = 0;
+	Manifest_encoder manifest;
+	std::chrono::steady_clock::time_point batch_started;
+	std::vector<std::filesystem::path> roots;
+	uint64_t delta_threshold;
+	uint64_t pack_threshold;
+	int compression_level;
+	Socket_tuning tuning;
+	std::chrono::steady_clock::time_point started;
+
+	// Remote names of the manifest entries, to find files the server asks for.
+	// A file's local path is its remote name under the parent of its sync path.
+	Path_pool remote_names;
+	std::vector<uint32_t> entry_roots;	// By id in remote_names
+	std::unordered_set<std::string> skipped_names;
+	std::mutex paths_mutex;
+
+	Blocking_queue<Outdated_entry> requested;
+	Blocking_queue<Chunk_need> chunk_needs;	// Answers on the session's own connection
+	std::atomic<size_t> sent = 0;
+
+	std::vector<std::unique_ptr<Upload_stream>> streams;	// The session's own first
+	std::mutex streams_mutex;	// Guards joining, against failing meanwhile
+	std::latch joined_done;		// Counted down as further connections finish
+
+	std::exception_ptr error;
+	bool failed = false;	// Even without an error, when given up on
+	std::mutex error_mutex;
+	bool acked = false;
+
+	std::thread receiver;
+	std::vector<std::thread> uploaders;
+};
+
+#endif
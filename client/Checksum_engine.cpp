@@ -0,0 +1,76 @@
+#include "Checksum_engine.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+
+namespace fs = std::filesystem;
+
+void Checksum_engine::checksums
+(const std::vector<fs::path>& files, const Result_handler& on_result) {
+	struct Slot {
+		Checksum checksum;
+		std::exception_ptr error;
+		bool ready = false;
+	};
+	std::vector<Slot> slots(files.size());
+	std::atomic<size_t> next{0};
+	std::atomic<bool> cancelled{false};
+	std::mutex m;
+	std::condition_variable cv;
+	size_t running = pool.size();
+
+	// Workers claim files one at a time, so a few huge files
+	// don't leave the other threads idle
+	for (size_t t = 0; t < pool.size(); ++t) {
+		pool.submit([&]{
+			for (size_t i = 0; !cancelled && (i = next++) < files.size(); ) {
+				Slot slot;
+				try {
+					slot.checksum = checksum_of_file(algorithm, files[i]);
+				} catch (...) {
+					slot.error = std::current_exception();
+				}
+				slot.ready = true;
+				{
+					std::lock_guard<std::mutex> lock{m};
+					slots[i] = std::move(slot);
+				}
+				cv.notify_one();
+			}
+			{
+				std::lock_guard<std::mutex> lock{m};
+				--running;
+			}
+			cv.notify_one();
+		});
+	}
+	// The workers refer to this frame, wait for them even when failing
+	auto join_workers = [&]{
+		cancelled = true;
+		std::unique_lock<std::mutex> lock{m};
+		cv.wait(lock, [&]{ return running == 0; });
+	};
+	try {
+		for (size_t i = 0; i < files.size(); ++i) {
+			{
+				std::unique_lock<std::mutex> lock{m};
+				cv.wait(lock, [&]{ return slots[i].ready; });
+			}
+			if (slots[i].error)
+				std::rethrow_exception(slots[i].error);
+			on_result(i, slots[i].checksum);
+		}
+	} catch (...) {
+		join_workers();
+		throw;
+	}
+	join_workers();
+}
+
+std::vector<Checksum> Checksum_engine::checksums(const std::vector<fs::path>& files) {
+	std::vector<Checksum> ret(files.size());
+	checksums(files, [&ret](size_t i, const Checksum& checksum){ ret[i] = checksum; });
+	return ret;
+}
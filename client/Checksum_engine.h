@@ -0,0 +1,29 @@
+#ifndef CHECKSUM_ENGINE_H
+#define CHECKSUM_ENGINE_H
+
+#include "../utils/Thread_pool.h"
+#include "../utils/Hasher.h"
+
+#include <filesystem>
+#include <functional>
+#include <vector>
+
+// Calculates checksums of files on a pool of threads
+class Checksum_engine {
+public:
+	// Receives the index of a file in the input and its checksum
+	using Result_handler = std::function<void(size_t, const Checksum&)>;
+
+	Checksum_engine(size_t threads, Hash_algorithm a) : algorithm{a}, pool{threads} {}
+
+	// Checksums each file exactly once, fanning them out across the pool.
+	// Results are handed to on_result in input order as they become ready,
+	// on the calling thread. Rethrows the first failure in input order.
+	void checksums(const std::vector<std::filesystem::path>& files, const Result_handler& on_result);
+	std::vector<Checksum> checksums(const std::vector<std::filesystem::path>& files);
+private:
+	Hash_algorithm algorithm;
+	Thread_pool pool;
+};
+
+#endif
@@ -1,4 +1,12 @@
 #include "Client_options.h"
+#include "../utils/Frame.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -17,3 +25,138 @@ std::vector<fs::path> Client_options::sync_path() const {
 fs::path Client_options::directory() const {
 	return lookup_single_as<fs::path>("DirectoryFile");
 }
+
+size_t Client_options::hash_threads() const {
+	constexpr int max_hash_threads = 1024;
+	if (!contains("HashThreads"))
+		return std::max(1u, std::thread::hardware_concurrency());
+	const int threads = lookup_single_as<int>("HashThreads");
+	if (threads < 1 || threads > max_hash_threads)
+		throw std::runtime_error{"HashThreads must be between 1 and " + std::to_string(max_hash_threads)};
+	return threads;
+}
+
+Hash_algorithm Client_options::hash_algorithm() const {
+	if (!contains("HashAlgorithm"))
+		return best_hash_algorithm();
+	return parse_hash_algorithm(lookup_single("HashAlgorithm"));
+}
+
+uint64_t Client_options::delta_threshold() const {
+	constexpr uint64_t default_delta_threshold = 1024 * 1024;
+	if (!contains("DeltaThreshold"))
+		return default_delta_threshold;
+	return std::stoull(lookup_single("DeltaThreshold"));
+}
+
+uint64_t Client_options::pack_threshold() const {
+	constexpr uint64_t default_pack_threshold = 64 * 1024;
+	// Leaves room in a pack for the path of a file, and a few more files
+	constexpr uint64_t max_pack_threshold = max_pack_payload / 4;
+	if (!contains("PackThreshold"))
+		return default_pack_threshold;
+	const uint64_t threshold = std::stoull(lookup_single("PackThreshold"));
+	if (threshold > max_pack_threshold)
+		throw std::runtime_error{"PackThreshold must be at most " + std::to_string(max_pack_threshold)};
+	return threshold;
+}
+
+size_t Client_options::streams() const {
+	constexpr int max_streams = 64;
+	if (!contains("Streams"))
+		return 1;
+	const int streams = lookup_single_as<int>("Streams");
+	if (streams < 1 || streams > max_streams)
+		throw std::runtime_error{"Streams must be between 1 and " + std::to_string(max_streams)};
+	return streams;
+}
+
+Socket_tuning Client_options::socket_tuning() const {
+	Socket_tuning t;
+	if (contains("SendBuffer"))
+		t.send_buffer = lookup_single_as<int>("SendBuffer");
+	if (contains("ReceiveBuffer"))
+		t.receive_buffer = lookup_single_as<int>("ReceiveBuffer");
+	if (contains("Cork")) {
+		const std::string cork = lookup_single("Cork");
+		if (cork != "yes" && cork != "no")
+			throw std::runtime_error{"Cork must be yes or no"};
+		t.cork = cork == "yes";
+	}
+	if (contains("ZeroCopyThreshold"))
+		t.zerocopy_threshold = std::stoull(lookup_single("ZeroCopyThreshold"));
+	return t;
+}
+
+Rate_schedule Client_options::network_schedule() const {
+	if (!contains("NetworkLimit"))
+		return {};
+	return Rate_schedule{lookup("NetworkLimit")};
+}
+
+Rate_schedule Client_options::disk_read_schedule() const {
+	if (!contains("DiskReadLimit"))
+		return {};
+	return Rate_schedule{lookup("DiskReadLimit")};
+}
+
+int Client_options::compression_level() const {
+	constexpr int default_compression_level = 1;
+	if (!contains("CompressionLevel"))
+		return default_compression_level;
+	const int level = lookup_single_as<int>("CompressionLevel");
+	if (level < 0 || level > max_compression_level)
+		throw std::runtime_error{"CompressionLevel must be between 0 and " + std::to_string(max_compression_level)};
+	return level;
+}
+
+std::string Client_options::client_id() const {
+	if (contains("ClientId"))
+		return lookup_single("ClientId");
+	char name[256] = {};
+	if (gethostname(name, sizeof(name) - 1) == -1)
+		throw std::runtime_error{"failed gethostname() " + std::to_string(errno)};
+	return name;
+}
+
+std::chrono::milliseconds Client_options::watch_delay() const {
+	constexpr std::chrono::milliseconds default_watch_delay{1000};
+	if (!contains("WatchDelay"))
+		return default_watch_delay;
+	return std::chrono::milliseconds{lookup_single_as<int>("WatchDelay")};
+}
+
+std::chrono::milliseconds Client_options::watch_max_delay() const {
+	constexpr int default_multiple = 10;
+	if (!contains("WatchMaxDelay"))
+		return watch_delay() * default_multiple;
+	const std::chrono::milliseconds max_delay{lookup_single_as<int>("WatchMaxDelay")};
+	if (max_delay < watch_delay())
+		throw std::runtime_error{"WatchMaxDelay must not be less than WatchDelay"};
+	return max_delay;
+}
+
+bool Client_options::quiet() const {
+	if (!contains("Quiet"))
+		return false;
+	const std::string quiet = lookup_single("Quiet");
+	if (quiet != "yes" && quiet != "no")
+		throw std::runtime_error{"Quiet must be yes or no"};
+	return quiet == "yes";
+}
+
+fs::path Client_options::metrics_file() const {
+	if (!contains("MetricsFile"))
+		return {};
+	return lookup_single_as<fs::path>("MetricsFile");
+}
+
+std::chrono::milliseconds Client_options::metrics_interval() const {
+	constexpr std::chrono::milliseconds default_metrics_interval{10000};
+	if (!contains("MetricsInterval"))
+		return default_metrics_interval;
+	const int interval = lookup_single_as<int>("MetricsInterval");
+	if (interval <= 0)
+		throw std::runtime_error{"MetricsInterval must be positive"};
+	return std::chrono::milliseconds{interval};
+}
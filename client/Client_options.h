@@ -2,6 +2,12 @@
 #define CLIENT_OPTIONS_H
 
 #include "../utils/Option_parser.h"
+#include "../utils/Hasher.h"
+#include "../utils/Compressor.h"
+#include "../utils/Rate_limiter.h"
+#include "../utils/Transport.h"
+
+#include <chrono>
 
 struct Client_options : private Options {
 public:
@@ -11,6 +17,35 @@ public:
 	int port() const;
 	std::vector<std::filesystem::path> sync_path() const;
 	std::filesystem::path directory() const;
+	// Threads calculating checksums, defaults to the number of cores
+	size_t hash_threads() const;
+	// Checksum algorithm, best_hash_algorithm() when not set or "auto"
+	Hash_algorithm hash_algorithm() const;
+	// Files at least this large are sent as deltas of content-defined chunks
+	uint64_t delta_threshold() const;
+	// Files smaller than this are sent whole, packed many to a frame
+	uint64_t pack_threshold() const;
+	// Connections files are uploaded over, at least 1
+	size_t streams() const;
+	// Socket buffer sizes, corking and zero-copy sends of the uploads
+	Socket_tuning socket_tuning() const;
+	// Rates bytes are sent and files read at, by time of day, unlimited when not set
+	Rate_schedule network_schedule() const;
+	Rate_schedule disk_read_schedule() const;
+	// Compression level of file contents, 0 sends them as they are
+	int compression_level() const;
+	// Name the server keeps this client's files under, defaults to the host name
+	std::string client_id() const;
+	// How long changes must settle in watch mode before they are backed up
+	std::chrono::milliseconds watch_delay() const;
+	// Longest changes are gathered for while they keep coming
+	std::chrono::milliseconds watch_max_delay() const;
+	// Leave out the lines printed for each file
+	bool quiet() const;
+	// Where metrics are appended as JSON lines, empty for nowhere
+	std::filesystem::path metrics_file() const;
+	// How often they are
+	std::chrono::milliseconds metrics_interval() const;
 };
 
 #endif
@@ -0,0 +1,88 @@
+#include "Client_state.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Layout of a File_state in the index
+struct Record {
+	uint64_t size;
+	int64_t mtime_ns;
+	uint64_t inode;
+	int64_t ctime_ns;
+	uint64_t checksum;
+	uint8_t algorithm;
+	uint8_t reserved[7];
+};
+
+int64_t nanoseconds(const timespec& t) {
+	return int64_t{t.tv_sec} * 1'000'000'000 + t.tv_nsec;
+}
+
+}
+
+File_state stat_file(const fs::path& file) {
+	struct stat st;
+	if (stat(file.c_str(), &st) == -1)
+		throw std::runtime_error{"failed stat() on " + file.string() + ' ' + std::to_string(errno)};
+	return file_state(st);
+}
+
+File_state file_state(const struct stat& st) {
+	File_state s;
+	s.size = st.st_size;
+	s.mtime_ns = nanoseconds(st.st_mtim);
+	s.inode = st.st_ino;
+	s.ctime_ns = nanoseconds(st.st_ctim);
+	return s;
+}
+
+bool unchanged(const File_state& stored, const File_state& current) {
+	return stored.size == current.size
+		&& stored.mtime_ns == current.mtime_ns
+		&& stored.inode == current.inode
+		&& stored.ctime_ns == current.ctime_ns;
+}
+
+Client_state::Client_state(const fs::path& path) : index{path, sizeof(Record)} {}
+
+std::optional<File_state> Client_state::find(std::string_view file) const {
+	const std::optional<std::string_view> value = index.find(file);
+	if (!value)
+		return std::nullopt;
+	Record r;
+	std::memcpy(&r, value->data(), sizeof(r));
+	File_state s;
+	s.size = r.size;
+	s.mtime_ns = r.mtime_ns;
+	s.inode = r.inode;
+	s.ctime_ns = r.ctime_ns;
+	s.checksum = {static_cast<Hash_algorithm>(r.algorithm), r.checksum};
+	return s;
+}
+
+void Client_state::put(std::string_view file, const File_state& s) {
+	Record r{};
+	r.size = s.size;
+	r.mtime_ns = s.mtime_ns;
+	r.inode = s.inode;
+	r.ctime_ns = s.ctime_ns;
+	r.checksum = s.checksum.value;
+	r.algorithm = static_cast<uint8_t>(s.checksum.algorithm);
+	index.put(file, {reinterpret_cast<const char*>(&r), sizeof(r)});
+}
+
+void Client_state::erase(std::string_view file) {
+	index.erase(file);
+}
+
+void Client_state::for_each_path(const std::function<void(std::string_view)>& f) const {
+	index.for_each([&](std::string_view key, std::string_view) {
+		f(key);
+	});
+}
@@ -0,0 +1,47 @@
+#ifndef CLIENT_STATE_H
+#define CLIENT_STATE_H
+
+#include "../utils/Hasher.h"
+#include "../utils/Mapped_index.h"
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string_view>
+
+// What was known about a file when its checksum was calculated
+struct File_state {
+	uint64_t size = 0;
+	int64_t mtime_ns = 0;
+	uint64_t inode = 0;
+	int64_t ctime_ns = 0;
+	Checksum checksum;
+};
+
+// Stats a file, leaving the checksum unset
+File_state stat_file(const std::filesystem::path&);
+File_state file_state(const struct stat&);
+// Whether a file looks untouched since its stored state, without reading it.
+// The ctime catches writes that restored the mtime, the inode replaced files.
+bool unchanged(const File_state& stored, const File_state& current);
+
+// Files seen by previous runs, by local path
+class Client_state {
+public:
+	explicit Client_state(const std::filesystem::path& path);
+
+	std::optional<File_state> find(std::string_view path) const;
+	void put(std::string_view path, const File_state&);
+	void erase(std::string_view path);
+	void for_each_path(const std::function<void(std::string_view)>&) const;
+	size_t size() const { return index.size(); }
+	// Make updates durable, compacting the index now and then
+	void checkpoint() { index.checkpoint(); }
+private:
+	Mapped_index index;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "Watcher.h"
+#include "../utils/Walker.h"
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+}
+
+Watcher::Watcher(const std::vector<fs::path>& r) : roots{r} {
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error{"failed inotify_init1() " + std::to_string(errno)};
+	try {
+		for (const fs::path& root : roots)
+			watch_tree(root, nullptr);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+}
+
+Watcher::~Watcher() {
+	close(fd);
+}
+
+void Watcher::watch_directory(const fs::path& dir) {
+	int wd = inotify_add_watch(fd, dir.c_str(), watch_mask);
+	if (wd == -1) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return;		// Gone already
+		if (errno == ENOSPC)
+			throw std::runtime_error{"out of inotify watches, raise fs.inotify.max_user_watches"};
+		throw std::runtime_error{"failed inotify_add_watch() on " + dir.string() + ' ' + std::to_string(errno)};
+	}
+	directories[wd] = dir;
+}
+
+void Watcher::watch_tree(const fs::path& dir, Changes* found) {
+	watch_directory(dir);
+	Walk_result walked;
+	try {
+		walked = walk({dir}, std::thread::hardware_concurrency());
+	} catch (const std::runtime_error&) {
+		return;		// Gone already
+	}
+	for (const fs::path& d : walked.directories)
+		watch_directory(d);
+	if (found)
+		for (Walked_file& f : walked.files)
+			found->paths.insert(std::move(f.path));
+}
+
+bool Watcher::read_events(Changes& changes) {
+	alignas(inotify_event) char buf[64 * 1024];
+	bool any = false;
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return any;
+		if (n <= 0)
+			throw std::runtime_error{"failed read() on inotify " + std::to_string(errno)};
+		any = true;
+		for (char* p = buf; p < buf + n; ) {
+			const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+			p += sizeof(inotify_event) + e->len;
+			if (e->mask & IN_Q_OVERFLOW) {
+				changes.rescan = true;
+				continue;
+			}
+			auto it = directories.find(e->wd);
+			if (it == directories.cend())
+				continue;
+			if (e->mask & IN_IGNORED) {
+				directories.erase(it);
+				continue;
+			}
+			if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+				// The files under it are gone without events of their own
+				changes.rescan = true;
+				continue;
+			}
+			if (e->len == 0)
+				continue;
+			const fs::path path = it->second / e->name;
+			if (!(e->mask & IN_ISDIR))
+				changes.paths.insert(path);
+			else if (e->mask & (IN_CREATE | IN_MOVED_TO))
+				watch_tree(path, &changes);
+			else if (e->mask & IN_MOVED_FROM)
+				changes.rescan = true;
+		}
+	}
+}
+
+Watcher::Changes Watcher::wait(std::chrono::milliseconds settle, std::chrono::milliseconds max_delay) {
+	using Clock = std::chrono::steady_clock;
+	Changes changes;
+	pollfd p{fd, POLLIN, 0};
+	bool started = false;
+	Clock::time_point deadline;
+	// Block for the first event, then until things calm down,
+	// or they've kept coming until the deadline
+	for (;;) {
+		int timeout = -1;
+		if (started) {
+			const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+			if (left.count() <= 0)
+				break;
+			timeout = std::min(settle, left).count();
+		}
+		int status = poll(&p, 1, timeout);
+		if (status == -1 && errno == EINTR)
+			continue;
+		if (status == -1)
+			throw std::runtime_error{"failed poll() " + std::to_string(errno)};
+		if (status == 0 || !read_events(changes)) {
+			if (started)
+				break;
+		} else if (!started) {
+			started = true;
+			deadline = Clock::now() + max_delay;
+		}
+	}
+	// Directories created while events were lost have no watch yet,
+	// those already watched keep theirs
+	if (changes.rescan)
+		for (const fs::path& root : roots)
+			watch_tree(root, nullptr);
+	return changes;
+}
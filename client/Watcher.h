@@ -0,0 +1,41 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <chrono>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Watches directory trees with inotify and reports changed files,
+// so a resident client doesn't have to rescan unchanged trees
+class Watcher {
+public:
+	struct Changes {
+		std::unordered_set<std::filesystem::path> paths;	// Written, created, moved or deleted
+		bool rescan = false;	// Events were lost, or a directory went away
+	};
+
+	explicit Watcher(const std::vector<std::filesystem::path>& roots);
+	~Watcher();
+
+	Watcher(const Watcher&) = delete;
+	Watcher& operator=(const Watcher&) = delete;
+
+	// Blocks until something changes, then gathers changes
+	// until none arrive for the settle time, or for max_delay at most
+	Changes wait(std::chrono::milliseconds settle, std::chrono::milliseconds max_delay);
+private:
+	// Watch a directory and those under it, reporting the files found in them
+	// when given changes, for directories that appeared after watching began
+	void watch_tree(const std::filesystem::path& dir, Changes* found);
+	void watch_directory(const std::filesystem::path& dir);
+	// Handle every queued event, false if there were none
+	bool read_events(Changes&);
+
+	std::vector<std::filesystem::path> roots;
+	int fd = -1;
+	std::unordered_map<int, std::filesystem::path> directories;	// By watch descriptor
+};
+
+#endif
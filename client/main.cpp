@@ -5,6 +5,7 @@
 #include <cerrno>
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <iostream>
 #include <stdexcept>
@@ -12,239 +13,182 @@
 #include <filesystem>
 #include <fstream>
 #include <unordered_set>
+#include <unordered_map>
 #include <vector>
 #include <set>
 #include <algorithm>
 #include <map>
-#include <sstream>
-#include <format>
-#include <chrono>
-#include <boost/crc.hpp>
+#include <optional>
 
 #include "Client_options.h"
-#include "../utils/Path_handler.h"
+#include "Checksum_engine.h"
+#include "Backup_session.h"
+#include "Client_state.h"
+#include "Watcher.h"
+#include "../utils/Log.h"
+#include "../utils/Metrics.h"
+#include "../utils/Path_pool.h"
+#include "../utils/Rate_limiter.h"
+#include "../utils/Walker.h"
 
 namespace fs = std::filesystem;
 
-std::vector<fs::path>
-recursive_directory_search(const fs::path& p) {
-	std::vector<fs::path> entries;
-	for (fs::recursive_directory_iterator it{p};
-		it != fs::recursive_directory_iterator{};
-		++it) {
-		// Only return files, not directories, as directories don't
-		// have checksum values, and it would mess with the parsing
-		if (!fs::is_directory(*it) && fs::is_regular_file(*it))
-			entries.push_back(*it);
+int connect_to_server(const Client_options& options) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		throw std::runtime_error{"socket error"};
+	try {
+		tune_socket(fd, options.socket_tuning());
+	} catch (...) {
+		close(fd);
+		throw;
 	}
-	return entries;
-}
-
-std::vector<fs::path> get_directory_entries
-(const fs::path& p) {
-	return recursive_directory_search(p);
-}
 
-uint32_t get_crc32(const std::string& s) {
-	boost::crc_32_type value;
-	value.process_bytes(s.data(), s.size());
-	return value.checksum();
-}
-
-uint32_t get_crc32_from_file(const fs::path& path) {
-	constexpr size_t bufsize = 4096;
-	std::ifstream is{path, std::ios_base::binary};
-	if (!is)
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(options.port());
+	addr.sin_addr.s_addr = inet_addr(options.server_ip().c_str());
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr),
+			sizeof(addr)) == -1) {
+		int err = errno;
+		close(fd);
 		throw std::runtime_error{
-			"can't open "
-			+ path.string()
-			+ " for reading"
+			"failed connect() " + std::to_string(err)
 		};
-	boost::crc_32_type value;
-	char buffer[bufsize];
-	while (is.read(buffer, bufsize))
-		value.process_bytes(buffer, is.gcount());
-	if (is.gcount() > 0)
-		value.process_bytes(buffer, is.gcount());
-	return value.checksum();
-}
-
-void send_message(int fd, const std::string& msg) {
-	send(fd, msg.c_str(), msg.size(), MSG_CONFIRM);
-	send(fd, "\0", 1, MSG_CONFIRM);	// END TRANSMISSION
-}
-
-std::unordered_map<fs::path, uint32_t> checksums_for_directory_entries
-(const std::vector<fs::path>& vec) {
-	std::unordered_map<fs::path, uint32_t> ret;
-	for (const fs::path& path : vec) {
-		std::vector<fs::path> paths = get_directory_entries(path);
-		for (fs::path& p : paths) {
-			// VERBOSE
-			std::cout << "Calculating " << p << '\n';
-			
-			uint32_t checksum = get_crc32_from_file(p);
-			ret.insert({std::move(p), checksum});
-		}
 	}
-	return ret;
+	return fd;
 }
 
-std::string format(const std::unordered_map<fs::path, uint32_t>& entries, const fs::path& root) {
-	std::ostringstream os;
-	for (const auto& e : entries) {
-		os << fs::relative(e.first, root)
-			<< '\t'
-			<< e.second
-			<< '\n';
+// Back up the given files, whose current state is by path id. Those whose
+// stat tuple changed since their state was stored are hashed again,
+// the others are sent with their stored checksums.
+void back_up(const Client_options& options, Client_state& state,
+		const Path_pool& paths, std::vector<File_state>& curr_data) {
+	const Hash_algorithm algorithm = options.hash_algorithm();
+	std::vector<Path_id> outdated;
+	std::vector<bool> is_outdated(paths.size());
+	for (Path_id id = 0; id < paths.size(); ++id) {
+		std::optional<File_state> prev = state.find(paths.view(id));
+		if (!prev || !unchanged(*prev, curr_data[id])
+				|| prev->checksum.algorithm != algorithm) {
+			outdated.push_back(id);
+			is_outdated[id] = true;
+		} else {
+			curr_data[id].checksum = prev->checksum;
+		}
 	}
-	return os.str();
-}
-
-std::unordered_set<fs::path> parse_message(const std::string& msg) {
-	std::istringstream is{msg};
-	std::unordered_set<fs::path> paths;
-	for (std::string s; std::getline(is, s); ) {
-		paths.insert(fs::path{s});
+	if (outdated.empty()) {
+		state.checkpoint();
+		return;
 	}
-	return paths;
-}
-
-std::string receive_message(int fd) {
-	std::string message;
-	constexpr size_t bufsize = 1024;
-	char temp_buf[bufsize]{};
-	int status = 0;
-	while ((status = read(fd, temp_buf, bufsize)) > 0) {
-		message.append(temp_buf, status);
-		if (message.find('\0') != std::string::npos) {
-			message.erase(message.size()-1);
-			break;
+	Backup_session session{[&options]{ return connect_to_server(options); }, options};
+	{
+		// Entries that didn't change are streamed right away,
+		// the rest as soon as their checksums are calculated
+		std::vector<fs::path> to_hash;
+		for (Path_id id = 0; id < paths.size(); ++id) {
+			if (!is_outdated[id]) {
+				session.add_entry(paths.view(id), curr_data[id].checksum);
+			} else {
+				to_hash.push_back(paths.path(id));
+				log_file(std::cout, "OUTDATED:\t", to_hash.back());
+			}
 		}
+		// Only outdated files need their checksums recalculated, once each
+		Checksum_engine engine{options.hash_threads(), algorithm};
+		engine.checksums(to_hash, [&](size_t i, const Checksum& checksum) {
+			const Path_id id = outdated[i];
+			curr_data[id].checksum = checksum;
+			session.add_entry(paths.view(id), checksum);
+		});
 	}
-	return message;
+	session.finish();
+	// Only once the server acknowledged the backup, so that files
+	// of an interrupted one are hashed and offered again
+	for (Path_id id : outdated)
+		if (!session.skipped(paths.view(id)))
+			state.put(paths.view(id), curr_data[id]);
+	state.checkpoint();
+	if (session.files_sent() == 0)
+		std::cout << "Local files up to date with backup.\n";
+	else
+		std::cout << session.files_sent() << " file(s) backed up.\n";
+	std::cout << "Backup complete!\n";
 }
 
-void send_files
-(int fd, const std::unordered_set<fs::path>& paths, const fs::path& sync_path) {
-	for (const fs::path& path : paths) {
-		fs::path localpath = sync_path / path;
-		std::ifstream is{localpath, std::ios_base::binary};
-		if (!is) {
-			std::cerr << path << " doesn't exist!\n";
-			continue;
-		}
-		size_t file_size = fs::file_size(localpath);
-		std::ostringstream metadata;
-		metadata << path << ' ' << file_size << '\n';
-
-		// VERBOSE
-		std::cout << "Sending " << path << " (" << file_size << " bytes)\n";
+// Scan every sync path, forgetting files that are gone
+void full_backup(const Client_options& options, Client_state& state) {
+	Path_pool paths;
+	std::vector<File_state> curr_data;
+	// One parallel walk stats the files, which go straight into the pool
+	walk(options.sync_path(), options.hash_threads(), true, [&](std::string_view path, const struct stat& st) {
+		if (paths.intern(path) == curr_data.size())
+			curr_data.push_back(file_state(st));
+	});
+	std::vector<std::string> removed;
+	state.for_each_path([&](std::string_view p) {
+		if (!paths.find(p))
+			removed.emplace_back(p);
+	});
+	for (const std::string& p : removed)
+		state.erase(p);
+	back_up(options, state, paths, curr_data);
+}
 
-		send(fd, metadata.str().c_str(), metadata.str().size(), MSG_CONFIRM);
-		constexpr size_t bufsize = 1024;
-		char buf[bufsize]{};
-		for (size_t i = 0; i < file_size; i += bufsize) {
-			is.read(buf, bufsize);
-			send(fd, buf, is.gcount(), MSG_CONFIRM);
+// Back up files as the watcher reports changes to them, for good.
+// Failed backups are retried with the next change.
+void watch(const Client_options& options, Client_state& state, Watcher& watcher) {
+	std::unordered_set<fs::path> dirty;
+	bool rescan = false;
+	for (;;) {
+		Watcher::Changes changes = watcher.wait(options.watch_delay(), options.watch_max_delay());
+		dirty.merge(changes.paths);
+		rescan = rescan || changes.rescan;
+		try {
+			if (rescan) {
+				full_backup(options, state);
+			} else {
+				Path_pool paths;
+				std::vector<File_state> curr_data;
+				for (const fs::path& p : dirty) {
+					std::error_code ec;
+					if (!fs::is_regular_file(p, ec))
+						state.erase(p.native());
+					else if (paths.intern(p.native()) == curr_data.size())
+						curr_data.push_back(stat_file(p));
+				}
+				back_up(options, state, paths, curr_data);
+			}
+			dirty.clear();
+			rescan = false;
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << '\n';
 		}
 	}
 }
 
-int main(/*int argc, char* argv[]*/) try {
+int main(int argc, char* argv[]) try {
 	const fs::path config_path = "./config.txt";
-	const fs::path filedata_path = "./filedata.txt";
+	const fs::path state_path = "./client_state.idx";
+	// With --watch, the client stays resident and backs up changes as they happen
+	const bool watch_mode = argc > 1 && std::string{argv[1]} == "--watch";
 	const Client_options options{parse_options(config_path)};
-	Path_handler phandler(options.sync_path(), options.directory());
-	for (const fs::path& p : options.sync_path())
-		add_recursively(phandler, p);
-	std::unordered_map<fs::path, std::pair<std::string, std::string>> curr_data;
-	for (size_t i = 0; i < phandler.size(); ++i) {
-		const fs::path& curr_path = phandler.entry(i);
-		std::string time = std::format("{0:%F}/{0:%T}", fs::last_write_time(curr_path));
-		curr_data[curr_path] = std::make_pair(time, std::string{});
-	}
-	std::unordered_map<fs::path, std::pair<std::string, std::string>> prev_data;
-	std::unordered_set<fs::path> outdated;
-	if (!fs::exists(filedata_path)) {
-		std::ofstream os{filedata_path};
-		for (const auto& p : curr_data) {
-			outdated.insert(p.first);
-			os << p.first << '\t' << p.second.first << '\n';
-		}
-	} else {
-		std::ifstream is{filedata_path};
-		for (std::string line; std::getline(is, line); ) {
-			std::istringstream iss{line};
-			fs::path p;
-			std::string t;
-			std::string c;
-			if (iss >> p >> t >> c) {
-				prev_data[p] = std::make_pair(t, c);
-			}
-		}
-		for (const auto& p : curr_data) {
-			auto it = prev_data.find(p.first);
-			if (it == prev_data.cend() || it->second.first != p.second.first) {
-				outdated.insert(p.first);
-			}
-		}
-	}
-	if (outdated.empty())
+	set_quiet(options.quiet());
+	network_limit().set_schedule(options.network_schedule());
+	disk_read_limit().set_schedule(options.disk_read_schedule());
+	// Dumped periodically, and once more as the client exits
+	std::optional<Metrics_dump> dump;
+	if (!options.metrics_file().empty())
+		dump.emplace(options.metrics_file(), options.metrics_interval());
+	Client_state state{state_path};
+	if (!watch_mode) {
+		full_backup(options, state);
 		return 0;
-	std::unordered_map<fs::path, std::pair<std::string, std::string>> up_to_date;
-	{
-		std::ofstream os{filedata_path};
-		for (const fs::path& p : outdated) {
-			std::cout << "OUTDATED:\t" << p << '\n';
-		}
-		// Write current data into filedata file
-		for (const auto& p : curr_data) {
-			auto it = outdated.find(p.first);
-			if (it == outdated.cend()) {
-				auto it2 = prev_data.find(p.first);
-				up_to_date[p.first] = std::make_pair(it2->second.first, it2->second.second);
-				os << p.first << '\t' << it2->second.first << '\t' << it2->second.second << '\n';
-			} else {
-				up_to_date[p.first] = std::make_pair(p.second.first, std::to_string(get_crc32_from_file(p.first)));
-				os << p.first << '\t' << p.second.first << '\t' << get_crc32_from_file(p.first) << '\n';
-			}
-		}
 	}
-	/*
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd == -1)
-		throw std::runtime_error{"socket error"};
-
-	sockaddr_in addr{};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(options.port());
-	addr.sin_addr.s_addr = inet_addr(options.server_ip().c_str());
-	if (connect(fd, reinterpret_cast<sockaddr*>(&addr),
-			sizeof(addr)) == -1) {
-		int err = errno;
-		throw std::runtime_error{
-			"failed connect() " + std::to_string(err)
-		};
-	}
-	*/
-	for (const auto& p : up_to_date)
-		std::cout << "SEND:\t" << p.first << '\t' << p.second.second << '\n';
-/*	send_message(fd, send_text);
-	
-	std::string received = receive_message(fd);
-	std::set<fs::path> outdated = parse_message(received);
-	if (outdated.empty()) {
-		std::cout << "Local files up to date with backup.\n";
-	} else {
-		std::cout << outdated.size() << " file(s) to backup.\n";
-		send_files(fd, outdated, options.sync_path());
-	}
-	
-	shutdown(fd, SHUT_WR);
-	close(fd);
-	std::cout << "Backup complete!\n";
-*/
+	// Watching starts before the first scan, so no change slips in between
+	Watcher watcher{options.sync_path()};
+	full_backup(options, state);
+	watch(options, state, watcher);
 } catch (const std::exception& e) {
 	std::cerr << "error: " << e.what() << '\n';
 } catch (...) {
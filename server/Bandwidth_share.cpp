@@ -0,0 +1,86 @@
+#include "Bandwidth_share.h"
+
+#include <algorithm>
+
+namespace {
+
+// Sessions that wanted to receive this recently still count as busy
+constexpr std::chrono::milliseconds busy_window{200};
+// Not worth a read below this, unless that's all a session wants
+constexpr size_t min_grant = 16 * 1024;
+
+// What the bucket holds at most, an eighth of a second's worth
+double burst_of(uint64_t rate) {
+	return std::max<double>(rate / 8, 2 * min_grant);
+}
+
+}
+
+Bandwidth_share::Bandwidth_share(Rate_schedule s) : limited{s.limits()}, schedule{std::move(s)} {}
+
+Bandwidth_share::Share::Share(Bandwidth_share& b) : owner{b} {
+	std::lock_guard<std::mutex> lock{owner.m};
+	owner.shares.push_back(this);
+}
+
+Bandwidth_share::Share::~Share() {
+	std::lock_guard<std::mutex> lock{owner.m};
+	owner.shares.erase(std::find(owner.shares.begin(), owner.shares.end(), this));
+}
+
+size_t Bandwidth_share::Share::grant(size_t want, Clock::time_point& resume_at) {
+	if (!owner.limited.load(std::memory_order_relaxed))
+		return want;
+	std::lock_guard<std::mutex> lock{owner.m};
+	const Clock::time_point now = Clock::now();
+	if (now >= owner.next_check) {
+		owner.rate = owner.schedule.rate_at(std::chrono::system_clock::now());
+		owner.next_check = now + std::chrono::seconds{1};
+	}
+	if (owner.rate == 0)
+		return want;
+	last_wanted = now;
+
+	using Seconds = std::chrono::duration<double>;
+	const double rate = owner.rate;
+	const double burst = burst_of(owner.rate);
+	owner.tokens = std::min(burst, owner.tokens + rate * Seconds{now - owner.refilled}.count());
+	owner.refilled = now;
+	// An equal part of the rate, and of the burst
+	const size_t n = owner.busy(now);
+	const double share_rate = rate / n;
+	const double share_burst = std::max<double>(burst / n, min_grant);
+	tokens = std::min(share_burst, tokens + share_rate * Seconds{now - refilled}.count());
+	refilled = now;
+
+	const double need = std::min(want, min_grant);
+	const double available = std::min(tokens, owner.tokens);
+	if (available < need) {
+		// Until both this session's part and the whole have enough
+		const double wait = std::max((need - tokens) / share_rate, (need - owner.tokens) / rate);
+		resume_at = now + std::max(std::chrono::duration_cast<Clock::duration>(Seconds{wait}),
+			Clock::duration{std::chrono::milliseconds{1}});
+		last_wanted = resume_at;	// Still busy while it waits
+		return 0;
+	}
+	const size_t allowed = std::min<double>(want, available);
+	tokens -= allowed;
+	owner.tokens -= allowed;
+	return allowed;
+}
+
+void Bandwidth_share::Share::refund(size_t n) {
+	if (n == 0 || !owner.limited.load(std::memory_order_relaxed))
+		return;
+	std::lock_guard<std::mutex> lock{owner.m};
+	tokens += n;
+	owner.tokens += n;
+}
+
+size_t Bandwidth_share::busy(Clock::time_point now) const {
+	size_t n = 0;
+	for (const Share* s : shares)
+		if (s->last_wanted + busy_window >= now)
+			++n;
+	return std::max<size_t>(n, 1);
+}
@@ -0,0 +1,64 @@
+#ifndef BANDWIDTH_SHARE_H
+#define BANDWIDTH_SHARE_H
+
+#include "../utils/Rate_limiter.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Limit on the bytes the server receives, shared fairly among the sessions
+// receiving at the same time: each busy session gets an equal part of the
+// rate, the whole of it while alone, and all of them together no more than
+// it. Sessions are never blocked, they are told when to read again instead.
+class Bandwidth_share {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Unlimited
+	Bandwidth_share() = default;
+	explicit Bandwidth_share(Rate_schedule);
+
+	Bandwidth_share(const Bandwidth_share&) = delete;
+	Bandwidth_share& operator=(const Bandwidth_share&) = delete;
+
+	// The part of one session
+	class Share {
+	public:
+		explicit Share(Bandwidth_share&);
+		~Share();
+
+		Share(const Share&) = delete;
+		Share& operator=(const Share&) = delete;
+
+		// Bytes that may be received now, up to want. 0 when over the
+		// limit, with when to try again in resume_at.
+		size_t grant(size_t want, Clock::time_point& resume_at);
+		// Give back what was granted but not received
+		void refund(size_t);
+	private:
+		friend class Bandwidth_share;
+
+		Bandwidth_share& owner;
+		double tokens = 0;
+		Clock::time_point refilled;
+		Clock::time_point last_wanted;
+	};
+private:
+	// Sessions that wanted to receive within the window, with m held
+	size_t busy(Clock::time_point now) const;
+
+	std::atomic<bool> limited{false};
+	std::mutex m;
+	Rate_schedule schedule;
+	uint64_t rate = 0;
+	Clock::time_point next_check;
+	double tokens = 0;
+	Clock::time_point refilled;
+	std::vector<Share*> shares;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "Checksum_index.h"
+#include "Checksums.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Layout of a checksum in the index
+struct Record {
+	uint64_t value;
+	uint8_t algorithm;
+	uint8_t reserved[7];
+};
+
+bool valid_client_id(const std::string& id) {
+	constexpr size_t max_length = 128;
+	if (id.empty() || id.size() > max_length || id[0] == '.')
+		return false;
+	return std::all_of(id.cbegin(), id.cend(), [](char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+			|| c == '.' || c == '_' || c == '-';
+	});
+}
+
+}
+
+Client_checksums::Client_checksums(const fs::path& path) : index{path, sizeof(Record)} {}
+
+std::optional<Checksum> Client_checksums::find(const fs::path& relative) {
+	std::lock_guard<std::mutex> lock{m};
+	const std::optional<std::string_view> value = index.find(relative.generic_string());
+	if (!value)
+		return std::nullopt;
+	Record r;
+	std::memcpy(&r, value->data(), sizeof(r));
+	return Checksum{static_cast<Hash_algorithm>(r.algorithm), r.value};
+}
+
+void Client_checksums::put(const fs::path& relative, const Checksum& checksum) {
+	Record r{};
+	r.value = checksum.value;
+	r.algorithm = static_cast<uint8_t>(checksum.algorithm);
+	std::lock_guard<std::mutex> lock{m};
+	index.put(relative.generic_string(), {reinterpret_cast<const char*>(&r), sizeof(r)});
+}
+
+size_t Client_checksums::size() {
+	std::lock_guard<std::mutex> lock{m};
+	return index.size();
+}
+
+void Client_checksums::checkpoint() {
+	std::lock_guard<std::mutex> lock{m};
+	index.checkpoint();
+}
+
+Checksum_index::Checksum_index(fs::path r) : root{std::move(r)} {
+	fs::create_directories(root);
+}
+
+std::shared_ptr<Client_checksums> Checksum_index::open(const std::string& client_id) {
+	if (!valid_client_id(client_id))
+		throw std::runtime_error{"invalid client id \"" + client_id + '"'};
+	std::lock_guard<std::mutex> lock{m};
+	std::shared_ptr<Client_checksums>& c = clients[client_id];
+	if (c)
+		return c;
+	c = std::make_shared<Client_checksums>(root / (client_id + ".idx"));
+	return c;
+}
+
+void Checksum_index::import_legacy(const fs::path& legacy_file, const std::string& client_id,
+		const std::function<void(const fs::path&)>& adopt) {
+	const std::shared_ptr<Client_checksums> c = open(client_id);
+	const std::set<Entry, Compare> entries = parse_file(legacy_file);
+	// Safe to repeat until the file is renamed, if interrupted
+	size_t imported = 0;
+	for (const Entry& e : entries) {
+		// Only paths a client could have sent
+		const fs::path path = e.path.lexically_normal();
+		if (path.empty() || path.is_absolute() || *path.begin() == "..")
+			continue;
+		adopt(path);
+		c->put(path, e.checksum);
+		++imported;
+	}
+	c->checkpoint();
+	fs::path renamed = legacy_file;
+	renamed += ".imported";
+	fs::rename(legacy_file, renamed);
+	std::cout << "Imported " << imported << " checksum(s) of " << legacy_file.string()
+		<< " for " << client_id << '\n';
+}
@@ -0,0 +1,49 @@
+#ifndef CHECKSUM_INDEX_H
+#define CHECKSUM_INDEX_H
+
+#include "../utils/Hasher.h"
+#include "../utils/Mapped_index.h"
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Checksums of the files one client backed up, by remote path.
+// Shared by the sessions of the client, so every call locks.
+class Client_checksums {
+public:
+	explicit Client_checksums(const std::filesystem::path& path);
+
+	std::optional<Checksum> find(const std::filesystem::path& relative);
+	void put(const std::filesystem::path& relative, const Checksum&);
+	size_t size();
+	// Make updates durable, compacting the index now and then
+	void checkpoint();
+private:
+	std::mutex m;
+	Mapped_index index;
+};
+
+// One checksum index per client, under a common directory
+class Checksum_index {
+public:
+	explicit Checksum_index(std::filesystem::path root);
+
+	// Throws on identifiers that aren't safe file names
+	std::shared_ptr<Client_checksums> open(const std::string& client_id);
+	// Seed the index of one client with the checksums of the file kept
+	// before clients had ids, then rename it, so that happens only once.
+	// Each file is handed to adopt before its checksum is stored.
+	void import_legacy(const std::filesystem::path& legacy_file, const std::string& client_id,
+			const std::function<void(const std::filesystem::path&)>& adopt);
+private:
+	std::filesystem::path root;
+	std::mutex m;
+	std::unordered_map<std::string, std::shared_ptr<Client_checksums>> clients;
+};
+
+#endif
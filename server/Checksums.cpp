@@ -0,0 +1,27 @@
+#include "Checksums.h"
+
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+std::set<Entry, Compare> parse(std::istream& is) {
+	std::set<Entry, Compare> entries;
+	fs::path path;
+	Checksum checksum;
+	while (is >> path >> checksum) {
+		entries.insert(Entry{std::move(path), checksum});
+	}
+	return entries;
+}
+
+std::set<Entry, Compare> parse(const std::string& s) {
+	std::istringstream is{s};
+	return parse(is);
+}
+
+std::set<Entry, Compare> parse_file(const fs::path& filepath) {
+	std::ifstream is{filepath};
+	return parse(is);
+}
@@ -0,0 +1,27 @@
+#ifndef CHECKSUMS_H
+#define CHECKSUMS_H
+
+#include <filesystem>
+#include <istream>
+#include <set>
+#include <string>
+
+#include "../utils/Hasher.h"
+
+struct Entry {
+	std::filesystem::path path;
+	Checksum checksum;
+};
+
+struct Compare {
+	bool operator()(const Entry& a, const Entry& b) const {
+		return a.path < b.path;
+	}
+};
+
+// Parse "path algorithm:checksum" pairs, as stored in the checksum file of older versions
+std::set<Entry, Compare> parse(std::istream&);
+std::set<Entry, Compare> parse(const std::string&);
+std::set<Entry, Compare> parse_file(const std::filesystem::path&);
+
+#endif
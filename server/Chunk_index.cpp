@@ -0,0 +1,88 @@
+#include "Chunk_index.h"
+#include "../utils/Frame.h"
+
+#include <sys/stat.h>
+
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Identifies a version of a backed up file
+struct File_stamp {
+	uint64_t size = 0;
+	uint64_t mtime_ns = 0;
+};
+
+bool stamp(const fs::path& file, File_stamp& s) {
+	struct stat st;
+	if (stat(file.c_str(), &st) == -1)
+		return false;
+	s.size = st.st_size;
+	s.mtime_ns = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	return true;
+}
+
+}
+
+fs::path Chunk_index::list_path(const fs::path& relative) const {
+	fs::path p = root / relative;
+	p += ".chunks";
+	return p;
+}
+
+std::vector<Chunk> Chunk_index::load(const fs::path& relative, const fs::path& file) const {
+	std::ifstream is{list_path(relative), std::ios_base::binary};
+	File_stamp current;
+	if (!is || !stamp(file, current))
+		return {};
+	const std::string data{std::istreambuf_iterator<char>{is}, {}};
+	try {
+		Payload_reader r{data};
+		if (r.u64() != current.size || r.u64() != current.mtime_ns)
+			return {};
+		const uint32_t count = r.u32();
+		std::vector<Chunk> chunks;
+		uint64_t offset = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			Chunk c;
+			c.offset = offset;
+			c.length = r.u32();
+			r.bytes(c.digest.data(), c.digest.size());
+			offset += c.length;
+			chunks.push_back(c);
+		}
+		r.finish();
+		if (offset != current.size)
+			return {};
+		return chunks;
+	} catch (const std::runtime_error&) {
+		return {};	// Corrupt list, the file is sent whole
+	}
+}
+
+void Chunk_index::store(const fs::path& relative, const fs::path& file,
+		const std::vector<Chunk>& chunks) const {
+	File_stamp s;
+	if (!stamp(file, s))
+		throw std::runtime_error{"can't stat " + file.string()};
+	Payload_writer w;
+	w.u64(s.size).u64(s.mtime_ns).u32(chunks.size());
+	for (const Chunk& c : chunks)
+		w.u32(c.length).bytes(c.digest.data(), c.digest.size());
+	const fs::path p = list_path(relative);
+	fs::create_directories(p.parent_path());
+	std::ofstream os{p, std::ios_base::binary};
+	const std::string data = w.payload();
+	if (!os.write(data.data(), data.size()))
+		throw std::runtime_error{"can't write " + p.string()};
+}
+
+void Chunk_index::remove(const fs::path& relative) const {
+	std::error_code ec;
+	fs::remove(list_path(relative), ec);
+}
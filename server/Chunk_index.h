@@ -0,0 +1,28 @@
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include "../utils/Chunker.h"
+
+#include <filesystem>
+#include <vector>
+
+// Chunk lists of backed up files, kept in a tree beside the backup,
+// so that chunks of the previous version of a file can be reused
+class Chunk_index {
+public:
+	explicit Chunk_index(std::filesystem::path r) : root{std::move(r)} {}
+
+	// Chunks of a backed up file, empty when unknown,
+	// or when the file changed since its list was stored
+	std::vector<Chunk> load(const std::filesystem::path& relative, const std::filesystem::path& file) const;
+	void store(const std::filesystem::path& relative, const std::filesystem::path& file,
+			const std::vector<Chunk>&) const;
+	// Forget the list of a file that was replaced whole
+	void remove(const std::filesystem::path& relative) const;
+private:
+	std::filesystem::path list_path(const std::filesystem::path& relative) const;
+
+	std::filesystem::path root;
+};
+
+#endif
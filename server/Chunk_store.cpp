@@ -0,0 +1,383 @@
+#include "Chunk_store.h"
+#include "../utils/Frame.h"
+#include "../utils/Log.h"
+#include "../utils/Transfer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Journal record: digest and signed reference count change
+constexpr size_t journal_record_size = sizeof(Digest) + sizeof(int32_t);
+
+}
+
+Chunk_store::Chunk_store(fs::path r, Committer& c) : root{std::move(r)}, committer{c} {
+	fs::create_directories(root / "objects");
+	fs::create_directories(root / "recipes");
+	fs::create_directories(root / "tmp");
+	// Leftovers of interrupted chunk writes, uploads are kept under partial
+	for (const fs::directory_entry& e : fs::directory_iterator{root / "tmp"})
+		fs::remove(e.path());
+	load_journal();
+	// Reference counts must be durable before the recipes that hold them
+	committer.sync_with(journal_fd);
+}
+
+Chunk_store::~Chunk_store() {
+	if (journal_fd != -1)
+		close(journal_fd);
+}
+
+void Chunk_store::load_journal() {
+	const fs::path path = root / "refs";
+	{
+		std::ifstream is{path, std::ios_base::binary};
+		char record[journal_record_size];
+		while (is.read(record, sizeof(record))) {
+			Digest d;
+			int32_t delta = 0;
+			std::memcpy(d.data(), record, d.size());
+			std::memcpy(&delta, record + d.size(), sizeof(delta));
+			int64_t count = int64_t{refs[d]} + delta;
+			if (count > 0)
+				refs[d] = count;
+			else
+				refs.erase(d);
+		}
+	}
+	// Compact the journal into one record per chunk
+	const fs::path temp = root / "refs.tmp";
+	journal_fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (journal_fd == -1)
+		throw std::runtime_error{"can't open " + temp.string() + " for writing"};
+	std::vector<std::pair<Digest, int32_t>> records;
+	for (const auto& [d, count] : refs)
+		records.emplace_back(d, count);
+	journal(records);
+	if (fsync(journal_fd) == -1)
+		throw std::runtime_error{"failed fsync() " + std::to_string(errno)};
+	close(journal_fd);
+	fs::rename(temp, path);
+	journal_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (journal_fd == -1)
+		throw std::runtime_error{"can't open " + path.string() + " for writing"};
+}
+
+void Chunk_store::journal(const std::vector<std::pair<Digest, int32_t>>& changes) {
+	std::string data;
+	data.reserve(changes.size() * journal_record_size);
+	for (const auto& [d, delta] : changes) {
+		data.append(reinterpret_cast<const char*>(d.data()), d.size());
+		data.append(reinterpret_cast<const char*>(&delta), sizeof(delta));
+	}
+	write_all(journal_fd, data.data(), data.size());
+}
+
+fs::path Chunk_store::object_path(const Digest& d) const {
+	const std::string hex = to_hex(d);
+	return root / "objects" / hex.substr(0, 2) / hex.substr(2);
+}
+
+fs::path Chunk_store::recipe_path(const fs::path& relative) const {
+	fs::path p = root / "recipes" / relative;
+	p += ".recipe";
+	return p;
+}
+
+fs::path Chunk_store::partial_path(const fs::path& relative) const {
+	// Outside tmp, which is emptied at startup
+	fs::path p = root / "partial" / relative;
+	p += ".partial";
+	return p;
+}
+
+fs::path Chunk_store::temp_path() {
+	return root / "tmp" / std::to_string(temp_count++);
+}
+
+bool Chunk_store::stored(const Digest& d) const {
+	return refs.count(d) > 0 && pending.count(d) == 0 && missing.count(d) == 0;
+}
+
+bool Chunk_store::acquire_if_present(const Digest& d) {
+	std::lock_guard<std::mutex> lock{m};
+	// Not while its file may yet fail to be put in place
+	if (!stored(d))
+		return false;
+	++refs[d];
+	journal({{d, 1}});
+	return true;
+}
+
+void Chunk_store::put(const Digest& d, const char* data, size_t n, std::function<void()> lost) {
+	if (acquire_if_present(d))
+		return;
+	// Write outside the lock, then publish the chunk with a rename
+	const fs::path temp = temp_path();
+	const fs::path path = object_path(d);
+	fs::create_directories(path.parent_path());
+	int fd = open_for_writing(temp);
+	try {
+		write_all(fd, data, n);
+	} catch (...) {
+		close(fd);
+		fs::remove(temp);
+		throw;
+	}
+	// The reference is journaled right away, as the journal is synced
+	// before the recipes that count on it. Should the chunk be lost,
+	// its holder drops it.
+	bool in_place = false;
+	{
+		std::lock_guard<std::mutex> lock{m};
+		in_place = stored(d);
+		++refs[d];
+		if (!in_place)
+			++pending[d];
+		journal({{d, 1}});
+	}
+	if (in_place) {
+		close(fd);
+		fs::remove(temp);	// Stored by another session meanwhile
+		return;
+	}
+	// A copy of its own otherwise, which doesn't depend on other commits.
+	// Failures thrown right away leave no reference behind.
+	try {
+		committer.commit(fd, temp, path, [this, d]{
+			std::lock_guard<std::mutex> lock{m};
+			missing.erase(d);
+			committed(d);
+		}, {}, [this, d, lost = std::move(lost)]{
+			{
+				std::lock_guard<std::mutex> lock{m};
+				// Unless another copy made it
+				if (refs.count(d) > 0 && !fs::exists(object_path(d)))
+					missing.insert(d);
+				committed(d);
+			}
+			if (lost)
+				lost();
+		});
+	} catch (...) {
+		release({d});
+		throw;
+	}
+}
+
+void Chunk_store::committed(const Digest& d) {
+	if (--pending[d] > 0)
+		return;
+	pending.erase(d);
+	// Released while in flight, so not deleted then
+	if (refs.count(d) == 0) {
+		std::error_code ec;
+		fs::remove(object_path(d), ec);
+	}
+}
+
+void Chunk_store::release(const std::vector<Digest>& digests) {
+	std::lock_guard<std::mutex> lock{m};
+	std::vector<std::pair<Digest, int32_t>> changes;
+	for (const Digest& d : digests) {
+		auto it = refs.find(d);
+		if (it == refs.end())
+			continue;
+		changes.emplace_back(d, -1);
+		if (--it->second > 0)
+			continue;
+		refs.erase(it);
+		missing.erase(d);
+		// A commit in flight would put it back after deleting it,
+		// it's deleted once that's done instead
+		if (pending.count(d) == 0) {
+			std::error_code ec;
+			fs::remove(object_path(d), ec);
+		}
+	}
+	journal(changes);
+}
+
+std::vector<Chunk> Chunk_store::recipe(const fs::path& relative) const {
+	std::ifstream is{recipe_path(relative), std::ios_base::binary};
+	if (!is)
+		return {};
+	const std::string data{std::istreambuf_iterator<char>{is}, {}};
+	Payload_reader r{data};
+	const uint32_t count = r.u32();
+	std::vector<Chunk> chunks;
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		Chunk c;
+		c.offset = offset;
+		c.length = r.u32();
+		r.bytes(c.digest.data(), c.digest.size());
+		offset += c.length;
+		chunks.push_back(c);
+	}
+	r.finish();
+	return chunks;
+}
+
+void Chunk_store::set_recipe(const fs::path& relative, const std::vector<Chunk>& chunks,
+		std::function<void()> then, std::shared_ptr<Commit_tally> tally, std::function<bool()> abandoned) {
+	// Whichever recipe doesn't end up in place has its chunks released
+	std::vector<Digest> current;
+	for (const Chunk& c : chunks)
+		current.push_back(c.digest);
+	std::vector<Digest> previous;
+	fs::path path;
+	fs::path temp;
+	int fd = -1;
+	try {
+		for (const Chunk& c : recipe(relative))
+			previous.push_back(c.digest);
+		Payload_writer w;
+		w.u32(chunks.size());
+		for (const Chunk& c : chunks)
+			w.u32(c.length).bytes(c.digest.data(), c.digest.size());
+		path = recipe_path(relative);
+		temp = temp_path();
+		fs::create_directories(path.parent_path());
+		fd = open_for_writing(temp);
+		const std::string& data = w.payload();
+		write_all(fd, data.data(), data.size());
+	} catch (...) {
+		if (fd != -1) {
+			close(fd);
+			fs::remove(temp);
+		}
+		release(current);
+		throw;
+	}
+	committer.commit(fd, temp, path, [this, previous = std::move(previous), then = std::move(then)]{
+		release(previous);
+		if (then)
+			then();
+	}, std::move(tally), [this, current = std::move(current)]{
+		release(current);
+	}, std::move(abandoned));
+}
+
+void Chunk_store::move_recipe(const fs::path& from, const fs::path& to) {
+	const fs::path from_path = recipe_path(from);
+	if (!fs::exists(from_path))
+		return;
+	const fs::path to_path = recipe_path(to);
+	fs::create_directories(to_path.parent_path());
+	fs::rename(from_path, to_path);
+}
+
+namespace {
+
+// Received into a partial file, split into chunks on commit
+class Cas_upload : public Upload {
+public:
+	// For a delta, chunks lists the whole file
+	Cas_upload(Chunk_store& s, const fs::path& r, const Checksum& checksum, std::vector<Chunk> c = {})
+		: Upload{s.partial_path(r), checksum}, store{s}, relative{r}, chunks{std::move(c)} {}
+	~Cas_upload() {
+		store.release(pinned);
+	}
+	// Pins the chunks of a delta that are stored already, and flags
+	// those to be sent, which are neither stored nor held
+	void plan(std::vector<bool>& needed) {
+		in_file.assign(chunks.size(), false);
+		needed.assign(chunks.size(), false);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			const Chunk& c = chunks[i];
+			if (store.acquire_if_present(c.digest)) {
+				pinned.push_back(c.digest);
+			} else {
+				in_file[i] = true;
+				needed[i] = c.offset + c.length > held();
+			}
+		}
+	}
+	void commit(std::function<void()> stored, std::shared_ptr<Commit_tally> tally) override {
+		const bool whole = in_file.empty();
+		if (whole) {
+			if (lseek(fd(), 0, SEEK_SET) == -1)
+				throw std::runtime_error{"failed lseek() " + std::to_string(errno)};
+			chunks = chunk_file(fd());
+			in_file.assign(chunks.size(), true);
+		}
+		size_t received = 0;
+		std::vector<char> buf;
+		// Set on the commit thread, before the recipe is done
+		auto lost = std::make_shared<std::atomic<bool>>(false);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			if (!in_file[i])
+				continue;
+			const Chunk& c = chunks[i];
+			buf.resize(c.length);
+			if (read_at(fd(), buf.data(), c.length, c.offset) != c.length
+					|| (!whole && sha256(buf.data(), buf.size()) != c.digest)) {
+				partial.discard();	// Resuming would fail the same way
+				throw std::runtime_error{relative.string() + ": chunk doesn't match its digest"};
+			}
+			store.put(c.digest, buf.data(), buf.size(), [lost]{ *lost = true; });
+			pinned.push_back(c.digest);
+			++received;
+		}
+		// Not put in place if a chunk was lost, keeping the previous recipe,
+		// and the file is asked for again next time
+		pinned.clear();	// Owned by the recipe now
+		store.set_recipe(relative, chunks, std::move(stored), std::move(tally), [lost, relative = relative]{
+			if (!*lost)
+				return false;
+			std::cerr << "error: " << relative.string() << ": chunks couldn't be stored\n";
+			return true;
+		});
+
+		// VRBOSE
+		log_file(std::clog, "Stored ", relative.string(), ": ", chunks.size(), " chunk(s), ",
+			received, " received");
+
+		partial.discard();
+	}
+private:
+	Chunk_store& store;
+	fs::path relative;
+	std::vector<Chunk> chunks;
+	std::vector<bool> in_file;	// Chunks received into the partial file
+	std::vector<Digest> pinned;	// References to release unless committed
+};
+
+}
+
+uint64_t Cas_storage::resumable(const std::string& client, const fs::path& relative,
+		const Checksum& checksum) const {
+	return Partial_file::held(store.partial_path(client_path(client, relative)), checksum);
+}
+
+std::unique_ptr<Upload> Cas_storage::begin_file(const std::string& client, const fs::path& relative,
+		const Checksum& checksum, uint64_t offset) {
+	auto upload = std::make_unique<Cas_upload>(store, client_path(client, relative), checksum);
+	upload->start_at(offset);
+	return upload;
+}
+
+std::unique_ptr<Upload> Cas_storage::begin_delta(const std::string& client, const fs::path& relative,
+		const Checksum& checksum, const std::vector<Chunk>& chunks, std::vector<bool>& needed) {
+	// Chunks stored for any file of any client are reused
+	auto upload = std::make_unique<Cas_upload>(store, client_path(client, relative), checksum, chunks);
+	upload->plan(needed);
+	return upload;
+}
+
+void Cas_storage::adopt(const std::string& client, const fs::path& relative) {
+	store.move_recipe(relative, client_path(client, relative));
+}
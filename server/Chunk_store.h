@@ -0,0 +1,93 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include "Storage.h"
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Deduplicating content-addressed store. Chunks are kept once, in files
+// named by their SHA-256, and counted by references from recipes, each of
+// which lists the chunks of one backed up file. Reference counts are
+// replayed from an append-only journal at startup. A chunk whose file is
+// still being committed isn't handed out, and isn't deleted from under it.
+class Chunk_store {
+public:
+	Chunk_store(std::filesystem::path root, Committer&);
+	~Chunk_store();
+
+	Chunk_store(const Chunk_store&) = delete;
+	Chunk_store& operator=(const Chunk_store&) = delete;
+
+	// Take a reference to a chunk, if it is stored
+	bool acquire_if_present(const Digest&);
+	// Store a chunk unless present, and take a reference to it. Should its
+	// file fail to be committed, lost runs, and the reference is to be
+	// released by its holder.
+	void put(const Digest&, const char* data, size_t n, std::function<void()> lost = {});
+	// Drop references, deleting chunks that have none left
+	void release(const std::vector<Digest>&);
+
+	std::vector<Chunk> recipe(const std::filesystem::path& relative) const;
+	// Replace the recipe of a file, taking over references to its chunks.
+	// Releases the chunks of the previous recipe once the new one is in place,
+	// then runs then. Should it fail, or be abandoned, the previous recipe
+	// stays, and the new chunks are released instead. Failures are counted
+	// in the tally.
+	void set_recipe(const std::filesystem::path& relative, const std::vector<Chunk>&,
+			std::function<void()> then = {}, std::shared_ptr<Commit_tally> tally = {},
+			std::function<bool()> abandoned = {});
+	// Move a recipe to another file, if there is one
+	void move_recipe(const std::filesystem::path& from, const std::filesystem::path& to);
+
+	// Unique path for an incoming file
+	std::filesystem::path temp_path();
+	// Where an upload of a file is received, kept if it is interrupted
+	std::filesystem::path partial_path(const std::filesystem::path& relative) const;
+private:
+	std::filesystem::path object_path(const Digest&) const;
+	std::filesystem::path recipe_path(const std::filesystem::path& relative) const;
+	void load_journal();
+	// Append reference count changes, with the mutex held
+	void journal(const std::vector<std::pair<Digest, int32_t>>&);
+	// Whether a chunk's file is in place for good, with the mutex held
+	bool stored(const Digest&) const;
+	// A commit of a chunk's file is over, with the mutex held
+	void committed(const Digest&);
+
+	std::filesystem::path root;
+	Committer& committer;
+	std::mutex m;
+	std::unordered_map<Digest, uint32_t, Digest_hash> refs;
+	// Commits of chunk files in flight, by chunk
+	std::unordered_map<Digest, uint32_t, Digest_hash> pending;
+	// Referenced chunks whose file failed to be committed
+	std::unordered_set<Digest, Digest_hash> missing;
+	int journal_fd = -1;
+	std::atomic<size_t> temp_count{0};
+};
+
+// Backend storing files as recipes of deduplicated chunks
+class Cas_storage : public Storage {
+public:
+	Cas_storage(std::filesystem::path root, Committer& c) : store{std::move(root), c} {}
+
+	uint64_t resumable(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&) const override;
+	std::unique_ptr<Upload> begin_file(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, uint64_t offset) override;
+	std::unique_ptr<Upload> begin_delta(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, const std::vector<Chunk>& chunks, std::vector<bool>& needed) override;
+	void adopt(const std::string& client, const std::filesystem::path& relative) override;
+	// Sending chunk lists lets the server skip content it already holds
+	bool prefers_chunks() const override { return true; }
+private:
+	Chunk_store store;
+};
+
+#endif
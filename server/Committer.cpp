@@ -0,0 +1,291 @@
+#include "Committer.h"
+#include "../utils/Metrics.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+Gauge& commit_queue = metrics().gauge("backup_server_commit_queue_depth",
+	"Received files waiting for the commit thread");
+Histogram& round_files = metrics().histogram("backup_server_commit_round_files",
+	"Files synced and renamed together");
+Histogram& round_latency = metrics().histogram("backup_server_commit_round_microseconds",
+	"Time to sync and rename a round of files");
+
+// Syncs in flight at once
+constexpr unsigned ring_entries = 64;
+
+void sync_directory(const fs::path& dir) {
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error{"can't open " + dir.string()};
+	const int status = fsync(fd);
+	close(fd);
+	if (status == -1)
+		throw std::runtime_error{"failed fsync() on " + dir.string() + ' ' + std::to_string(errno)};
+}
+
+}
+
+Durability parse_durability(const std::string& s) {
+	if (s == "none")
+		return Durability::none;
+	if (s == "batched")
+		return Durability::batched;
+	if (s == "per-file")
+		return Durability::per_file;
+	throw std::runtime_error{"unknown durability \"" + s + '"'};
+}
+
+uint64_t Commit_tally::wait() {
+	std::unique_lock<std::mutex> lock{m};
+	done_cv.wait(lock, [&]{ return outstanding == 0; });
+	return failed();
+}
+
+void Commit_tally::add() {
+	std::lock_guard<std::mutex> lock{m};
+	++outstanding;
+}
+
+void Commit_tally::done() {
+	{
+		std::lock_guard<std::mutex> lock{m};
+		--outstanding;
+	}
+	done_cv.notify_all();
+}
+
+Committer::Committer(Durability d, bool use_io_uring) : durability{d} {
+	if (durability != Durability::batched)
+		return;
+	if (use_io_uring) {
+		try {
+			ring = std::make_unique<Io_ring>(ring_entries);
+		} catch (const std::exception&) {
+			// Synced one after the other then
+		}
+	}
+	worker = std::thread{[this]{ run(); }};
+}
+
+Committer::~Committer() {
+	stop();
+}
+
+void Committer::stop() {
+	if (!worker.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock{m};
+		stopping = true;
+	}
+	queued_cv.notify_one();
+	worker.join();
+}
+
+void Committer::sync_with(int fd) {
+	std::lock_guard<std::mutex> lock{m};
+	journals.push_back(fd);
+}
+
+void Committer::commit(int fd, fs::path from, fs::path to, std::function<void()> then,
+		std::shared_ptr<Commit_tally> tally, std::function<void()> failed, std::function<bool()> abandoned) {
+	if (durability == Durability::batched) {
+		if (tally)
+			tally->add();
+		{
+			std::lock_guard<std::mutex> lock{m};
+			queue.push_back(Pending{fd, std::move(from), std::move(to), std::move(then), std::move(tally),
+				std::move(failed), std::move(abandoned)});
+			commit_queue.add();
+		}
+		queued_cv.notify_one();
+		return;
+	}
+	// In place before returning, failures are thrown to the caller
+	Latency_timer timer{round_latency};
+	round_files.record(1);
+	const bool sync = durability == Durability::per_file;
+	try {
+		try {
+			if (sync && !sync_journals())
+				throw std::runtime_error{"failed fdatasync() on a journal " + std::to_string(errno)};
+			if (sync && fdatasync(fd) == -1)
+				throw std::runtime_error{"failed fdatasync() on " + from.string() + ' ' + std::to_string(errno)};
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+		if (abandoned && abandoned()) {
+			std::error_code ec;
+			fs::remove(from, ec);
+			throw std::runtime_error{"abandoned " + to.string()};
+		}
+		fs::rename(from, to);
+		if (sync)
+			sync_directory(to.parent_path());
+		if (then)
+			then();
+	} catch (...) {
+		if (tally)
+			++tally->failures;
+		if (failed)
+			failed();
+		throw;
+	}
+}
+
+void Committer::run() {
+	std::vector<Pending> group;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock{m};
+			queued_cv.wait(lock, [&]{ return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			group.swap(queue);
+			commit_queue.sub(group.size());
+		}
+		round_files.record(group.size());
+		Latency_timer timer{round_latency};
+		finish(group);
+	}
+}
+
+bool Committer::sync_journals() {
+	std::lock_guard<std::mutex> lock{m};
+	for (int fd : journals)
+		if (fdatasync(fd) == -1)
+			return false;
+	return true;
+}
+
+std::vector<int> Committer::sync_all(const std::vector<int>& fds, bool datasync) {
+	std::vector<int> errors(fds.size(), 0);
+	if (!ring) {
+		for (size_t i = 0; i < fds.size(); ++i)
+			if ((datasync ? fdatasync(fds[i]) : fsync(fds[i])) == -1)
+				errors[i] = errno;
+		return errors;
+	}
+	// In waves no larger than the ring, so no completion is dropped
+	for (size_t first = 0; first < fds.size(); first += ring->size()) {
+		const size_t last = std::min<size_t>(fds.size(), first + ring->size());
+		for (size_t i = first; i < last; ++i)
+			ring->fsync(fds[i], datasync, i);
+		size_t left = last - first;
+		ring->submit(left);
+		while (left > 0) {
+			Io_ring::Completion c;
+			if (!ring->pop(c)) {
+				ring->submit(1);
+				continue;
+			}
+			if (c.result < 0)
+				errors.at(c.tag) = -c.result;
+			--left;
+		}
+	}
+	return errors;
+}
+
+void Committer::fail(Pending& p) {
+	if (p.tally)
+		++p.tally->failures;
+	if (p.failed) {
+		try {
+			p.failed();
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << '\n';
+		}
+	}
+}
+void Committer::finish(std::vector<Pending>& group) {
+	// Nothing is renamed unless its contents, and the journals it depends
+	// on, were synced, so nothing torn ever takes the place of a file.
+	// The syncs of a group are all in flight at once with io_uring.
+	std::vector<int> fds;
+	{
+		std::lock_guard<std::mutex> lock{m};
+		fds = journals;
+	}
+	const size_t journal_count = fds.size();
+	for (const Pending& p : group)
+		fds.push_back(p.fd);
+	const std::vector<int> errors = sync_all(fds, true);
+	bool journals_synced = true;
+	for (size_t i = 0; i < journal_count; ++i) {
+		if (errors[i] != 0) {
+			std::cerr << "error: failed fdatasync() on a journal " << errors[i] << '\n';
+			journals_synced = false;
+		}
+	}
+	std::vector<bool> failed(group.size(), !journals_synced);
+	for (size_t i = 0; i < group.size(); ++i) {
+		if (const int e = errors[journal_count + i]) {
+			std::cerr << "error: failed fdatasync() on " << group[i].from.string() << ' ' << e << '\n';
+			failed[i] = true;
+		}
+		close(group[i].fd);
+	}
+	// Failures are handled as soon as they're known, so that a later file
+	// of the group can be abandoned because of an earlier one
+	std::set<fs::path> directories;
+	for (size_t i = 0; i < group.size(); ++i) {
+		if (!failed[i] && group[i].abandoned && group[i].abandoned()) {
+			std::error_code ec;
+			fs::remove(group[i].from, ec);
+			failed[i] = true;
+		}
+		if (!failed[i]) {
+			std::error_code ec;
+			fs::rename(group[i].from, group[i].to, ec);
+			if (ec) {
+				std::cerr << "error: can't move " << group[i].from.string() << ": " << ec.message() << '\n';
+				failed[i] = true;
+			} else {
+				directories.insert(group[i].to.parent_path());
+			}
+		}
+		if (failed[i])
+			fail(group[i]);
+	}
+	std::vector<int> directory_fds;
+	for (const fs::path& dir : directories) {
+		const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			std::cerr << "error: can't open " << dir.string() << '\n';
+		else
+			directory_fds.push_back(fd);
+	}
+	for (int e : sync_all(directory_fds, false))
+		if (e != 0)
+			std::cerr << "error: failed fsync() on a directory " << e << '\n';
+	for (int fd : directory_fds)
+		close(fd);
+	for (size_t i = 0; i < group.size(); ++i) {
+		if (failed[i] || !group[i].then)
+			continue;
+		try {
+			group[i].then();
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << '\n';
+			fail(group[i]);
+		}
+	}
+	for (const Pending& p : group)
+		if (p.tally)
+			p.tally->done();
+	group.clear();
+}
@@ -0,0 +1,106 @@
+#ifndef COMMITTER_H
+#define COMMITTER_H
+
+#include "Io_ring.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How far received files are synced before they count as stored
+enum class Durability {
+	none,		// Left to the kernel
+	batched,	// Synced in groups by a commit thread
+	per_file	// Synced one by one as they are received
+};
+
+Durability parse_durability(const std::string&);
+
+// Follows the files of some commits, like those of one session,
+// counting those that couldn't be put in place, or whose then failed
+class Commit_tally {
+public:
+	uint64_t failed() const { return failures.load(std::memory_order_relaxed); }
+	// Returns once every file committed with the tally so far is in place,
+	// or failed, with how many failed. Commits of others aren't waited for.
+	uint64_t wait();
+private:
+	friend class Committer;
+	void add();
+	// After the file's then or failed ran
+	void done();
+
+	std::atomic<uint64_t> failures{0};
+	std::mutex m;
+	std::condition_variable done_cv;
+	uint64_t outstanding = 0;	// Files queued and not yet done
+};
+
+// Moves received files into place with a rename, so that readers never see
+// half of one, once their contents are as durable as configured. Batched,
+// a thread takes every file queued while it was busy, syncs all of their
+// contents, renames them, then syncs each of their directories once,
+// so that one round of syncs covers many small files. With io_uring,
+// the syncs of a round are all submitted at once.
+class Committer {
+public:
+	Committer(Durability, bool use_io_uring);
+	~Committer();
+
+	Committer(const Committer&) = delete;
+	Committer& operator=(const Committer&) = delete;
+
+	// Takes ownership of fd, open on the file at from. Then runs once the
+	// file is in place, on the commit thread when batched, failed instead
+	// if it can't be. Files are renamed, and then or failed run, in the order
+	// they were committed, failed as soon as the failure is known. Abandoned, if given, is asked right before the
+	// rename; the file is removed instead, and fails, if it returns true.
+	// Failures are counted in the tally, if given, and thrown too unless batched.
+	void commit(int fd, std::filesystem::path from, std::filesystem::path to,
+			std::function<void()> then = {}, std::shared_ptr<Commit_tally> tally = {},
+			std::function<void()> failed = {}, std::function<bool()> abandoned = {});
+	// Also synced before files are renamed, for journals they depend on
+	void sync_with(int fd);
+	// Finish the files committed so far and end the commit thread,
+	// before what their thens refer to, or the journals, are destroyed.
+	// Nothing may be committed after.
+	void stop();
+private:
+	struct Pending {
+		int fd;
+		std::filesystem::path from;
+		std::filesystem::path to;
+		std::function<void()> then;
+		std::shared_ptr<Commit_tally> tally;
+		std::function<void()> failed;
+		std::function<bool()> abandoned;
+	};
+
+	void run();
+	// Sync, rename and sync the directories of a group of files
+	void finish(std::vector<Pending>&);
+	// Count a file that failed, and run its failed
+	void fail(Pending&);
+	// Sync every file, returning the errno of each, 0 for success
+	std::vector<int> sync_all(const std::vector<int>& fds, bool datasync);
+	bool sync_journals();
+
+	Durability durability;
+	std::unique_ptr<Io_ring> ring;	// Used by the commit thread
+	std::vector<int> journals;
+
+	std::mutex m;
+	std::condition_variable queued_cv;
+	std::vector<Pending> queue;
+	bool stopping = false;
+	std::thread worker;
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "Event_loop.h"
+#include "../utils/Metrics.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+Gauge& pending_events = metrics().gauge("backup_server_pending_events",
+	"Readiness events waiting for a worker");
+
+}
+
+Event_loop::Event_loop(int port, size_t max_conn, size_t workers,
+		const Socket_tuning& tuning, Session_context& c)
+	: max_connections{max_conn ? max_conn : 1}, ctx{c}, pool{workers} {
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		throw std::runtime_error{"failed socket()"};
+	int opt = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	try {
+		tune_socket(listen_fd, tuning);
+	} catch (...) {
+		close(listen_fd);
+		throw;
+	}
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;	// Accept connections from any IP address
+
+	if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		int err = errno;
+		close(listen_fd);
+		throw std::runtime_error{"failed bind() " + std::to_string(err)};
+	}
+	if (listen(listen_fd, SOMAXCONN) == -1) {
+		int err = errno;
+		close(listen_fd);
+		throw std::runtime_error{"failed listen() " + std::to_string(err)};
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		int err = errno;
+		close(listen_fd);
+		throw std::runtime_error{"failed epoll_create1() " + std::to_string(err)};
+	}
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;	// Listening socket
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		int err = errno;
+		close(epoll_fd);
+		close(listen_fd);
+		throw std::runtime_error{"failed epoll_ctl() " + std::to_string(err)};
+	}
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ev.data.ptr = &wake_fd;
+	if (wake_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+		int err = errno;
+		if (wake_fd != -1)
+			close(wake_fd);
+		close(epoll_fd);
+		close(listen_fd);
+		throw std::runtime_error{"failed to set up the wakeup eventfd " + std::to_string(err)};
+	}
+}
+
+Event_loop::~Event_loop() {
+	close(wake_fd);
+	close(epoll_fd);
+	close(listen_fd);
+}
+
+void Event_loop::run() {
+	constexpr int max_events = 64;
+	epoll_event events[max_events];
+	for (;;) {
+		int n = epoll_wait(epoll_fd, events, max_events, resume_due());
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			int err = errno;
+			throw std::runtime_error{"failed epoll_wait() " + std::to_string(err)};
+		}
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.ptr == &wake_fd) {
+				uint64_t count;
+				while (read(wake_fd, &count, sizeof(count)) > 0)
+					;
+				continue;
+			}
+			Session* s = static_cast<Session*>(events[i].data.ptr);
+			if (!s) {
+				accept_clients();
+				continue;
+			}
+			uint32_t ev = events[i].events;
+			pending_events.add();
+			pool.submit([this, s, ev]{ handle(s, ev); });
+		}
+	}
+}
+
+void Event_loop::accept_clients() {
+	for (;;) {
+		std::lock_guard<std::mutex> lock{m};
+		if (sessions.size() >= max_connections) {
+			set_accepting(false);
+			return;
+		}
+		sockaddr_in addr{};
+		socklen_t size = sizeof(addr);
+		int clientfd = accept4(listen_fd, reinterpret_cast<sockaddr*>(&addr), &size,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				std::cerr << "accept() failed\n";
+			return;
+		}
+		auto session = std::make_unique<Session>(clientfd, inet_ntoa(addr.sin_addr), ctx);
+		Session* s = session.get();
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.ptr = s;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+			std::cerr << "epoll_ctl() failed for " << s->peer() << '\n';
+			continue;
+		}
+		std::cout << "--Connected from " << s->peer() << "--\n";
+		sessions.emplace(s, std::move(session));
+	}
+}
+
+void Event_loop::handle(Session* s, uint32_t events) {
+	pending_events.sub();
+	bool alive = !(events & EPOLLERR);
+	bool throttled = false;
+	try {
+		if (alive && (events & EPOLLOUT))
+			alive = s->on_writable();
+		if (alive && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+			alive = s->on_readable();
+			throttled = s->throttled();
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "error: " << s->peer() << ": " << e.what() << '\n';
+		s->abort(e.what());
+		alive = false;
+	}
+	if (alive && throttled)
+		defer(s);
+	else if (alive)
+		rearm(s);
+	else
+		close_session(s);
+}
+
+void Event_loop::defer(Session* s) {
+	bool earliest = false;
+	{
+		std::lock_guard<std::mutex> lock{m};
+		earliest = deferred.empty() || s->resume_time() < deferred.begin()->first;
+		deferred.emplace(s->resume_time(), s);
+	}
+	// The loop may be waiting past it
+	if (earliest) {
+		const uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			std::cerr << "failed to wake the event loop " << errno << '\n';
+	}
+}
+
+int Event_loop::resume_due() {
+	std::vector<Session*> due;
+	int timeout = -1;
+	{
+		std::lock_guard<std::mutex> lock{m};
+		const auto now = Bandwidth_share::Clock::now();
+		while (!deferred.empty() && deferred.begin()->first <= now) {
+			due.push_back(deferred.begin()->second);
+			deferred.erase(deferred.begin());
+		}
+		if (!deferred.empty()) {
+			// Rounded up, so the loop doesn't wake just before
+			const auto left = deferred.begin()->first - now;
+			timeout = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+		}
+	}
+	// Outside the lock, which closing a session takes
+	for (Session* s : due)
+		rearm(s);
+	return timeout;
+}
+
+void Event_loop::rearm(Session* s) {
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	if (s->wants_write())
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = s;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd(), &ev) == -1) {
+		std::cerr << "epoll_ctl() failed for " << s->peer() << '\n';
+		close_session(s);
+	}
+}
+
+void Event_loop::close_session(Session* s) {
+	std::lock_guard<std::mutex> lock{m};
+	auto it = sessions.find(s);
+	if (it == sessions.end())
+		return;
+	std::cout << "--Disconnected from " << s->peer() << "--\n";
+	sessions.erase(it);	// Closing the socket also removes it from epoll
+	if (!accepting && sessions.size() < max_connections)
+		set_accepting(true);
+}
+
+void Event_loop::set_accepting(bool on) {
+	if (accepting == on)
+		return;
+	epoll_event ev{};
+	ev.events = on ? uint32_t{EPOLLIN} : 0;
+	ev.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev) == 0)
+		accepting = on;
+}
@@ -0,0 +1,59 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "Session.h"
+#include "../utils/Thread_pool.h"
+#include "../utils/Transport.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Accepts clients and dispatches their readiness events to a worker pool.
+// Sessions are registered one-shot, so a session is only handled
+// by one worker at a time, and is re-armed when that worker is done.
+// Sessions throttled by the bandwidth limit are re-armed once they
+// may read again instead.
+class Event_loop {
+public:
+	// Accepted connections inherit the tuning of the listening socket
+	Event_loop(int port, size_t max_connections, size_t workers,
+		const Socket_tuning&, Session_context& ctx);
+	~Event_loop();
+
+	Event_loop(const Event_loop&) = delete;
+	Event_loop& operator=(const Event_loop&) = delete;
+
+	void run();
+private:
+	void accept_clients();
+	void handle(Session*, uint32_t events);
+	void rearm(Session*);
+	// Re-arm the session once it's no longer throttled
+	void defer(Session*);
+	// Re-arm the deferred sessions that are due, returning the
+	// milliseconds until the next one is, -1 for none
+	int resume_due();
+	void close_session(Session*);
+	// Stop or resume polling the listening socket;
+	// pending clients wait in the backlog meanwhile
+	void set_accepting(bool);
+
+	int listen_fd = -1;
+	int epoll_fd = -1;
+	int wake_fd = -1;	// Wakes the loop when a session is deferred
+	size_t max_connections;
+	Session_context& ctx;
+
+	std::mutex m;
+	std::unordered_map<Session*, std::unique_ptr<Session>> sessions;
+	bool accepting = true;
+	std::multimap<Bandwidth_share::Clock::time_point, Session*> deferred;
+
+	// Destroyed first, so no worker outlives the sessions
+	Thread_pool pool;
+};
+
+#endif
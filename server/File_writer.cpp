@@ -0,0 +1,167 @@
+#include "File_writer.h"
+#include "../utils/Transfer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+// Enough to keep the disk busy while the next blocks arrive
+constexpr size_t buffer_count = 4;
+// Writes of small files submitted together
+constexpr unsigned ring_entries = 64;
+
+}
+
+File_writer::File_writer(bool use_io_uring) {
+	if (use_io_uring) {
+		try {
+			auto r = std::make_unique<Io_ring>(ring_entries);
+			memory = std::make_unique<char[]>(buffer_count * buffer_size);
+			std::vector<iovec> buffers;
+			for (size_t i = 0; i < buffer_count; ++i)
+				buffers.push_back(iovec{memory.get() + i * buffer_size, buffer_size});
+			r->register_buffers(buffers);
+			ring = std::move(r);
+			slots.resize(buffer_count);
+		} catch (const std::exception&) {
+			ring.reset();	// Plain writes then
+		}
+	}
+	if (!ring) {
+		memory = std::make_unique<char[]>(buffer_size);
+		slots.resize(1);
+	}
+}
+
+File_writer::~File_writer() {
+	try {
+		while (in_flight > 0)
+			reap(true);
+	} catch (const std::exception& e) {
+		std::cerr << "error: " << e.what() << '\n';
+	}
+}
+
+char* File_writer::buffer() {
+	if (ring) {
+		auto free_slot = [&]{
+			return std::find_if(slots.begin(), slots.end(), [](const Slot& s){ return !s.busy; });
+		};
+		reap(false);
+		while (free_slot() == slots.end())
+			reap(true);
+		current = free_slot() - slots.begin();
+	}
+	return memory.get() + current * buffer_size;
+}
+
+void File_writer::write_buffer(int fd, size_t n, uint64_t offset) {
+	check();
+	char* data = memory.get() + current * buffer_size;
+	if (!ring) {
+		write_at(fd, data, n, offset);
+		return;
+	}
+	slots[current] = Slot{fd, offset, n, true};
+	ring->write_fixed(fd, data, n, offset, current, current);
+	ring->submit();
+	++in_flight;
+}
+
+void File_writer::write(int fd, const char* data, size_t n, uint64_t offset) {
+	if (!ring) {
+		check();
+		write_at(fd, data, n, offset);
+		return;
+	}
+	while (n > 0) {
+		const size_t part = std::min(n, buffer_size);
+		std::copy_n(data, part, buffer());
+		write_buffer(fd, part, offset);
+		data += part;
+		offset += part;
+		n -= part;
+	}
+}
+
+void File_writer::write_all(const std::vector<Write>& writes) {
+	drain();
+	if (!ring) {
+		for (const Write& w : writes)
+			write_at(w.fd, w.data, w.length, w.offset);
+		return;
+	}
+	// Tagged by index, no buffer writes are in flight meanwhile
+	std::vector<iovec> iov(writes.size());
+	for (size_t begin = 0; begin < writes.size(); begin += ring->size()) {
+		const size_t end = std::min<size_t>(writes.size(), begin + ring->size());
+		for (size_t i = begin; i < end; ++i) {
+			const Write& w = writes[i];
+			iov[i] = iovec{const_cast<char*>(w.data), w.length};
+			ring->writev(w.fd, &iov[i], 1, w.offset, i);
+		}
+		ring->submit(end - begin);
+		for (size_t done = begin; done < end; ++done) {
+			Io_ring::Completion c;
+			while (!ring->pop(c))
+				ring->submit(1);
+			const Write& w = writes.at(c.tag);
+			if (c.result < 0) {
+				if (error.empty())
+					error = "failed write() " + std::to_string(-c.result);
+			} else if (static_cast<size_t>(c.result) < w.length) {
+				// Failures are kept until every completion of the wave is in
+				try {
+					write_at(w.fd, w.data + c.result, w.length - c.result, w.offset + c.result);
+				} catch (const std::exception& e) {
+					if (error.empty())
+						error = e.what();
+				}
+			}
+		}
+	}
+	check();
+}
+
+uint64_t File_writer::done_before(uint64_t end) const {
+	for (const Slot& s : slots)
+		if (s.busy)
+			end = std::min(end, s.offset);
+	return end;
+}
+
+void File_writer::drain() {
+	while (in_flight > 0)
+		reap(true);
+	check();
+}
+
+void File_writer::reap(bool wait) {
+	if (wait)
+		ring->submit(1);
+	for (Io_ring::Completion c; ring->pop(c); ) {
+		Slot& s = slots.at(c.tag);
+		const char* data = memory.get() + c.tag * buffer_size;
+		if (c.result < 0) {
+			if (error.empty())
+				error = "failed write() " + std::to_string(-c.result);
+		} else if (static_cast<size_t>(c.result) < s.length) {
+			// Short writes are rare enough to finish on the spot
+			try {
+				write_at(s.fd, data + c.result, s.length - c.result, s.offset + c.result);
+			} catch (const std::exception& e) {
+				if (error.empty())
+					error = e.what();
+			}
+		}
+		s.busy = false;
+		--in_flight;
+	}
+}
+
+void File_writer::check() {
+	if (!error.empty())
+		throw std::runtime_error{error};
+}
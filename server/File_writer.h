@@ -0,0 +1,69 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include "Io_ring.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Writes received contents to files at their offsets. With io_uring,
+// contents are placed in registered buffers and their writes left in
+// flight, so a session goes on receiving while the disk catches up.
+// Otherwise, or where io_uring is unavailable, they are plain writes.
+class File_writer {
+public:
+	// Largest write placed in one buffer
+	static constexpr size_t buffer_size = 256 * 1024;
+
+	struct Write {
+		int fd;
+		const char* data;
+		size_t length;
+		uint64_t offset;
+	};
+
+	explicit File_writer(bool use_io_uring);
+	// Waits for writes in flight, which still use the buffers
+	~File_writer();
+
+	File_writer(const File_writer&) = delete;
+	File_writer& operator=(const File_writer&) = delete;
+
+	// Room for up to buffer_size bytes, waiting for a buffer to free up
+	char* buffer();
+	// Write n bytes placed in the last buffer() to fd at offset
+	void write_buffer(int fd, size_t n, uint64_t offset);
+	// Write from anywhere, copying into buffers when writes are left in flight
+	void write(int fd, const char* data, size_t n, uint64_t offset);
+	// Write each straight from where it is, returning once all are done.
+	// With io_uring, a ring's worth of them is submitted at once.
+	void write_all(const std::vector<Write>&);
+	// Offset before which every write is done, given that writes so far
+	// go up to end, in increasing order of offset
+	uint64_t done_before(uint64_t end) const;
+	// Wait until every write is done. Rethrows the first failure.
+	void drain();
+private:
+	struct Slot {
+		int fd = -1;
+		uint64_t offset = 0;
+		size_t length = 0;
+		bool busy = false;
+	};
+
+	// Handle completions, waiting for one if asked to
+	void reap(bool wait);
+	void check();
+
+	std::unique_ptr<Io_ring> ring;
+	std::unique_ptr<char[]> memory;
+	std::vector<Slot> slots;
+	size_t current = 0;		// Slot handed out by buffer()
+	size_t in_flight = 0;
+	std::string error;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "Io_ring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned count) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+unsigned* at(void* ring, uint32_t offset) {
+	return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+}
+
+Io_ring::Io_ring(unsigned n) {
+	io_uring_params p{};
+	fd = io_uring_setup(n, &p);
+	if (fd == -1)
+		throw std::runtime_error{"failed io_uring_setup() " + std::to_string(errno)};
+	entries = p.sq_entries;
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) {
+		sq_ring = nullptr;
+		close(fd);
+		throw std::runtime_error{"failed mmap() of io_uring " + std::to_string(errno)};
+	}
+	cq_ring = sq_ring;
+	if (!single_mmap) {
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED) {
+			cq_ring = nullptr;
+			munmap(sq_ring, sq_ring_size);
+			close(fd);
+			throw std::runtime_error{"failed mmap() of io_uring " + std::to_string(errno)};
+		}
+	}
+	sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (s == MAP_FAILED) {
+		if (cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		munmap(sq_ring, sq_ring_size);
+		close(fd);
+		throw std::runtime_error{"failed mmap() of io_uring " + std::to_string(errno)};
+	}
+	sqes = static_cast<io_uring_sqe*>(s);
+	sq_head = at(sq_ring, p.sq_off.head);
+	sq_tail = at(sq_ring, p.sq_off.tail);
+	sq_mask = *at(sq_ring, p.sq_off.ring_mask);
+	sq_array = at(sq_ring, p.sq_off.array);
+	cq_head = at(cq_ring, p.cq_off.head);
+	cq_tail = at(cq_ring, p.cq_off.tail);
+	cq_mask = *at(cq_ring, p.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_ring) + p.cq_off.cqes);
+}
+
+Io_ring::~Io_ring() {
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	close(fd);
+}
+
+void Io_ring::register_buffers(const std::vector<iovec>& buffers) {
+	if (io_uring_register(fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == -1)
+		throw std::runtime_error{"failed io_uring_register() " + std::to_string(errno)};
+}
+
+io_uring_sqe& Io_ring::next_sqe(uint64_t tag) {
+	const unsigned tail = *sq_tail;
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries)
+		submit();
+	const unsigned index = tail & sq_mask;
+	io_uring_sqe& sqe = sqes[index];
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.user_data = tag;
+	sq_array[index] = index;
+	return sqe;
+}
+
+void Io_ring::submit_sqe() {
+	// Published to the kernel by the store of the new tail, once filled in
+	__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+	++queued;
+}
+
+void Io_ring::write_fixed(int file, const char* data, unsigned n, uint64_t offset, unsigned buffer, uint64_t tag) {
+	io_uring_sqe& sqe = next_sqe(tag);
+	sqe.opcode = IORING_OP_WRITE_FIXED;
+	sqe.fd = file;
+	sqe.addr = reinterpret_cast<uint64_t>(data);
+	sqe.len = n;
+	sqe.off = offset;
+	sqe.buf_index = buffer;
+	submit_sqe();
+}
+
+void Io_ring::writev(int file, const iovec* iov, unsigned count, uint64_t offset, uint64_t tag) {
+	io_uring_sqe& sqe = next_sqe(tag);
+	sqe.opcode = IORING_OP_WRITEV;
+	sqe.fd = file;
+	sqe.addr = reinterpret_cast<uint64_t>(iov);
+	sqe.len = count;
+	sqe.off = offset;
+	submit_sqe();
+}
+
+void Io_ring::fsync(int file, bool datasync, uint64_t tag) {
+	io_uring_sqe& sqe = next_sqe(tag);
+	sqe.opcode = IORING_OP_FSYNC;
+	sqe.fd = file;
+	sqe.fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+	submit_sqe();
+}
+
+void Io_ring::submit(unsigned wait) {
+	while (queued > 0 || wait > 0) {
+		const int n = io_uring_enter(fd, queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error{"failed io_uring_enter() " + std::to_string(errno)};
+		}
+		queued -= std::min<unsigned>(n, queued);
+		wait = 0;	// Waited for along with the submission
+	}
+}
+
+bool Io_ring::pop(Completion& c) {
+	const unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	const io_uring_cqe& cqe = cqes[head & cq_mask];
+	c.tag = cqe.user_data;
+	c.result = cqe.res;
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
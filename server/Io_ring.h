@@ -0,0 +1,69 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Minimal io_uring, set up with raw system calls rather than liburing.
+// Operations are queued, then submitted together with one system call.
+// Used by one thread at a time.
+class Io_ring {
+public:
+	struct Completion {
+		uint64_t tag;
+		int result;		// As the system call would return, -errno on failure
+	};
+
+	// Throws if the kernel lacks io_uring, or it is disabled
+	explicit Io_ring(unsigned entries);
+	~Io_ring();
+
+	Io_ring(const Io_ring&) = delete;
+	Io_ring& operator=(const Io_ring&) = delete;
+
+	// Buffers pinned once, so fixed writes from them skip mapping them each time
+	void register_buffers(const std::vector<iovec>&);
+
+	// Queue an operation, whose completion carries tag.
+	// A full queue is submitted first.
+	void write_fixed(int fd, const char* data, unsigned n, uint64_t offset, unsigned buffer, uint64_t tag);
+	// The iovecs must stay valid until the write completes
+	void writev(int fd, const iovec* iov, unsigned count, uint64_t offset, uint64_t tag);
+	void fsync(int fd, bool datasync, uint64_t tag);
+
+	// Submit the queued operations, and wait for at least wait completions
+	void submit(unsigned wait = 0);
+	// Take a completion, if there is one
+	bool pop(Completion&);
+	unsigned size() const { return entries; }
+private:
+	// Slot for the next operation, not seen by the kernel until submit_sqe()
+	io_uring_sqe& next_sqe(uint64_t tag);
+	void submit_sqe();
+
+	int fd = -1;
+	unsigned entries = 0;
+	unsigned queued = 0;	// Not yet submitted
+
+	void* sq_ring = nullptr;
+	size_t sq_ring_size = 0;
+	void* cq_ring = nullptr;
+	size_t cq_ring_size = 0;
+	io_uring_sqe* sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned sq_mask = 0;
+	unsigned* sq_array = nullptr;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	io_uring_cqe* cqes = nullptr;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "Metrics_endpoint.h"
+#include "../utils/Metrics.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+Metrics_endpoint::Metrics_endpoint(int port) {
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		throw std::runtime_error{"failed socket()"};
+	int opt = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+		int err = errno;
+		close(listen_fd);
+		throw std::runtime_error{"failed bind() of the metrics port " + std::to_string(err)};
+	}
+	if (listen(listen_fd, 16) == -1) {
+		int err = errno;
+		close(listen_fd);
+		throw std::runtime_error{"failed listen() on the metrics port " + std::to_string(err)};
+	}
+	worker = std::thread{[this]{ run(); }};
+}
+
+Metrics_endpoint::~Metrics_endpoint() {
+	// Wakes the blocked accept()
+	shutdown(listen_fd, SHUT_RDWR);
+	worker.join();
+	close(listen_fd);
+}
+
+void Metrics_endpoint::run() {
+	for (;;) {
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;	// Shut down
+		}
+		serve(fd);
+		close(fd);
+	}
+}
+
+void Metrics_endpoint::serve(int fd) {
+	// A scraper that doesn't send its request in time isn't waited for
+	timeval timeout{1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	// Whatever was asked for, the request only needs reading to its end
+	constexpr size_t max_request = 8 * 1024;
+	std::string request;
+	char buf[1024];
+	while (request.size() < max_request && request.find("\r\n\r\n") == std::string::npos) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		request.append(buf, n);
+	}
+	const std::string body = metrics().prometheus();
+	const std::string response = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " + std::to_string(body.size()) + "\r\n"
+		"Connection: close\r\n\r\n" + body;
+	for (size_t sent = 0; sent < response.size(); ) {
+		ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			std::cerr << "failed to send metrics " << errno << '\n';
+			return;
+		}
+		sent += n;
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef METRICS_ENDPOINT_H
+#define METRICS_ENDPOINT_H
+
+#include <thread>
+
+// Serves metrics().prometheus() over HTTP on its own thread, to any
+// request on the port, one scrape at a time so it never competes with
+// the sessions for more than a thread
+class Metrics_endpoint {
+public:
+	explicit Metrics_endpoint(int port);
+	~Metrics_endpoint();
+
+	Metrics_endpoint(const Metrics_endpoint&) = delete;
+	Metrics_endpoint& operator=(const Metrics_endpoint&) = delete;
+private:
+	void run();
+	void serve(int fd);
+
+	int listen_fd = -1;
+	std::thread worker;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "Partial_file.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Bytes in place are recorded at most this often
+constexpr uint64_t record_interval = 8 << 20;
+
+// Layout of the info file
+struct Info {
+	uint64_t checksum;
+	uint64_t offset;
+	uint8_t algorithm;
+	uint8_t reserved[7];
+};
+
+fs::path info_path_of(const fs::path& path) {
+	fs::path p = path;
+	p += ".info";
+	return p;
+}
+
+// Offset recorded for the contents with this checksum, or 0
+uint64_t recorded_offset(int info, const Checksum& checksum) {
+	Info i;
+	if (pread(info, &i, sizeof(i), 0) != sizeof(i))
+		return 0;
+	if (i.algorithm != static_cast<uint8_t>(checksum.algorithm) || i.checksum != checksum.value)
+		return 0;
+	return i.offset;
+}
+
+}
+
+Partial_file::Partial_file(fs::path p, const Checksum& c)
+	: path{std::move(p)}, info_path{info_path_of(path)}, checksum{c} {
+	fs::create_directories(path.parent_path());
+	file = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (file == -1)
+		throw std::runtime_error{"can't open " + path.string() + " for writing"};
+	// The info is only created once there is progress to record,
+	// which spares small files two more operations on their directory
+	info = open(info_path.c_str(), O_RDWR | O_CLOEXEC);
+	struct stat st;
+	if (fstat(file, &st) == -1) {
+		close_file();
+		throw std::runtime_error{"failed fstat() " + std::to_string(errno)};
+	}
+	// Never trust more than made it to the file
+	kept = info == -1 ? 0 : std::min<uint64_t>(recorded_offset(info, checksum), st.st_size);
+	end = recorded = kept;
+	if (kept == 0 && (info != -1 || st.st_size > 0)) {
+		try {
+			// Other contents were left, the info must stop claiming them first
+			if (info != -1) {
+				write_info();
+				if (fdatasync(info) == -1)
+					throw std::runtime_error{"failed fdatasync() " + std::to_string(errno)};
+			}
+			if (ftruncate(file, 0) == -1)
+				throw std::runtime_error{"failed ftruncate() " + std::to_string(errno)};
+		} catch (...) {
+			close_file();
+			throw;
+		}
+	}
+}
+
+Partial_file::~Partial_file() {
+	if (file == -1)
+		return;
+	try {
+		record();
+	} catch (const std::exception& e) {
+		std::cerr << "error: " << e.what() << '\n';
+	}
+	close_file();
+}
+
+void Partial_file::start_at(uint64_t offset) {
+	if (offset > kept)
+		throw std::runtime_error{"resuming " + path.string() + " past what it holds"};
+	end = offset;
+}
+
+void Partial_file::progress(uint64_t e) {
+	if (e <= end)
+		return;
+	end = e;
+	if (end >= recorded + record_interval)
+		record();
+}
+
+void Partial_file::record() {
+	if (end == recorded)
+		return;
+	// The contents must be on disk before the info claims them
+	if (fdatasync(file) == -1)
+		throw std::runtime_error{"failed fdatasync() " + std::to_string(errno)};
+	write_info();
+	recorded = end;
+}
+
+void Partial_file::write_info() {
+	if (info == -1 && (info = open(info_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		throw std::runtime_error{"can't open " + info_path.string() + " for writing"};
+	Info i{};
+	i.checksum = checksum.value;
+	i.offset = end;
+	i.algorithm = static_cast<uint8_t>(checksum.algorithm);
+	if (pwrite(info, &i, sizeof(i), 0) != sizeof(i))
+		throw std::runtime_error{"can't write " + info_path.string()};
+}
+
+void Partial_file::commit_to(const fs::path& destination, Committer& committer, std::function<void()> then,
+		std::shared_ptr<Commit_tally> tally) {
+	// Without its info, what is left at path is never resumed from
+	if (info != -1) {
+		close(info);
+		info = -1;
+		fs::remove(info_path);
+	}
+	const int fd = file;
+	file = -1;
+	committer.commit(fd, path, destination, std::move(then), std::move(tally));
+}
+
+void Partial_file::discard() {
+	close_file();
+	std::error_code ec;
+	fs::remove(path, ec);
+	fs::remove(info_path, ec);
+}
+
+void Partial_file::close_file() {
+	if (file != -1)
+		close(file);
+	if (info != -1)
+		close(info);
+	file = info = -1;
+}
+
+uint64_t Partial_file::held(const fs::path& path, const Checksum& checksum) {
+	const fs::path info_path = info_path_of(path);
+	int info = open(info_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (info == -1)
+		return 0;
+	const uint64_t offset = recorded_offset(info, checksum);
+	close(info);
+	std::error_code ec;
+	const uintmax_t size = fs::file_size(path, ec);
+	return ec ? 0 : std::min<uint64_t>(offset, size);
+}
@@ -0,0 +1,56 @@
+#ifndef PARTIAL_FILE_H
+#define PARTIAL_FILE_H
+
+#include "Committer.h"
+#include "../utils/Hasher.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+
+// A file being received, kept when the transfer is cut off so that
+// a retry of the same contents picks up where it stopped. An info file
+// next to it holds the checksum of the whole file and how many bytes
+// from the start are in place, updated once they are on disk.
+class Partial_file {
+public:
+	// Keeps what an earlier transfer of the same contents left at path
+	Partial_file(std::filesystem::path path, const Checksum&);
+	// Records the progress, unless finished
+	~Partial_file();
+
+	Partial_file(const Partial_file&) = delete;
+	Partial_file& operator=(const Partial_file&) = delete;
+
+	int fd() const { return file; }
+	// Bytes from the start left by earlier transfers
+	uint64_t held() const { return kept; }
+	// Write on from offset, which must be within what is held
+	void start_at(uint64_t offset);
+	// The contents before end are all in place, never moves back
+	void progress(uint64_t end);
+	// Hand the finished file to the committer, which moves it to its destination
+	void commit_to(const std::filesystem::path&, Committer&, std::function<void()> then = {},
+			std::shared_ptr<Commit_tally> tally = {});
+	// Drop the file, contents and all
+	void discard();
+
+	// Bytes of the contents with this checksum held at path
+	static uint64_t held(const std::filesystem::path& path, const Checksum&);
+private:
+	void record();
+	void write_info();
+	void close_file();
+
+	std::filesystem::path path;
+	std::filesystem::path info_path;
+	Checksum checksum;
+	int file = -1;
+	int info = -1;
+	uint64_t kept = 0;
+	uint64_t end = 0;
+	uint64_t recorded = 0;
+};
+
+#endif
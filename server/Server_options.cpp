@@ -1,5 +1,7 @@
 #include "Server_options.h"
 
+#include <thread>
+
 namespace fs = std::filesystem;
 
 template <>
@@ -15,3 +17,130 @@ fs::path Server_options::backup_path() const {
 	return lookup<fs::path>("BackupPath");
 }
 
+size_t Server_options::max_connections() const {
+	constexpr size_t default_max_connections = 64;
+	constexpr int max_max_connections = 65536;
+	if (!contains("MaxConnections"))
+		return default_max_connections;
+	const int connections = lookup<int>("MaxConnections");
+	if (connections < 1 || connections > max_max_connections)
+		throw std::runtime_error{"MaxConnections must be between 1 and " + std::to_string(max_max_connections)};
+	return connections;
+}
+
+size_t Server_options::worker_threads() const {
+	constexpr int max_worker_threads = 1024;
+	if (!contains("WorkerThreads"))
+		return std::max(1u, std::thread::hardware_concurrency());
+	const int threads = lookup<int>("WorkerThreads");
+	if (threads < 1 || threads > max_worker_threads)
+		throw std::runtime_error{"WorkerThreads must be between 1 and " + std::to_string(max_worker_threads)};
+	return threads;
+}
+
+fs::path Server_options::chunk_index_path() const {
+	if (!contains("ChunkIndexPath"))
+		return "./chunks";
+	return lookup<fs::path>("ChunkIndexPath");
+}
+
+fs::path Server_options::partial_path() const {
+	if (!contains("PartialPath"))
+		return "./partial";
+	return lookup<fs::path>("PartialPath");
+}
+
+std::string Server_options::storage() const {
+	if (!contains("Storage"))
+		return "files";
+	return lookup("Storage");
+}
+
+fs::path Server_options::cas_path() const {
+	if (!contains("CasPath"))
+		return "./cas";
+	return lookup<fs::path>("CasPath");
+}
+
+fs::path Server_options::index_path() const {
+	if (!contains("IndexPath"))
+		return "./index";
+	return lookup<fs::path>("IndexPath");
+}
+
+std::string Server_options::legacy_client_id() const {
+	if (!contains("LegacyClientId"))
+		return "";
+	return lookup("LegacyClientId");
+}
+
+Durability Server_options::durability() const {
+	if (!contains("Durability"))
+		return Durability::batched;
+	return parse_durability(lookup("Durability"));
+}
+
+bool Server_options::io_uring() const {
+	if (!contains("IoEngine"))
+		return true;
+	const std::string engine = lookup("IoEngine");
+	if (engine != "uring" && engine != "sync")
+		throw std::runtime_error{"unknown I/O engine \"" + engine + '"'};
+	return engine == "uring";
+}
+
+Socket_tuning Server_options::socket_tuning() const {
+	Socket_tuning t;
+	if (contains("SendBuffer"))
+		t.send_buffer = lookup<int>("SendBuffer");
+	if (contains("ReceiveBuffer"))
+		t.receive_buffer = lookup<int>("ReceiveBuffer");
+	return t;
+}
+
+size_t Server_options::read_size() const {
+	constexpr size_t default_read_size = 64 * 1024;
+	if (!contains("ReadSize"))
+		return default_read_size;
+	const int size = lookup<int>("ReadSize");
+	if (size <= 0)
+		throw std::runtime_error{"ReadSize must be positive"};
+	return size;
+}
+
+Rate_schedule Server_options::bandwidth_schedule() const {
+	if (!contains("BandwidthLimit"))
+		return {};
+	return Rate_schedule{Options::lookup("BandwidthLimit")};
+}
+
+bool Server_options::quiet() const {
+	if (!contains("Quiet"))
+		return false;
+	const std::string quiet = lookup("Quiet");
+	if (quiet != "yes" && quiet != "no")
+		throw std::runtime_error{"Quiet must be yes or no"};
+	return quiet == "yes";
+}
+
+int Server_options::metrics_port() const {
+	if (!contains("MetricsPort"))
+		return 0;
+	return lookup<int>("MetricsPort");
+}
+
+fs::path Server_options::metrics_file() const {
+	if (!contains("MetricsFile"))
+		return {};
+	return lookup<fs::path>("MetricsFile");
+}
+
+std::chrono::milliseconds Server_options::metrics_interval() const {
+	constexpr std::chrono::milliseconds default_metrics_interval{10000};
+	if (!contains("MetricsInterval"))
+		return default_metrics_interval;
+	const int interval = lookup<int>("MetricsInterval");
+	if (interval <= 0)
+		throw std::runtime_error{"MetricsInterval must be positive"};
+	return std::chrono::milliseconds{interval};
+}
@@ -1,7 +1,12 @@
-#ifndef CLIENT_OPTIONS_H
-#define CLIENT_OPTIONS_H
+#ifndef SERVER_OPTIONS_H
+#define SERVER_OPTIONS_H
 
+#include "Committer.h"
 #include "../utils/Option_parser.h"
+#include "../utils/Rate_limiter.h"
+#include "../utils/Transport.h"
+
+#include <chrono>
 
 class Server_options : private Options {
 public:
@@ -9,6 +14,44 @@ public:
 
 	int port() const;
 	std::filesystem::path backup_path() const;
+	// Clients served at once, others wait in the listen backlog
+	size_t max_connections() const;
+	// Threads handling session I/O and disk writes
+	size_t worker_threads() const;
+	// Where chunk lists of backed up files are kept for delta uploads
+	std::filesystem::path chunk_index_path() const;
+	// Where files are received until complete, with "files" storage,
+	// on the same file system as the backup
+	std::filesystem::path partial_path() const;
+	// "files" keeps plain copies, "cas" deduplicated chunks
+	std::string storage() const;
+	// Where the deduplicated chunk store lives
+	std::filesystem::path cas_path() const;
+	// Where the checksums of each client's files are kept
+	std::filesystem::path index_path() const;
+	// Client the checksums and files of the days before client ids
+	// are handed to, empty for none
+	std::string legacy_client_id() const;
+	// How far received files are synced before they are acknowledged
+	Durability durability() const;
+	// Socket buffer sizes of client connections
+	Socket_tuning socket_tuning() const;
+	// Bytes read from a connection at once
+	size_t read_size() const;
+	// Rate the server receives at, by time of day, shared fairly
+	// among the sessions; unlimited when not set
+	Rate_schedule bandwidth_schedule() const;
+	// "uring" writes and syncs files through io_uring where the kernel
+	// has it, "sync" with plain system calls
+	bool io_uring() const;
+	// Leave out the lines printed for each file
+	bool quiet() const;
+	// Port metrics are served on over HTTP, 0 for none
+	int metrics_port() const;
+	// Where metrics are appended as JSON lines, empty for nowhere
+	std::filesystem::path metrics_file() const;
+	// How often they are
+	std::chrono::milliseconds metrics_interval() const;
 private:
 	template <typename T = std::string>
 	T lookup(const std::string& key) const {
@@ -0,0 +1,453 @@
+#include "Session.h"
+#include "../utils/Log.h"
+#include "../utils/Metrics.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+Counter& sessions_started = metrics().counter("backup_server_sessions_total",
+	"Connections accepted, own sessions and joined ones");
+Gauge& sessions_open = metrics().gauge("backup_server_sessions_open", "Connections being served");
+Histogram& session_latency = metrics().histogram("backup_server_session_microseconds",
+	"How long connections were served");
+Counter& bytes_received = metrics().counter("backup_server_bytes_received_total",
+	"Bytes read from connections");
+Counter& entries_received = metrics().counter("backup_server_manifest_entries_total",
+	"Files offered by clients");
+Counter& entries_outdated = metrics().counter("backup_server_outdated_entries_total",
+	"Files asked for, being new or changed");
+Counter& files_received = metrics().counter("backup_server_files_received_total",
+	"Files received, whole, resumed, as deltas or in packs");
+Counter& file_bytes_received = metrics().counter("backup_server_file_bytes_received_total",
+	"Sizes of the files received");
+Histogram& file_latency = metrics().histogram("backup_server_receive_file_microseconds",
+	"Time from the header of a file until it was handed to the committer");
+Histogram& pack_latency = metrics().histogram("backup_server_store_pack_microseconds",
+	"Time to write the files of a pack");
+
+}
+
+// Paths from clients must stay inside the backup directory
+static fs::path checked_path(const std::string& s) {
+	fs::path p = fs::path{s}.lexically_normal();
+	if (p.empty() || p.is_absolute() || *p.begin() == "..")
+		throw std::runtime_error{"invalid path \"" + s + '"'};
+	return p;
+}
+
+Session::Session(int fd, std::string peer, Session_context& c)
+	: sock{fd}, peer_name{std::move(peer)}, ctx{c}, started{std::chrono::steady_clock::now()},
+		share{c.bandwidth} {
+	sessions_started.add();
+	sessions_open.add();
+}
+
+Session::~Session() {
+	if (upload) {
+		std::cerr << file_path << " incomplete, " << remaining << " byte(s) missing, kept for resuming\n";
+		try {
+			// What was received is kept once it's written
+			if (writer)
+				writer->drain();
+			upload->received(received_end);
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << '\n';
+		}
+	}
+	writer.reset();
+	upload.reset();
+	if (group_id != 0)
+		ctx.groups.remove(group_id);
+	close(sock);
+	sessions_open.sub();
+	session_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - started).count());
+}
+
+bool Session::on_readable() {
+	// Bound the work done per wakeup so one busy client can't starve the others
+	constexpr size_t max_reads = 16;
+	resume_at = {};
+	for (size_t i = 0; i < max_reads; ++i) {
+		// Over the bandwidth limit, the event loop calls again at resume_at
+		const bool splice = state == State::Chunk && input.empty();
+		const size_t granted = share.grant(splice ? chunk_remaining : ctx.bufsize, resume_at);
+		if (granted == 0)
+			return true;
+		ssize_t status = 0;
+		if (splice) {
+			status = receive_chunk(granted);
+		} else {
+			const size_t old_size = input.size();
+			input.resize(old_size + granted);
+			status = read(sock, input.data() + old_size, granted);
+			input.resize(old_size + std::max<ssize_t>(status, 0));
+		}
+		share.refund(granted - std::max<ssize_t>(status, 0));
+		if (status > 0) {
+			bytes_received.add(status);
+			process();
+			if (wants_write() && !on_writable())
+				return false;
+		} else if (status == 0) {
+			if (state != State::Done)
+				std::cerr << peer_name << " disconnected before finishing\n";
+			return false;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		} else if (errno != EINTR) {
+			int err = errno;
+			std::cerr << "read() failed from " << peer_name << ' ' << err << '\n';
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Session::on_writable() {
+	while (!output.empty()) {
+		ssize_t status = send(sock, output.data(), output.size(), MSG_NOSIGNAL);
+		if (status > 0) {
+			output.erase(0, status);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		} else if (errno != EINTR) {
+			int err = errno;
+			std::cerr << "send() failed to " << peer_name << ' ' << err << '\n';
+			return false;
+		}
+	}
+	return true;
+}
+
+void Session::abort(const std::string& reason) {
+	output = encode_error(reason);
+	on_writable();
+}
+
+void Session::process() {
+	while (step())
+		;
+	input.erase(0, consumed);
+	consumed = 0;
+}
+
+bool Session::step() {
+	if (state == State::Chunk)
+		return handle_chunk();
+	if (input.size() - consumed < frame_header_size)
+		return false;
+	const Frame_header h = parse_frame_header(input.data() + consumed);
+	if (h.type == Frame_type::file_chunk) {
+		begin_chunk(h.length);
+		consumed += frame_header_size;
+		state = State::Chunk;
+		return true;
+	}
+	if (input.size() - consumed < frame_header_size + h.length)
+		return false;
+	std::string_view payload{input.data() + consumed + frame_header_size, h.length};
+	consumed += frame_header_size + h.length;
+	handle_frame(h.type, payload);
+	return true;
+}
+
+void Session::handle_frame(Frame_type type, std::string_view payload) {
+	const bool between_files = state == State::Idle || state == State::File;
+	const bool streams_manifest = manifest && !manifest_done;
+	if (type == Frame_type::error)
+		throw std::runtime_error{"client error: " + decode_error(payload)};
+	if (type == Frame_type::hello && state == State::Hello) {
+		handle_hello(payload);
+	} else if (type == Frame_type::join && state == State::Hello) {
+		handle_join(payload);
+	} else if (type == Frame_type::manifest_batch && between_files && streams_manifest) {
+		handle_manifest_batch(payload);
+	} else if (type == Frame_type::manifest_end && between_files && streams_manifest) {
+		handle_manifest_end();
+	} else if (type == Frame_type::file_header && state == State::Idle) {
+		handle_file_header(payload);
+	} else if (type == Frame_type::chunk_list && state == State::Idle) {
+		handle_chunk_list(payload);
+	} else if (type == Frame_type::compressed_chunk && compression != Compression::none) {
+		handle_compressed_chunk(payload);
+	} else if (type == Frame_type::file_pack && state == State::Idle) {
+		handle_file_pack(payload);
+	} else if (type == Frame_type::compressed_pack && state == State::Idle
+			&& compression != Compression::none) {
+		handle_compressed_pack(payload);
+	} else if (type == Frame_type::files_end && state == State::Idle && !streams_manifest) {
+		handle_files_end();
+	} else {
+		throw std::runtime_error{
+			"unexpected frame type " + std::to_string(static_cast<int>(type))
+		};
+	}
+}
+
+void Session::handle_hello(std::string_view payload) {
+	const Hello hello = decode_hello(payload);
+	compression = hello.compression;
+	manifest.emplace(hello.algorithm);
+	// Opened first, which checks the id is fit to name the client's directory
+	std::shared_ptr<Client_checksums> checksums = ctx.checksums.open(hello.client_id);
+	group = std::make_shared<Session_group>(compression, hello.client_id, std::move(checksums));
+	if (hello.session_id != 0) {
+		ctx.groups.add(hello.session_id, group);
+		group_id = hello.session_id;
+	}
+	std::cout << "Existing file(s) of " << hello.client_id << ": " << group->checksums()->size() << '\n';
+	state = State::Idle;
+}
+
+void Session::handle_join(std::string_view payload) {
+	group = ctx.groups.find(decode_join(payload).session_id);
+	compression = group->compression();
+	state = State::Idle;
+}
+
+void Session::handle_files_end() {
+	// Files are in place, with their checksums, before they're acknowledged.
+	// Otherwise the client is told, and keeps its state for the next run.
+	const uint64_t failed = group->commits()->wait();
+	if (failed > 0)
+		throw std::runtime_error{std::to_string(failed) + " file(s) couldn't be stored"};
+	// Acknowledged checksums must survive a crash. The session's own
+	// connection ends last, after those that joined it were acknowledged.
+	if (manifest)
+		group->checksums()->checkpoint();
+	output += encode(Frame_type::ack);
+	state = State::Done;
+}
+
+void Session::handle_manifest_batch(std::string_view payload) {
+	batch.clear();
+	manifest->decode_batch(payload, batch);
+	for (const Manifest_entry& e : batch)
+		handle_manifest_entry(e);
+}
+
+void Session::handle_manifest_entry(const Manifest_entry& e) {
+	// Decoded paths are normal and relative already
+	const std::string& path = e.path;
+	++received_count;
+	entries_received.add();
+	// Ask for the file right away, so the client can send it while still scanning
+	const std::optional<Checksum> stored = group->checksums()->find(path);
+	if (!stored || *stored != e.checksum) {
+		group->request(path, e.checksum);
+		// What an interrupted upload left needn't be sent again
+		const bool as_chunks = ctx.storage->prefers_chunks();
+		const uint64_t offset = as_chunks ? 0 : ctx.storage->resumable(group->client_id(), path, e.checksum);
+		output += encode(Outdated_entry{path, as_chunks, offset});
+		++outdated_count;
+		entries_outdated.add();
+	}
+}
+
+void Session::handle_manifest_end() {
+	std::cout << "Received: " << received_count << " file(s) from " << peer_name << '\n';
+	if (outdated_count == 0)
+		std::cout << "Backup up to date\n";
+	else
+		std::cout << outdated_count << " file(s) to update\n";
+	output += encode(Frame_type::outdated_end);
+	manifest_done = true;
+}
+
+void Session::handle_file_header(std::string_view payload) {
+	const File_header header = decode_file_header(payload);
+	const fs::path relative = checked_path(header.path);
+	file_path = relative;
+	file_started = std::chrono::steady_clock::now();
+	upload = ctx.storage->begin_file(group->client_id(), relative,
+		group->requested_checksum(relative), header.offset);
+	file_size = header.size;
+	remaining = header.size - header.offset;
+	write_offset = received_end = header.offset;
+	state = State::File;
+	if (remaining == 0)
+		finish_file();
+}
+
+void Session::handle_chunk_list(std::string_view payload) {
+	Chunk_list list = decode_chunk_list(payload);
+	const fs::path relative = checked_path(list.path);
+	file_path = relative;
+	file_started = std::chrono::steady_clock::now();
+	file_size = list.size;
+	Chunk_need need{list.path, {}};
+	upload = ctx.storage->begin_delta(group->client_id(), relative,
+		group->requested_checksum(relative), list.chunks, need.needed);
+	delta.emplace();
+	remaining = 0;
+	write_offset = received_end = upload->held();
+	for (size_t i = 0; i < list.chunks.size(); ++i) {
+		if (need.needed[i]) {
+			delta->needed.push_back(i);
+			remaining += list.chunks[i].length;
+		}
+	}
+
+	// VRBOSE
+	log_file(std::clog, "Delta ", file_path.string(), ": ",
+		delta->needed.size(), " of ", list.chunks.size(), " chunk(s) needed");
+
+	output += encode(need);
+	delta->chunks = std::move(list.chunks);
+	state = State::File;
+	if (remaining == 0)
+		finish_file();
+}
+
+void Session::handle_file_pack(std::string_view payload) {
+	// Unpacked in groups, whose files are all open while their writes are
+	// in flight, and then committed together
+	constexpr size_t max_group = 64;
+	std::vector<std::unique_ptr<Upload>> uploads;
+	std::vector<std::function<void()>> stored;
+	std::vector<File_writer::Write> writes;
+	Latency_timer timer{pack_latency};
+	auto store_group = [&]{
+		file_writer().write_all(writes);
+		for (size_t i = 0; i < uploads.size(); ++i)
+			uploads[i]->commit(std::move(stored[i]), group->commits());
+		uploads.clear();
+		stored.clear();
+		writes.clear();
+	};
+	Payload_reader r{payload};
+	while (!r.done()) {
+		const fs::path relative = checked_path(r.str());
+		const uint64_t size = r.u64();
+		const std::string_view contents = r.view(size);
+		uploads.push_back(ctx.storage->begin_file(group->client_id(), relative,
+			group->requested_checksum(relative), 0));
+		// Taken right away, so a file can't be in a pack twice
+		stored.push_back(on_stored(relative));
+		writes.push_back(File_writer::Write{uploads.back()->fd(), contents.data(), contents.size(), 0});
+		files_received.add();
+		file_bytes_received.add(size);
+		if (uploads.size() == max_group)
+			store_group();
+	}
+	store_group();
+}
+
+void Session::handle_compressed_pack(std::string_view payload) {
+	Payload_reader r{payload};
+	const uint32_t length = r.u32();
+	if (length > max_pack_payload)
+		throw std::runtime_error{"compressed pack too large"};
+	unpacked.resize(length);
+	decompress(payload.data() + 4, payload.size() - 4, unpacked.data(), length);
+	handle_file_pack(unpacked);
+}
+
+void Session::begin_chunk(uint32_t length) {
+	if (state != State::File)
+		throw std::runtime_error{"unexpected file chunk"};
+	if (length == 0)
+		throw std::runtime_error{"empty file chunk"};
+	if (length > remaining)
+		throw std::runtime_error{"file chunk exceeds file size"};
+	if (delta) {
+		// Chunks of a delta arrive one per frame, in the order they were asked for
+		const Chunk& c = delta->chunks[delta->needed[delta->next]];
+		if (length != c.length)
+			throw std::runtime_error{"file chunk doesn't match the chunk list"};
+		write_offset = c.offset;
+	}
+	chunk_remaining = length;
+}
+
+void Session::handle_compressed_chunk(std::string_view payload) {
+	Payload_reader r{payload};
+	const uint32_t length = r.u32();
+	if (length > compressed_block_size)
+		throw std::runtime_error{"compressed block too large"};
+	begin_chunk(length);
+	// Decompressed straight into a buffer of the writer
+	static_assert(compressed_block_size <= File_writer::buffer_size);
+	char* block = file_writer().buffer();
+	decompress(payload.data() + 4, payload.size() - 4, block, length);
+	file_writer().write_buffer(upload->fd(), length, write_offset);
+	chunk_received(length);
+}
+
+bool Session::handle_chunk() {
+	const size_t n = std::min<size_t>(chunk_remaining, input.size() - consumed);
+	if (n == 0)
+		return false;
+	file_writer().write(upload->fd(), input.data() + consumed, n, write_offset);
+	consumed += n;
+	chunk_received(n);
+	return true;
+}
+
+ssize_t Session::receive_chunk(size_t n) {
+	ssize_t status = splicer.to_file(sock, upload->fd(), write_offset, n);
+	if (status > 0)
+		chunk_received(status);
+	return status;
+}
+
+void Session::chunk_received(size_t n) {
+	chunk_remaining -= n;
+	remaining -= n;
+	write_offset += n;
+	if (!delta)
+		received_end = write_offset;
+	if (chunk_remaining == 0) {
+		state = State::File;
+		if (delta) {
+			// Chunks arrive in order, so everything before this one is in place
+			received_end = write_offset;
+			++delta->next;
+		}
+	}
+	// Only what is written counts as held, writes may still be in flight
+	upload->received(writer ? writer->done_before(received_end) : received_end);
+	if (remaining == 0)
+		finish_file();
+}
+
+void Session::finish_file() {
+	std::function<void()> stored = on_stored(file_path);
+	if (writer)
+		writer->drain();
+	upload->commit(std::move(stored), group->commits());
+	upload.reset();
+	delta.reset();
+	files_received.add();
+	file_bytes_received.add(file_size);
+	file_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - file_started).count());
+	state = State::Idle;
+}
+
+std::function<void()> Session::on_stored(const fs::path& path) {
+	// Only stored contents make the checksum current
+	const std::optional<Checksum> checksum = group->take(path);
+	if (!checksum)
+		return {};
+	return [checksums = group->checksums(), path, checksum = *checksum]{
+		checksums->put(path, checksum);
+	};
+}
+
+File_writer& Session::file_writer() {
+	if (!writer)
+		writer.emplace(ctx.io_uring);
+	return *writer;
+}
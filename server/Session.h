@@ -0,0 +1,146 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Bandwidth_share.h"
+#include "Checksum_index.h"
+#include "Committer.h"
+#include "File_writer.h"
+#include "Session_group.h"
+#include "Storage.h"
+#include "../utils/Frame.h"
+#include "../utils/Manifest_codec.h"
+#include "../utils/Path_pool.h"
+#include "../utils/Transfer.h"
+
+// State shared by every session of the server
+struct Session_context {
+	std::filesystem::path backup_path;
+	size_t bufsize;		// Read in chunks of this size
+	Committer& committer;
+	bool io_uring;		// Write files through io_uring where the kernel has it
+	std::unique_ptr<Storage> storage;
+	Checksum_index checksums;
+	Session_registry groups;	// Sessions accepting further connections
+	Bandwidth_share bandwidth;	// Shared by the sessions receiving
+
+	// Commits still queued refer to the storage and the checksums
+	~Session_context() { committer.stop(); }
+};
+
+// Per-connection state, driven by the event loop.
+// A session is only ever handled by one worker at a time.
+// A connection that joined another's session only receives files.
+class Session {
+public:
+	Session(int fd, std::string peer, Session_context& ctx);
+	~Session();
+
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
+
+	// Consume available input without blocking,
+	// returns false once the session is over
+	bool on_readable();
+	// Flush pending output without blocking,
+	// returns false if the connection broke
+	bool on_writable();
+	bool wants_write() const { return !output.empty(); }
+	// Whether reading stopped at the bandwidth limit, to go on at resume_time()
+	bool throttled() const { return resume_at != Bandwidth_share::Clock::time_point{}; }
+	Bandwidth_share::Clock::time_point resume_time() const { return resume_at; }
+	// Tell the client why the session is being dropped, best effort
+	void abort(const std::string& reason);
+
+	int fd() const { return sock; }
+	const std::string& peer() const { return peer_name; }
+private:
+	enum class State {
+		Hello,		// Waiting for the hello or join frame
+		Idle,		// Between files, manifest entries may arrive too
+		File,		// Waiting for the next chunk of the current file
+		Chunk,		// Receiving the payload of a file chunk
+		Done		// Acknowledged, waiting for the client to close
+	};
+
+	// Advance the state machine as far as the buffered input allows
+	void process();
+	bool step();
+	void handle_frame(Frame_type, std::string_view payload);
+	void handle_hello(std::string_view payload);
+	void handle_join(std::string_view payload);
+	void handle_files_end();
+	void handle_manifest_batch(std::string_view payload);
+	void handle_manifest_entry(const Manifest_entry&);
+	void handle_manifest_end();
+	void handle_file_header(std::string_view payload);
+	void handle_chunk_list(std::string_view payload);
+	// Store whole small files, their writes batched
+	void handle_file_pack(std::string_view payload);
+	void handle_compressed_pack(std::string_view payload);
+	// Check the next chunk of the current file, and seek to it
+	void begin_chunk(uint32_t length);
+	void handle_compressed_chunk(std::string_view payload);
+	bool handle_chunk();
+	// Move at most n bytes of chunk contents straight from the socket
+	// once no input is buffered
+	ssize_t receive_chunk(size_t n);
+	void chunk_received(size_t n);
+	void finish_file();
+	// Makes the checksum of a requested file current, once it's stored
+	std::function<void()> on_stored(const std::filesystem::path&);
+	File_writer& file_writer();
+
+	int sock;
+	std::string peer_name;
+	Session_context& ctx;
+
+	State state = State::Hello;
+	std::string input;		// Received bytes not yet consumed
+	size_t consumed = 0;	// Consumed prefix of input
+	std::string output;		// Bytes waiting to be sent
+	std::chrono::steady_clock::time_point started;
+	Bandwidth_share::Share share;
+	Bandwidth_share::Clock::time_point resume_at;	// Set while throttled
+
+	Compression compression = Compression::none;
+	std::optional<Manifest_decoder> manifest;	// Unless the session was joined
+	std::vector<Manifest_entry> batch;	// Entries of the last manifest batch
+	bool manifest_done = false;
+	std::shared_ptr<Session_group> group;
+	uint64_t group_id = 0;	// Registered under, if other connections may join
+	size_t received_count = 0;
+	size_t outdated_count = 0;
+
+	std::unique_ptr<Upload> upload;	// File currently being received
+	std::filesystem::path file_path;
+	std::chrono::steady_clock::time_point file_started;
+	uint64_t file_size = 0;
+	uint64_t remaining = 0;	// Bytes left of the current file
+	uint32_t chunk_remaining = 0;	// Bytes left of the current chunk
+	uint64_t write_offset = 0;	// Where the next contents of the current file go
+	uint64_t received_end = 0;	// Contents before this offset were received
+	Splice_pipe splicer;
+	std::optional<File_writer> writer;	// Created with the first file
+	std::string unpacked;	// Decompressed file pack
+
+	// File being rebuilt from stored chunks and new ones
+	struct Delta {
+		std::vector<Chunk> chunks;
+		std::vector<size_t> needed;	// Chunks to receive, in order
+		size_t next = 0;			// Next of needed to arrive
+	};
+	std::optional<Delta> delta;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "Session_group.h"
+
+#include <stdexcept>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+Session_group::Session_group(Compression c, std::string id, std::shared_ptr<Client_checksums> checksums)
+	: compressed{c}, client{std::move(id)}, client_checksums{std::move(checksums)} {}
+
+void Session_group::request(std::string_view path, const Checksum& checksum) {
+	std::lock_guard<std::mutex> lock{m};
+	const Path_id id = paths.intern(path);
+	if (id == requested.size())
+		requested.emplace_back();
+	requested[id] = checksum;
+}
+
+Checksum Session_group::requested_checksum(const fs::path& path) const {
+	std::lock_guard<std::mutex> lock{m};
+	const std::optional<Path_id> id = paths.find(path.generic_string());
+	if (!id || !requested[*id])
+		throw std::runtime_error{"file \"" + path.string() + "\" wasn't asked for"};
+	return *requested[*id];
+}
+
+std::optional<Checksum> Session_group::take(const fs::path& path) {
+	std::lock_guard<std::mutex> lock{m};
+	const std::optional<Path_id> id = paths.find(path.generic_string());
+	if (!id)
+		return std::nullopt;
+	return std::exchange(requested[*id], std::nullopt);
+}
+
+void Session_registry::add(uint64_t id, const std::shared_ptr<Session_group>& group) {
+	std::lock_guard<std::mutex> lock{m};
+	std::weak_ptr<Session_group>& slot = groups[id];
+	if (!slot.expired())
+		throw std::runtime_error{"session id already in use"};
+	slot = group;
+}
+
+void Session_registry::remove(uint64_t id) {
+	std::lock_guard<std::mutex> lock{m};
+	groups.erase(id);
+}
+
+std::shared_ptr<Session_group> Session_registry::find(uint64_t id) {
+	std::lock_guard<std::mutex> lock{m};
+	auto it = groups.find(id);
+	std::shared_ptr<Session_group> group = it == groups.end() ? nullptr : it->second.lock();
+	if (!group)
+		throw std::runtime_error{"no session to join"};
+	return group;
+}
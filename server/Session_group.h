@@ -0,0 +1,64 @@
+#ifndef SESSION_GROUP_H
+#define SESSION_GROUP_H
+
+#include "Checksum_index.h"
+#include "Committer.h"
+#include "../utils/Compressor.h"
+#include "../utils/Hasher.h"
+#include "../utils/Path_pool.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// What the connections of one backup session share: the connection that
+// streams the manifest, and those that joined it to upload files alongside.
+// Every call locks, as the connections are handled by different workers.
+class Session_group {
+public:
+	Session_group(Compression, std::string client_id, std::shared_ptr<Client_checksums>);
+
+	Compression compression() const { return compressed; }
+	const std::string& client_id() const { return client; }
+	const std::shared_ptr<Client_checksums>& checksums() const { return client_checksums; }
+	// Files of the session's connections that couldn't be stored
+	const std::shared_ptr<Commit_tally>& commits() const { return tally; }
+
+	// Ask for a file, to be stored with the checksum of its manifest entry
+	void request(std::string_view path, const Checksum&);
+	// Checksum of a file that was asked for and not yet stored,
+	// throws if there is none
+	Checksum requested_checksum(const std::filesystem::path&) const;
+	// Checksum to store a file with, only handed out once
+	std::optional<Checksum> take(const std::filesystem::path&);
+private:
+	const Compression compressed;
+	const std::string client;
+	const std::shared_ptr<Client_checksums> client_checksums;
+	const std::shared_ptr<Commit_tally> tally = std::make_shared<Commit_tally>();
+
+	mutable std::mutex m;
+	Path_pool paths;
+	std::vector<std::optional<Checksum>> requested;	// By id in paths
+};
+
+// Sessions further connections may join, by the id their client gave them
+class Session_registry {
+public:
+	// Throws if the id is taken
+	void add(uint64_t id, const std::shared_ptr<Session_group>&);
+	void remove(uint64_t id);
+	// Throws unless a session of that id is going on
+	std::shared_ptr<Session_group> find(uint64_t id);
+private:
+	std::mutex m;
+	std::unordered_map<uint64_t, std::weak_ptr<Session_group>> groups;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "Storage.h"
+#include "../utils/Log.h"
+#include "../utils/Transfer.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+int open_for_writing(const fs::path& path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		throw std::runtime_error{
+			"can't open "
+			+ path.string()
+			+ " for writing"
+		};
+	return fd;
+}
+
+namespace {
+
+// Received next to its destination, which it replaces on commit
+class Plain_upload : public Upload {
+public:
+	Plain_upload(const fs::path& p, const fs::path& partial_path, const Checksum& c, Committer& cm)
+		: Upload{partial_path, c}, path{p}, committer{cm} {}
+	void commit(std::function<void()> stored, std::shared_ptr<Commit_tally> tally) override {
+		partial.commit_to(path, committer, std::move(stored), std::move(tally));
+	}
+private:
+	fs::path path;
+	Committer& committer;
+};
+
+// Rebuilt in the same way, recording the chunks of the result
+class Plain_delta : public Upload {
+public:
+	Plain_delta(const fs::path& p, const fs::path& partial_path, const Checksum& c, Committer& cm,
+			const fs::path& r, const Chunk_index& i, const std::vector<Chunk>& ch)
+		: Upload{partial_path, c}, path{p}, committer{cm}, relative{r}, index{i}, chunks{ch} {}
+	void commit(std::function<void()> stored, std::shared_ptr<Commit_tally> tally) override {
+		// The chunk list is only valid for the file in place
+		partial.commit_to(path, committer,
+			[path = path, relative = relative, &index = index, chunks = std::move(chunks), stored = std::move(stored)]{
+				index.store(relative, path, chunks);
+				if (stored)
+					stored();
+			}, std::move(tally));
+	}
+private:
+	fs::path path;
+	Committer& committer;
+	fs::path relative;
+	const Chunk_index& index;
+	std::vector<Chunk> chunks;
+};
+
+}
+
+Plain_storage::Plain_storage(fs::path backup, fs::path partial, fs::path chunk_index, Committer& c)
+	: backup_path{std::move(backup)}, partial_root{std::move(partial)}, index{std::move(chunk_index)}, committer{c} {
+	fs::create_directories(backup_path);
+	fs::create_directories(partial_root);
+	struct stat backup_st, partial_st;
+	if (stat(backup_path.c_str(), &backup_st) == -1 || stat(partial_root.c_str(), &partial_st) == -1)
+		throw std::runtime_error{"failed stat() " + std::to_string(errno)};
+	if (backup_st.st_dev != partial_st.st_dev)
+		throw std::runtime_error{"PartialPath must be on the same file system as BackupPath"};
+}
+
+fs::path Plain_storage::partial_path(const fs::path& relative) const {
+	fs::path p = partial_root / relative;
+	p += ".partial";
+	return p;
+}
+
+uint64_t Plain_storage::resumable(const std::string& client, const fs::path& relative,
+		const Checksum& checksum) const {
+	return Partial_file::held(partial_path(client_path(client, relative)), checksum);
+}
+
+std::unique_ptr<Upload> Plain_storage::begin_file(const std::string& client, const fs::path& file,
+		const Checksum& checksum, uint64_t offset) {
+	const fs::path relative = client_path(client, file);
+	const fs::path path = backup_path / relative;
+	fs::create_directories(path.parent_path());
+	index.remove(relative);	// Its chunks are unknown now
+
+	// VRBOSE, without looking the file up when quiet
+	if (!quiet())
+		log_file(std::clog, fs::exists(path) ? "Overwritten " : "Created ", path.string());
+	if (offset > 0)
+		log_file(std::clog, "Resumed ", path.string(), " at ", offset);
+
+	auto upload = std::make_unique<Plain_upload>(path, partial_path(relative), checksum, committer);
+	upload->start_at(offset);
+	return upload;
+}
+
+std::unique_ptr<Upload> Plain_storage::begin_delta(const std::string& client, const fs::path& file,
+		const Checksum& checksum, const std::vector<Chunk>& chunks, std::vector<bool>& needed) {
+	const fs::path relative = client_path(client, file);
+	const fs::path path = backup_path / relative;
+	fs::create_directories(path.parent_path());
+	auto upload = std::make_unique<Plain_delta>(path, partial_path(relative), checksum, committer,
+		relative, index, chunks);
+	// Chunks an interrupted upload left in place are kept
+	const uint64_t held = upload->held();
+
+	// Chunks of the previous version, by content
+	const std::vector<Chunk> old_chunks = index.load(relative, path);
+	std::unordered_map<Digest, const Chunk*, Digest_hash> existing;
+	for (const Chunk& c : old_chunks)
+		existing.emplace(c.digest, &c);
+	int old_file = -1;
+	if (!existing.empty() && (old_file = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1)
+		existing.clear();
+
+	try {
+		needed.assign(chunks.size(), false);
+		uint64_t size = 0;
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			const Chunk& c = chunks[i];
+			size += c.length;
+			if (size <= held)
+				continue;
+			auto it = existing.find(c.digest);
+			if (it != existing.cend() && it->second->length == c.length)
+				copy_range(old_file, it->second->offset, upload->fd(), c.offset, c.length);
+			else
+				needed[i] = true;
+		}
+		if (ftruncate(upload->fd(), size) == -1)
+			throw std::runtime_error{"failed ftruncate() " + std::to_string(errno)};
+	} catch (...) {
+		if (old_file != -1)
+			close(old_file);
+		throw;
+	}
+	if (old_file != -1)
+		close(old_file);
+
+	// VRBOSE
+	if (held > 0)
+		log_file(std::clog, "Resumed ", path.string(), " at ", held);
+
+	return upload;
+}
+
+void Plain_storage::adopt(const std::string& client, const fs::path& relative) {
+	const fs::path from = backup_path / relative;
+	if (!fs::is_regular_file(from))
+		return;
+	const fs::path to = backup_path / client_path(client, relative);
+	fs::create_directories(to.parent_path());
+	fs::rename(from, to);
+	index.remove(relative);
+}
@@ -0,0 +1,92 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "Chunk_index.h"
+#include "Partial_file.h"
+#include "../utils/Chunker.h"
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// An incoming file. Its contents are written to fd() at their offsets
+// in the file, then commit() makes it part of the backup, calling stored
+// once it is, which may be later and on another thread, or counting it
+// in the tally if it can't be.
+// Destroying an uncommitted upload keeps what was received for a retry.
+class Upload {
+public:
+	Upload(const std::filesystem::path& partial_path, const Checksum& c) : partial{partial_path, c} {}
+	virtual ~Upload() = default;
+	int fd() const { return partial.fd(); }
+	// Bytes from the start an interrupted upload left in place
+	uint64_t held() const { return partial.held(); }
+	// Write on from offset, which must be within what is held
+	void start_at(uint64_t offset) { partial.start_at(offset); }
+	// The contents before end are all in place
+	void received(uint64_t end) { partial.progress(end); }
+	virtual void commit(std::function<void()> stored, std::shared_ptr<Commit_tally> tally) = 0;
+protected:
+	Partial_file partial;
+};
+
+// Where received files end up. Each client's files are kept apart,
+// under a directory named by its id, which must be a safe file name.
+class Storage {
+public:
+	virtual ~Storage() = default;
+	// Bytes from the start of a file with this checksum that an interrupted
+	// upload left, so a file sent whole may start at any offset up to it
+	virtual uint64_t resumable(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&) const = 0;
+	// A file sent whole, from offset on
+	virtual std::unique_ptr<Upload> begin_file(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, uint64_t offset) = 0;
+	// A file sent as a delta, sets the flags of the chunks that must be sent
+	virtual std::unique_ptr<Upload> begin_delta(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, const std::vector<Chunk>& chunks, std::vector<bool>& needed) = 0;
+	// Move a file stored before files were kept per client to the client's,
+	// if it is there
+	virtual void adopt(const std::string& client, const std::filesystem::path& relative) = 0;
+	// Whether clients should send every file as a chunk list
+	virtual bool prefers_chunks() const = 0;
+};
+
+// A client's file relative to the root of a storage
+inline std::filesystem::path client_path(const std::string& client, const std::filesystem::path& relative) {
+	return std::filesystem::path{client} / relative;
+}
+
+// Files are written verbatim under the backup directory, received under
+// a directory of partial files outside it, so the backup only ever holds
+// complete files. Deltas reuse chunks of the previous version of the same file.
+class Plain_storage : public Storage {
+public:
+	// Throws unless partials are on the file system of the backup,
+	// as received files are moved into it with a rename
+	Plain_storage(std::filesystem::path backup, std::filesystem::path partial,
+			std::filesystem::path chunk_index, Committer&);
+
+	uint64_t resumable(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&) const override;
+	std::unique_ptr<Upload> begin_file(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, uint64_t offset) override;
+	std::unique_ptr<Upload> begin_delta(const std::string& client, const std::filesystem::path& relative,
+			const Checksum&, const std::vector<Chunk>& chunks, std::vector<bool>& needed) override;
+	void adopt(const std::string& client, const std::filesystem::path& relative) override;
+	bool prefers_chunks() const override { return false; }
+private:
+	std::filesystem::path partial_path(const std::filesystem::path& relative) const;
+
+	std::filesystem::path backup_path;
+	std::filesystem::path partial_root;
+	Chunk_index index;
+	Committer& committer;
+};
+
+// Opens a file for writing, throwing on failure
+int open_for_writing(const std::filesystem::path&);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef BLOCKING_QUEUE_H
+#define BLOCKING_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Queue handing items from producer threads to consumer threads.
+// Once closed, consumers drain the remaining items and then stop.
+template <typename T>
+class Blocking_queue {
+public:
+	void push(T item) {
+		{
+			std::lock_guard<std::mutex> lock{m};
+			items.push_back(std::move(item));
+		}
+		cv.notify_one();
+	}
+	// Blocks until an item is available, false once closed and empty
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock{m};
+		cv.wait(lock, [this]{ return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock{m};
+			closed = true;
+		}
+		cv.notify_all();
+	}
+private:
+	std::deque<T> items;
+	std::mutex m;
+	std::condition_variable cv;
+	bool closed = false;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "Chunker.h"
+#include "Rate_limiter.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Gear table, generated with splitmix64 from a fixed seed.
+// Changing it moves every cut point, so it must never change.
+struct Gear_table {
+	Gear_table() {
+		uint64_t x = 0x6a09e667f3bcc909;
+		for (uint64_t& v : t) {
+			uint64_t z = (x += 0x9e3779b97f4a7c15);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+			v = z ^ (z >> 31);
+		}
+	}
+	uint64_t t[256];
+};
+
+const Gear_table gear;
+
+// The gear hash shifts older bytes towards the high bits, so masks test the top.
+// Harder to match before the average size, easier after, which
+// narrows the spread of chunk sizes around the average.
+constexpr uint64_t mask_small = ~uint64_t{0} << (64 - 18);
+constexpr uint64_t mask_large = ~uint64_t{0} << (64 - 14);
+
+}
+
+size_t chunk_boundary(const unsigned char* data, size_t n) {
+	if (n <= min_chunk_size)
+		return n;
+	if (n > max_chunk_size)
+		n = max_chunk_size;
+	const size_t normal = std::min<size_t>(n, avg_chunk_size);
+	uint64_t fp = 0;
+	size_t i = min_chunk_size;
+	for (; i < normal; ++i) {
+		fp = (fp << 1) + gear.t[data[i]];
+		if (!(fp & mask_small))
+			return i;
+	}
+	for (; i < n; ++i) {
+		fp = (fp << 1) + gear.t[data[i]];
+		if (!(fp & mask_large))
+			return i;
+	}
+	return n;
+}
+
+std::vector<Chunk> chunk_file(int fd) {
+	constexpr size_t bufsize = 4 * max_chunk_size;
+	std::vector<unsigned char> buf(bufsize);
+	std::vector<Chunk> chunks;
+	size_t begin = 0, end = 0;	// Unprocessed bytes in buf
+	uint64_t offset = 0;
+	bool eof = false;
+	for (;;) {
+		// Keep at least a maximal chunk buffered, so cut points don't depend on reads
+		if (!eof && end - begin < max_chunk_size) {
+			std::copy(buf.begin() + begin, buf.begin() + end, buf.begin());
+			end -= begin;
+			begin = 0;
+			while (!eof && end < bufsize) {
+				ssize_t n = read(fd, buf.data() + end, bufsize - end);
+				if (n == -1 && errno == EINTR)
+					continue;
+				if (n == -1)
+					throw std::runtime_error{"failed read() " + std::to_string(errno)};
+				if (n == 0)
+					eof = true;
+				disk_read_limit().consume(n);
+				end += n;
+			}
+		}
+		if (begin == end)
+			return chunks;
+		const size_t length = chunk_boundary(buf.data() + begin, end - begin);
+		chunks.push_back(Chunk{offset, static_cast<uint32_t>(length), sha256(buf.data() + begin, length)});
+		begin += length;
+		offset += length;
+	}
+}
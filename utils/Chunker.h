@@ -0,0 +1,31 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "Sha256.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Piece of a file, identified by the SHA-256 of its contents
+struct Chunk {
+	uint64_t offset;
+	uint32_t length;
+	Digest digest;
+};
+
+// Content-defined chunking (FastCDC with normalized chunking).
+// Cut points depend on a rolling gear hash of the contents, so an edit
+// only changes the chunks around it instead of shifting every later one.
+constexpr uint32_t min_chunk_size = 16 * 1024;
+constexpr uint32_t avg_chunk_size = 64 * 1024;
+constexpr uint32_t max_chunk_size = 256 * 1024;
+
+// Length of the chunk at the start of data, given n available bytes.
+// At the end of the input, all remaining bytes must be passed.
+size_t chunk_boundary(const unsigned char* data, size_t n);
+
+// Splits a whole file into chunks, reading it from the current position
+std::vector<Chunk> chunk_file(int fd);
+
+#endif
@@ -0,0 +1,214 @@
+#include "Compressor.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+// The LZ4 block format: a sequence is a token holding the literal count
+// and match length in its nibbles (15 meaning more bytes of 255 follow),
+// the literals, and a 16-bit little-endian offset back to the match.
+// The last sequence only has literals.
+
+namespace {
+
+constexpr size_t min_match = 4;
+constexpr size_t last_literals = 5;		// The block ends with literals
+constexpr size_t match_start_limit = 12;	// No match starts closer to the end
+constexpr size_t max_offset = 65535;
+constexpr unsigned hash_log = 12;
+
+uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint32_t hash(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - hash_log);
+}
+
+// Extra length bytes after a nibble of 15
+unsigned char* write_length(unsigned char* op, size_t length) {
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = static_cast<unsigned char>(length);
+	return op;
+}
+
+size_t read_length(const unsigned char*& ip, const unsigned char* end) {
+	size_t length = 0;
+	unsigned char b = 0;
+	do {
+		if (ip == end)
+			throw std::runtime_error{"truncated compressed block"};
+		b = *ip++;
+		length += b;
+	} while (b == 255);
+	return length;
+}
+
+}
+
+std::string to_string(Compression c) {
+	switch (c) {
+	case Compression::none: return "none";
+	case Compression::lz4: return "lz4";
+	}
+	throw std::runtime_error{"unknown compression " + std::to_string(static_cast<int>(c))};
+}
+
+size_t compress_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+size_t compress(const char* src, size_t n, char* dst, size_t capacity, int level) {
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+	unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+	unsigned char* const out_end = op + capacity;
+
+	// Positions of recent 4 byte sequences, by hash
+	thread_local std::array<uint32_t, 1 << hash_log> table;
+	table.fill(0);
+	// Searching speeds up over stretches without matches,
+	// higher levels give up later
+	const unsigned skip_strength = 2 + std::clamp(level, 1, max_compression_level);
+
+	size_t anchor = 0;	// Start of pending literals
+	size_t ip = 0;
+	if (n >= match_start_limit) {
+		const size_t match_limit = n - last_literals;
+		const size_t ip_limit = n - match_start_limit;
+		size_t misses = 0;
+		while (ip <= ip_limit) {
+			const uint32_t sequence = read32(in + ip);
+			const uint32_t h = hash(sequence);
+			size_t candidate = table[h];
+			table[h] = ip;
+			if (candidate >= ip || ip - candidate > max_offset || read32(in + candidate) != sequence) {
+				ip += 1 + (misses++ >> skip_strength);
+				continue;
+			}
+			misses = 0;
+			while (ip > anchor && candidate > 0 && in[ip - 1] == in[candidate - 1]) {
+				--ip;
+				--candidate;
+			}
+			size_t length = min_match;
+			while (ip + length < match_limit && in[ip + length] == in[candidate + length])
+				++length;
+
+			const size_t literals = ip - anchor;
+			if (static_cast<size_t>(out_end - op) < 1 + literals / 255 + 1 + literals + 2 + length / 255 + 1)
+				return 0;
+			unsigned char* token = op++;
+			if (literals >= 15) {
+				*token = 15 << 4;
+				op = write_length(op, literals - 15);
+			} else {
+				*token = literals << 4;
+			}
+			std::memcpy(op, in + anchor, literals);
+			op += literals;
+			const size_t offset = ip - candidate;
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+			const size_t extra = length - min_match;
+			if (extra >= 15) {
+				*token |= 15;
+				op = write_length(op, extra - 15);
+			} else {
+				*token |= extra;
+			}
+			ip += length;
+			anchor = ip;
+			if (ip <= ip_limit)
+				table[hash(read32(in + ip - 2))] = ip - 2;
+		}
+	}
+
+	const size_t literals = n - anchor;
+	if (static_cast<size_t>(out_end - op) < 1 + literals / 255 + 1 + literals)
+		return 0;
+	if (literals >= 15) {
+		*op++ = 15 << 4;
+		op = write_length(op, literals - 15);
+	} else {
+		*op++ = literals << 4;
+	}
+	std::memcpy(op, in + anchor, literals);
+	op += literals;
+	return op - reinterpret_cast<unsigned char*>(dst);
+}
+
+void decompress(const char* src, size_t n, char* dst, size_t raw_size) {
+	const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+	const unsigned char* const in_end = ip + n;
+	unsigned char* const out = reinterpret_cast<unsigned char*>(dst);
+	unsigned char* op = out;
+	unsigned char* const out_end = out + raw_size;
+	while (ip < in_end) {
+		const unsigned char token = *ip++;
+		size_t literals = token >> 4;
+		if (literals == 15)
+			literals += read_length(ip, in_end);
+		if (literals > static_cast<size_t>(in_end - ip) || literals > static_cast<size_t>(out_end - op))
+			throw std::runtime_error{"corrupt compressed block"};
+		std::memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == in_end)
+			break;	// Last sequence
+
+		if (in_end - ip < 2)
+			throw std::runtime_error{"truncated compressed block"};
+		const size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t length = token & 15;
+		if (length == 15)
+			length += read_length(ip, in_end);
+		length += min_match;
+		if (offset == 0 || offset > static_cast<size_t>(op - out)
+				|| length > static_cast<size_t>(out_end - op))
+			throw std::runtime_error{"corrupt compressed block"};
+		const unsigned char* match = op - offset;
+		if (offset >= length) {
+			std::memcpy(op, match, length);
+			op += length;
+		} else {
+			// Overlapping copy repeats the last offset bytes
+			for (size_t i = 0; i < length; ++i)
+				*op++ = match[i];
+		}
+	}
+	if (op != out_end)
+		throw std::runtime_error{"compressed block has the wrong size"};
+}
+
+bool looks_compressible(const char* data, size_t n) {
+	// Bytes of evenly spread samples, in bits per byte
+	constexpr size_t samples = 16;
+	constexpr size_t sample_size = 256;
+	constexpr double max_entropy = 7.5;
+	if (n == 0)
+		return false;
+
+	std::array<uint32_t, 256> counts{};
+	size_t total = 0;
+	const size_t stride = std::max(n / samples, sample_size);
+	for (size_t start = 0; start < n; start += stride) {
+		const size_t end = std::min(n, start + sample_size);
+		for (size_t i = start; i < end; ++i)
+			++counts[static_cast<unsigned char>(data[i])];
+		total += end - start;
+	}
+	double entropy = 0;
+	for (uint32_t c : counts) {
+		if (c == 0)
+			continue;
+		const double p = static_cast<double>(c) / total;
+		entropy -= p * std::log2(p);
+	}
+	return entropy < max_entropy;
+}
@@ -0,0 +1,31 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Compression of file contents on the wire, the values are part of the protocol
+enum class Compression : uint8_t {
+	none = 0,
+	lz4 = 1		// LZ4 block format, one block per frame
+};
+
+std::string to_string(Compression);
+
+// Levels trade speed for ratio, 0 disables compression
+constexpr int max_compression_level = 9;
+
+// Largest output of compress() for n input bytes
+size_t compress_bound(size_t n);
+// Compresses n bytes into out, returns the compressed size,
+// or 0 if it would exceed capacity
+size_t compress(const char* in, size_t n, char* out, size_t capacity, int level);
+// Decompresses exactly raw_size bytes, throwing on corrupt input
+void decompress(const char* in, size_t n, char* out, size_t raw_size);
+
+// Estimates the entropy of sampled bytes, so that data that is already
+// compressed or encrypted isn't run through the compressor in vain
+bool looks_compressible(const char* data, size_t n);
+
+#endif
@@ -1,23 +1,18 @@
 #include "Directory.h"
+#include "Walker.h"
+
 #include <filesystem>
+#include <thread>
 
 namespace fs = std::filesystem;
 
 std::vector<std::string> directories(const std::vector<fs::path>& paths) {
 	// Holds directory names
 	std::vector<std::string> dir_vec;
+	// Recursive search, unaccessible directories are skipped
+	for (const fs::path& dir : walk(paths, std::thread::hardware_concurrency()).directories)
+		dir_vec.push_back(dir.filename());
 	for (const fs::path& path : paths) {
-		// Recursive search
-		for (const fs::directory_entry& e : fs::recursive_directory_iterator{
-				path, fs::directory_options::skip_permission_denied
-			}) try {
-			if (fs::is_directory(e)) {
-				// Insert name of current directory
-				dir_vec.push_back(e.path().filename());
-			}
-		} catch (...) {
-			// Skip unaccessible entries
-		}
 		for (fs::path p{path}; p != p.root_path(); p = p.parent_path()) {
 			if (fs::is_directory(p)) {
 				dir_vec.push_back(p.filename());
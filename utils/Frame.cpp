@@ -0,0 +1,413 @@
+#include "Frame.h"
+#include "Rate_limiter.h"
+#include "Transfer.h"
+
+#include <endian.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// Raw size and compressed block
+const uint32_t max_compressed_chunk_payload = 4 + compress_bound(compressed_block_size);
+// Queued frames are sent once they add up to this size
+constexpr size_t flush_threshold = 64 * 1024;
+
+}
+
+Frame_header parse_frame_header(const char* data) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	if (p[0] != protocol_version)
+		throw std::runtime_error{"unsupported protocol version " + std::to_string(p[0])};
+	uint32_t length = 0;
+	std::memcpy(&length, p + 4, sizeof(length));
+	Frame_header h{static_cast<Frame_type>(p[1]), be32toh(length)};
+	const uint32_t limit = h.type == Frame_type::file_chunk ? max_chunk_payload
+		: h.type == Frame_type::chunk_list ? max_chunk_list_payload
+		: h.type == Frame_type::compressed_chunk ? max_compressed_chunk_payload
+		: max_frame_payload;
+	if (h.length > limit)
+		throw std::runtime_error{"frame too large (" + std::to_string(h.length) + " bytes)"};
+	return h;
+}
+
+void append_frame_header(std::string& out, Frame_type type, uint32_t length) {
+	const char h[4] = {
+		static_cast<char>(protocol_version),
+		static_cast<char>(type),
+		0, 0
+	};
+	out.append(h, sizeof(h));
+	const uint32_t be = htobe32(length);
+	out.append(reinterpret_cast<const char*>(&be), sizeof(be));
+}
+
+Payload_writer& Payload_writer::u8(uint8_t v) {
+	data += static_cast<char>(v);
+	return *this;
+}
+
+Payload_writer& Payload_writer::u32(uint32_t v) {
+	const uint32_t be = htobe32(v);
+	data.append(reinterpret_cast<const char*>(&be), sizeof(be));
+	return *this;
+}
+
+Payload_writer& Payload_writer::u64(uint64_t v) {
+	const uint64_t be = htobe64(v);
+	data.append(reinterpret_cast<const char*>(&be), sizeof(be));
+	return *this;
+}
+
+Payload_writer& Payload_writer::varint(uint64_t v) {
+	for (; v >= 0x80; v >>= 7)
+		data += static_cast<char>(v | 0x80);
+	data += static_cast<char>(v);
+	return *this;
+}
+
+Payload_writer& Payload_writer::str(std::string_view s) {
+	u32(s.size());
+	data.append(s);
+	return *this;
+}
+
+Payload_writer& Payload_writer::bytes(const void* p, size_t n) {
+	data.append(static_cast<const char*>(p), n);
+	return *this;
+}
+
+std::string Payload_writer::frame(Frame_type type) const {
+	std::string f;
+	f.reserve(frame_header_size + data.size());
+	append_frame_header(f, type, data.size());
+	f += data;
+	return f;
+}
+
+std::string_view Payload_reader::take(size_t n) {
+	if (data.size() - pos < n)
+		throw std::runtime_error{"truncated frame"};
+	std::string_view s = data.substr(pos, n);
+	pos += n;
+	return s;
+}
+
+uint8_t Payload_reader::u8() {
+	return static_cast<uint8_t>(take(1)[0]);
+}
+
+uint32_t Payload_reader::u32() {
+	uint32_t v = 0;
+	std::memcpy(&v, take(sizeof(v)).data(), sizeof(v));
+	return be32toh(v);
+}
+
+uint64_t Payload_reader::u64() {
+	uint64_t v = 0;
+	std::memcpy(&v, take(sizeof(v)).data(), sizeof(v));
+	return be64toh(v);
+}
+
+uint64_t Payload_reader::varint() {
+	uint64_t v = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		const uint8_t b = u8();
+		v |= uint64_t{b & 0x7fu} << shift;
+		if (!(b & 0x80))
+			return v;
+	}
+	throw std::runtime_error{"varint too long"};
+}
+
+std::string Payload_reader::str() {
+	const uint32_t n = u32();
+	return std::string{take(n)};
+}
+
+void Payload_reader::bytes(void* out, size_t n) {
+	std::memcpy(out, take(n).data(), n);
+}
+
+void Payload_reader::finish() const {
+	if (pos != data.size())
+		throw std::runtime_error{"trailing bytes in frame"};
+}
+
+std::string encode(const Hello& h) {
+	return Payload_writer{}
+		.u8(static_cast<uint8_t>(h.algorithm))
+		.u8(static_cast<uint8_t>(h.compression))
+		.str(h.client_id)
+		.u64(h.session_id)
+		.frame(Frame_type::hello);
+}
+
+std::string encode(const File_header& h) {
+	return Payload_writer{}.str(h.path).u64(h.size).u64(h.offset).frame(Frame_type::file_header);
+}
+
+std::string encode(const Chunk_list& l) {
+	Payload_writer w;
+	w.str(l.path).u64(l.size).u32(l.chunks.size());
+	for (const Chunk& c : l.chunks)
+		w.u32(c.length).bytes(c.digest.data(), c.digest.size());
+	return w.frame(Frame_type::chunk_list);
+}
+
+std::string encode(const Chunk_need& n) {
+	std::string bitmap((n.needed.size() + 7) / 8, '\0');
+	for (size_t i = 0; i < n.needed.size(); ++i)
+		if (n.needed[i])
+			bitmap[i / 8] |= 1 << (i % 8);
+	return Payload_writer{}
+		.str(n.path)
+		.u32(n.needed.size())
+		.bytes(bitmap.data(), bitmap.size())
+		.frame(Frame_type::chunk_need);
+}
+
+std::string encode(const Outdated_entry& e) {
+	return Payload_writer{}.str(e.path).u8(e.as_chunks).u64(e.offset).frame(Frame_type::outdated_entry);
+}
+
+std::string encode(const Join& j) {
+	return Payload_writer{}.u64(j.session_id).frame(Frame_type::join);
+}
+
+std::string encode_error(const std::string& message) {
+	return Payload_writer{}.str(message).frame(Frame_type::error);
+}
+
+std::string encode(Frame_type type) {
+	return Payload_writer{}.frame(type);
+}
+
+Hello decode_hello(std::string_view payload) {
+	Payload_reader r{payload};
+	Hello h;
+	h.algorithm = static_cast<Hash_algorithm>(r.u8());
+	h.compression = static_cast<Compression>(r.u8());
+	h.client_id = r.str();
+	h.session_id = r.u64();
+	r.finish();
+	to_string(h.algorithm);	// Throws on unknown algorithms
+	to_string(h.compression);
+	return h;
+}
+
+File_header decode_file_header(std::string_view payload) {
+	Payload_reader r{payload};
+	File_header h;
+	h.path = r.str();
+	h.size = r.u64();
+	h.offset = r.u64();
+	if (h.offset > h.size)
+		throw std::runtime_error{"file offset past its end"};
+	r.finish();
+	return h;
+}
+
+Chunk_list decode_chunk_list(std::string_view payload) {
+	Payload_reader r{payload};
+	Chunk_list l;
+	l.path = r.str();
+	l.size = r.u64();
+	const uint32_t count = r.u32();
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		Chunk c;
+		c.offset = offset;
+		c.length = r.u32();
+		r.bytes(c.digest.data(), c.digest.size());
+		if (c.length == 0 || c.length > max_chunk_payload)
+			throw std::runtime_error{"invalid chunk length"};
+		offset += c.length;
+		l.chunks.push_back(c);
+	}
+	r.finish();
+	if (offset != l.size)
+		throw std::runtime_error{"chunk list doesn't cover the file"};
+	return l;
+}
+
+Chunk_need decode_chunk_need(std::string_view payload) {
+	Payload_reader r{payload};
+	Chunk_need n;
+	n.path = r.str();
+	const uint32_t count = r.u32();
+	if (count > payload.size() * 8)
+		throw std::runtime_error{"truncated frame"};
+	n.needed.resize(count);
+	std::string bitmap((n.needed.size() + 7) / 8, '\0');
+	r.bytes(bitmap.data(), bitmap.size());
+	r.finish();
+	for (size_t i = 0; i < n.needed.size(); ++i)
+		n.needed[i] = bitmap[i / 8] & (1 << (i % 8));
+	return n;
+}
+
+Outdated_entry decode_outdated(std::string_view payload) {
+	Payload_reader r{payload};
+	Outdated_entry e;
+	e.path = r.str();
+	e.as_chunks = r.u8() != 0;
+	e.offset = r.u64();
+	r.finish();
+	return e;
+}
+
+Join decode_join(std::string_view payload) {
+	Payload_reader r{payload};
+	Join j;
+	j.session_id = r.u64();
+	r.finish();
+	if (j.session_id == 0)
+		throw std::runtime_error{"invalid session id"};
+	return j;
+}
+
+std::string decode_error(std::string_view payload) {
+	Payload_reader r{payload};
+	return r.str();
+}
+
+bool Frame_stream::fill(size_t n) {
+	constexpr size_t bufsize = 64 * 1024;
+	if (pos > 0 && buffer.size() - pos < n) {
+		buffer.erase(0, pos);
+		pos = 0;
+	}
+	while (buffer.size() - pos < n) {
+		const size_t old_size = buffer.size();
+		buffer.resize(old_size + std::max(bufsize, n));
+		ssize_t status = ::read(sock, buffer.data() + old_size, buffer.size() - old_size);
+		buffer.resize(old_size + std::max<ssize_t>(status, 0));
+		if (status == 0)
+			return false;
+		if (status == -1 && errno != EINTR)
+			throw std::runtime_error{"failed read() " + std::to_string(errno)};
+	}
+	return true;
+}
+
+bool Frame_stream::read(Frame& f) {
+	flush();	// The peer may be waiting for what's queued
+	if (!fill(frame_header_size)) {
+		if (buffer.size() == pos)
+			return false;
+		throw std::runtime_error{"connection closed mid-frame"};
+	}
+	const Frame_header h = parse_frame_header(buffer.data() + pos);
+	if (!fill(frame_header_size + h.length))
+		throw std::runtime_error{"connection closed mid-frame"};
+	f.type = h.type;
+	f.payload.assign(buffer, pos + frame_header_size, h.length);
+	pos += frame_header_size + h.length;
+	if (f.type == Frame_type::error)
+		throw std::runtime_error{"peer error: " + decode_error(f.payload)};
+	return true;
+}
+
+void Frame_stream::write(std::string frame) {
+	std::lock_guard<std::mutex> lock{write_mutex};
+	pending.push(std::move(frame));
+	if (pending.size() >= flush_threshold)
+		flush_pending();
+}
+
+void Frame_stream::flush() {
+	std::lock_guard<std::mutex> lock{write_mutex};
+	flush_pending();
+	if (corked) {
+		set_cork(sock, false);
+		corked = false;
+	}
+}
+
+void Frame_stream::flush_pending() {
+	pending.flush();
+}
+
+void Frame_stream::begin_bulk() {
+	if (cork && !corked) {
+		set_cork(sock, true);
+		corked = true;
+	}
+}
+
+void Frame_stream::write_file_chunks(int file_fd, off_t offset, uint64_t count, int level) {
+	if (level > 0) {
+		write_compressed_chunks(file_fd, offset, count, level);
+		return;
+	}
+	while (count > 0) {
+		const uint32_t n = std::min<uint64_t>(count, max_chunk_payload);
+		// Other frames may go between chunks, but not inside one
+		std::lock_guard<std::mutex> lock{write_mutex};
+		begin_bulk();
+		std::string header;
+		append_frame_header(header, Frame_type::file_chunk, n);
+		pending.append(header);
+		flush_pending();
+		// Read and sent at once, so both limits apply to each part
+		for (uint32_t done = 0; done < n; ) {
+			size_t part = n - done;
+			for (size_t slice : {network_limit().slice(), disk_read_limit().slice()})
+				if (slice > 0)
+					part = std::min(part, slice);
+			if (send_file_contents(sock, file_fd, offset + done, part) != part)
+				throw std::runtime_error{"file shrank while sending"};
+			network_limit().consume(part);
+			disk_read_limit().consume(part);
+			done += part;
+		}
+		offset += n;
+		count -= n;
+	}
+}
+
+void Frame_stream::write_compressed_chunks(int file_fd, off_t offset, uint64_t count, int level) {
+	thread_local std::vector<char> raw;
+	raw.resize(compressed_block_size);
+	while (count > 0) {
+		const uint32_t n = std::min<uint64_t>(count, compressed_block_size);
+		if (read_at(file_fd, raw.data(), n, offset) != n)
+			throw std::runtime_error{"file shrank while sending"};
+		disk_read_limit().consume(n);
+		// Blocks are queued as they are, the memory of sent ones reused
+		std::string block;
+		{
+			std::lock_guard<std::mutex> lock{write_mutex};
+			block = pending.spare();
+		}
+		// Not worth decompressing unless it saves a few percent
+		size_t packed_size = 0;
+		if (looks_compressible(raw.data(), n)) {
+			block.resize(compress_bound(n));
+			packed_size = compress(raw.data(), n, block.data(), n - n / 32, level);
+		}
+		std::string header;
+		if (packed_size > 0) {
+			append_frame_header(header, Frame_type::compressed_chunk, 4 + packed_size);
+			const uint32_t be = htobe32(n);
+			header.append(reinterpret_cast<const char*>(&be), sizeof(be));
+			block.resize(packed_size);
+		} else {
+			append_frame_header(header, Frame_type::file_chunk, n);
+			block.assign(raw.data(), n);
+		}
+		std::lock_guard<std::mutex> lock{write_mutex};
+		begin_bulk();
+		pending.append(header);
+		pending.push(std::move(block));
+		if (pending.size() >= flush_threshold)
+			flush_pending();
+		offset += n;
+		count -= n;
+	}
+}
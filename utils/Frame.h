@@ -0,0 +1,247 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "Hasher.h"
+#include "Chunker.h"
+#include "Compressor.h"
+#include "Transport.h"
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Wire protocol. Every frame starts with an 8 byte header:
+//   u8 version, u8 type, u16 reserved (zero), u32 payload length
+// followed by the payload. Integers are big-endian, strings are
+// prefixed with their u32 length.
+//
+// A session runs:
+//   client: hello, manifest_batch..., manifest_end
+//   server: outdated_entry..., outdated_end
+//   client: (file_header, file_chunk...)..., files_end
+//   server: ack
+// The phases overlap: the server requests each outdated file as soon as
+// its manifest entry arrives, and the client may send requested files
+// while the manifest is still being streamed. Manifest batches may come
+// between the chunks of a file, but files_end only after manifest_end.
+// Either side may send an error frame and close the connection instead.
+// Manifest batches are described in Manifest_codec.h.
+//
+// Instead of file_header, large files may be sent as a delta:
+//   client: chunk_list
+//   server: chunk_need
+//   client: file_chunk for each needed chunk, in order
+// The server rebuilds the file from the chunks it already stores
+// and the ones it received. It may ask for any file to be sent this way
+// by flagging its outdated_entry.
+//
+// File contents may be sent as compressed_chunk frames instead of
+// file_chunk, if the hello announced a compression. Each holds one
+// compressed block, decompressed on arrival, and a delta chunk always
+// fits in one.
+//
+// Interrupted transfers are resumed. When the server still holds the start
+// of a requested file from an earlier session, its outdated_entry carries
+// the number of bytes held, and the file_header the offset the contents
+// are sent from. A delta skips the chunks held without further ado.
+//
+// Small files may be sent whole in a file_pack instead of file_header and
+// chunks, many to a frame. Its payload is a sequence of files, each its
+// path, u64 size and contents. With compression, a pack may be sent as a
+// compressed_pack, its u32 size followed by the pack compressed as one block.
+//
+// Files may be uploaded over more connections than the one of the session.
+// Its hello then carries a random session id, and each further connection
+// starts with a join frame naming it instead of a hello. Such a connection
+// sends (file_header, file_chunk...), chunk lists and packs like the first,
+// but no manifest, and ends with files_end, which the server acknowledges
+// on it. The files_end of the session's own connection comes last.
+
+constexpr uint8_t protocol_version = 5;
+constexpr size_t frame_header_size = 8;
+// Frames other than file chunks are buffered whole, so their size is bounded
+constexpr uint32_t max_frame_payload = 1 << 20;
+// Chunk lists of huge files are larger
+constexpr uint32_t max_chunk_list_payload = 1 << 26;
+// File contents are split into chunks of at most this size
+constexpr uint32_t max_chunk_payload = 1 << 24;
+// Compressed file contents are split into blocks of this size
+constexpr uint32_t compressed_block_size = max_chunk_size;
+// Packs of small files are buffered whole like other frames
+constexpr uint32_t max_pack_payload = max_frame_payload;
+
+enum class Frame_type : uint8_t {
+	hello = 1,			// Checksum algorithm of the manifest, compression, client id
+	manifest_batch = 2,	// Paths and checksums of local files
+	manifest_end = 3,
+	outdated_entry = 4,	// Path of a file the server needs, and how to send it
+	outdated_end = 5,
+	file_header = 6,	// Path and size of the file whose chunks follow
+	file_chunk = 7,		// Raw file contents
+	files_end = 8,
+	ack = 9,			// Server stored everything it was sent
+	error = 10,			// Human readable reason for giving up
+	chunk_list = 11,	// Path, size and chunks of a file to send as a delta
+	chunk_need = 12,	// Which chunks of the list the server lacks
+	compressed_chunk = 13,	// Size and compressed contents of a block of a file
+	file_pack = 14,		// Paths, sizes and contents of whole small files
+	compressed_pack = 15,	// Size and compressed contents of a file_pack payload
+	join = 16			// Session a further connection uploads files for
+};
+
+struct Frame_header {
+	Frame_type type;
+	uint32_t length;
+};
+
+// Throws on an unsupported version or an oversized frame
+Frame_header parse_frame_header(const char* data);
+void append_frame_header(std::string& out, Frame_type, uint32_t length);
+
+struct Frame {
+	Frame_type type;
+	std::string payload;
+};
+
+// Builds payloads
+class Payload_writer {
+public:
+	Payload_writer& u8(uint8_t);
+	Payload_writer& u32(uint32_t);
+	Payload_writer& u64(uint64_t);
+	// LEB128, 7 bits per byte, small values first
+	Payload_writer& varint(uint64_t);
+	Payload_writer& str(std::string_view);
+	Payload_writer& bytes(const void* data, size_t n);
+	// Complete frame with this payload
+	std::string frame(Frame_type) const;
+	const std::string& payload() const { return data; }
+private:
+	std::string data;
+};
+
+// Reads payloads, throwing when reading past the end
+class Payload_reader {
+public:
+	explicit Payload_reader(std::string_view s) : data{s} {}
+	uint8_t u8();
+	uint32_t u32();
+	uint64_t u64();
+	uint64_t varint();
+	std::string str();
+	void bytes(void* out, size_t n);
+	// Next n bytes, valid as long as the payload
+	std::string_view view(size_t n) { return take(n); }
+	bool done() const { return pos == data.size(); }
+	// Throws unless the whole payload was read
+	void finish() const;
+private:
+	std::string_view take(size_t n);
+
+	std::string_view data;
+	size_t pos = 0;
+};
+
+struct Hello {
+	Hash_algorithm algorithm;
+	Compression compression = Compression::none;
+	std::string client_id;	// Names the set of files the server keeps for the client
+	uint64_t session_id = 0;	// Further connections may join unless zero
+};
+
+struct Join {
+	uint64_t session_id;
+};
+
+struct Manifest_entry {
+	std::string path;
+	Checksum checksum;
+};
+
+struct Outdated_entry {
+	std::string path;
+	bool as_chunks = false;	// Send as a chunk list, whatever its size
+	uint64_t offset = 0;	// Bytes the server holds already
+};
+
+struct File_header {
+	std::string path;
+	uint64_t size;
+	uint64_t offset = 0;	// Contents follow from here
+};
+
+struct Chunk_list {
+	std::string path;
+	uint64_t size;
+	std::vector<Chunk> chunks;	// Offsets follow from the lengths
+};
+
+struct Chunk_need {
+	std::string path;
+	std::vector<bool> needed;	// One flag per chunk of the list
+};
+
+std::string encode(const Hello&);
+std::string encode(const File_header&);
+std::string encode(const Chunk_list&);
+std::string encode(const Chunk_need&);
+std::string encode(const Outdated_entry&);
+std::string encode(const Join&);
+std::string encode_error(const std::string& message);
+// Frame without payload
+std::string encode(Frame_type);
+
+Hello decode_hello(std::string_view payload);
+File_header decode_file_header(std::string_view payload);
+Chunk_list decode_chunk_list(std::string_view payload);
+Chunk_need decode_chunk_need(std::string_view payload);
+Outdated_entry decode_outdated(std::string_view payload);
+Join decode_join(std::string_view payload);
+std::string decode_error(std::string_view payload);
+
+// Frames over a blocking socket. Reads are buffered,
+// so whole frames are parsed without a syscall per byte.
+// Frames may be written from several threads, but read from one.
+class Frame_stream {
+public:
+	explicit Frame_stream(int fd, const Socket_tuning& tuning = {})
+		: sock{fd}, cork{tuning.cork}, pending{fd, tuning.zerocopy_threshold} {}
+
+	// Blocks until a frame arrives, false at the end of the stream.
+	// Throws on error frames and on streams ending mid-frame.
+	bool read(Frame&);
+	// Small frames are coalesced, and sent once enough of them
+	// have been queued, before reading, or when flushed
+	void write(std::string frame);
+	// Also ends a bulk send, letting out what the cork held back
+	void flush();
+	// Sends count bytes of a file as file_chunk frames, or block by block
+	// as compressed_chunk frames at a non-zero level. Blocks that don't
+	// look compressible, or don't shrink enough, are sent as they are.
+	// The socket is corked until the next flush, so chunk headers and
+	// contents leave in full segments.
+	void write_file_chunks(int file_fd, off_t offset, uint64_t count, int level = 0);
+
+	int fd() const { return sock; }
+private:
+	// Buffer at least n unread bytes, false at the end of the stream
+	bool fill(size_t n);
+	// Send queued frames, with write_mutex held
+	void flush_pending();
+	void begin_bulk();
+	void write_compressed_chunks(int file_fd, off_t offset, uint64_t count, int level);
+
+	int sock;
+	std::string buffer;
+	size_t pos = 0;		// Start of unread bytes in buffer
+	bool cork;
+	bool corked = false;
+	Send_queue pending;	// Frames not yet sent
+	std::mutex write_mutex;
+};
+
+#endif
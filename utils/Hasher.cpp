@@ -0,0 +1,394 @@
+#include "Hasher.h"
+#include "Metrics.h"
+#include "Rate_limiter.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <boost/crc.hpp>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+uint64_t load64(const unsigned char* p) {
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint32_t load32(const unsigned char* p) {
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// CRC-32C, operating on the raw register without pre- and post-inversion
+
+constexpr uint32_t crc32c_poly = 0x82f63b78;	// Reflected Castagnoli polynomial
+
+// Slicing-by-8 tables for the portable implementation
+struct Crc32c_tables {
+	Crc32c_tables() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int k = 0; k < 8; ++k)
+				crc = (crc >> 1) ^ (crc & 1 ? crc32c_poly : 0);
+			t[0][i] = crc;
+		}
+		for (uint32_t i = 0; i < 256; ++i)
+			for (size_t k = 1; k < 8; ++k)
+				t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+	}
+	uint32_t t[8][256];
+};
+
+const Crc32c_tables& crc32c_tables() {
+	static const Crc32c_tables tables;
+	return tables;
+}
+
+uint32_t crc32c_software(uint32_t crc, const unsigned char* p, size_t n) {
+	const auto& t = crc32c_tables().t;
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t v = load64(p) ^ crc;
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff]
+			^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff]
+			^ t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff]
+			^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+	}
+	for (; n > 0; ++p, --n)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+// Bytes per stream of the interleaved hardware loop
+constexpr size_t crc32c_stripe = 8192;
+
+// Advancing a CRC register over a run of zero bytes is linear,
+// so it is tabulated per register byte for one stripe length.
+// This lets three independent streams be combined without PCLMULQDQ.
+struct Crc32c_shift {
+	Crc32c_shift() {
+		const std::vector<unsigned char> zeros(crc32c_stripe);
+		uint32_t column[32];
+		for (int bit = 0; bit < 32; ++bit)
+			column[bit] = crc32c_software(uint32_t{1} << bit, zeros.data(), zeros.size());
+		for (int byte = 0; byte < 4; ++byte)
+			for (uint32_t v = 0; v < 256; ++v) {
+				uint32_t r = 0;
+				for (int bit = 0; bit < 8; ++bit)
+					if (v & (1u << bit))
+						r ^= column[byte * 8 + bit];
+				t[byte][v] = r;
+			}
+	}
+	uint32_t operator()(uint32_t crc) const {
+		return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff]
+			^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+	}
+	uint32_t t[4][256];
+};
+
+const Crc32c_shift& crc32c_shift() {
+	static const Crc32c_shift shift;
+	return shift;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t n) {
+	for (; n > 0 && reinterpret_cast<uintptr_t>(p) % 8; ++p, --n)
+		crc = _mm_crc32_u8(crc, *p);
+	// The crc32 instruction has a latency of three cycles but a throughput
+	// of one, so three independent streams keep the unit busy
+	if (n >= 3 * crc32c_stripe) {
+		const Crc32c_shift& shift = crc32c_shift();
+		for (; n >= 3 * crc32c_stripe; p += 3 * crc32c_stripe, n -= 3 * crc32c_stripe) {
+			uint64_t c0 = crc, c1 = 0, c2 = 0;
+			for (size_t i = 0; i < crc32c_stripe; i += 8) {
+				c0 = _mm_crc32_u64(c0, load64(p + i));
+				c1 = _mm_crc32_u64(c1, load64(p + crc32c_stripe + i));
+				c2 = _mm_crc32_u64(c2, load64(p + 2 * crc32c_stripe + i));
+			}
+			crc = shift(shift(static_cast<uint32_t>(c0)) ^ static_cast<uint32_t>(c1))
+				^ static_cast<uint32_t>(c2);
+		}
+	}
+	uint64_t c = crc;
+	for (; n >= 8; p += 8, n -= 8)
+		c = _mm_crc32_u64(c, load64(p));
+	crc = static_cast<uint32_t>(c);
+	for (; n > 0; ++p, --n)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+
+#endif
+
+using Crc32c_kernel = uint32_t (*)(uint32_t, const unsigned char*, size_t);
+
+Crc32c_kernel select_crc32c_kernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();	// May run before the library's own constructor
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_hardware;
+#endif
+	return crc32c_software;
+}
+
+const Crc32c_kernel crc32c_kernel = select_crc32c_kernel();
+
+class Crc32_hasher : public Hasher {
+public:
+	void update(const void* data, size_t n) override {
+		value.process_bytes(data, n);
+	}
+	Checksum digest() const override {
+		return Checksum{Hash_algorithm::crc32, value.checksum()};
+	}
+private:
+	boost::crc_32_type value;
+};
+
+class Crc32c_hasher : public Hasher {
+public:
+	void update(const void* data, size_t n) override {
+		crc = crc32c_kernel(crc, static_cast<const unsigned char*>(data), n);
+	}
+	Checksum digest() const override {
+		return Checksum{Hash_algorithm::crc32c, ~crc};
+	}
+private:
+	uint32_t crc = 0xffffffff;
+};
+
+// Streaming XXH64 with a seed of zero
+class Xxh64_hasher : public Hasher {
+public:
+	void update(const void* data, size_t n) override {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		total += n;
+		if (buffered + n < sizeof(buffer)) {
+			std::memcpy(buffer + buffered, p, n);
+			buffered += n;
+			return;
+		}
+		if (buffered) {
+			const size_t fill = sizeof(buffer) - buffered;
+			std::memcpy(buffer + buffered, p, fill);
+			consume(buffer);
+			p += fill;
+			n -= fill;
+			buffered = 0;
+		}
+		for (; n >= sizeof(buffer); p += sizeof(buffer), n -= sizeof(buffer))
+			consume(p);
+		std::memcpy(buffer, p, n);
+		buffered = n;
+	}
+	Checksum digest() const override {
+		uint64_t h = 0;
+		if (total >= sizeof(buffer)) {
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for (uint64_t acc : v) {
+				h ^= round(0, acc);
+				h = h * p1 + p4;
+			}
+		} else {
+			h = p5;
+		}
+		h += total;
+		const unsigned char* p = buffer;
+		size_t n = buffered;
+		for (; n >= 8; p += 8, n -= 8) {
+			h ^= round(0, load64(p));
+			h = rotl(h, 27) * p1 + p4;
+		}
+		if (n >= 4) {
+			h ^= load32(p) * p1;
+			h = rotl(h, 23) * p2 + p3;
+			p += 4;
+			n -= 4;
+		}
+		for (; n > 0; ++p, --n) {
+			h ^= *p * p5;
+			h = rotl(h, 11) * p1;
+		}
+		h ^= h >> 33;
+		h *= p2;
+		h ^= h >> 29;
+		h *= p3;
+		h ^= h >> 32;
+		return Checksum{Hash_algorithm::xxh64, h};
+	}
+private:
+	static constexpr uint64_t p1 = 11400714785074694791ULL;
+	static constexpr uint64_t p2 = 14029467366897019727ULL;
+	static constexpr uint64_t p3 = 1609587929392839161ULL;
+	static constexpr uint64_t p4 = 9650029242287828579ULL;
+	static constexpr uint64_t p5 = 2870177450012600261ULL;
+
+	static uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+	static uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * p2;
+		return rotl(acc, 31) * p1;
+	}
+	void consume(const unsigned char* p) {
+		for (size_t i = 0; i < 4; ++i)
+			v[i] = round(v[i], load64(p + 8 * i));
+	}
+
+	uint64_t v[4] = { p1 + p2, p2, 0, 0 - p1 };
+	unsigned char buffer[32];
+	size_t buffered = 0;
+	uint64_t total = 0;
+};
+
+}
+
+std::string to_string(Hash_algorithm a) {
+	switch (a) {
+	case Hash_algorithm::crc32:		return "crc32";
+	case Hash_algorithm::crc32c:	return "crc32c";
+	case Hash_algorithm::xxh64:		return "xxh64";
+	}
+	throw std::runtime_error{"unknown hash algorithm " + std::to_string(static_cast<int>(a))};
+}
+
+Hash_algorithm parse_hash_algorithm(const std::string& s) {
+	if (s == "auto")
+		return best_hash_algorithm();
+	for (Hash_algorithm a : {Hash_algorithm::crc32, Hash_algorithm::crc32c, Hash_algorithm::xxh64})
+		if (s == to_string(a))
+			return a;
+	throw std::runtime_error{"unknown hash algorithm \"" + s + '"'};
+}
+
+Hash_algorithm best_hash_algorithm() {
+	// Checksums identify changed files in large trees,
+	// 32-bit values collide too often there
+	return Hash_algorithm::xxh64;
+}
+
+bool hardware_crc32c() {
+	return crc32c_kernel != crc32c_software;
+}
+
+bool operator==(const Checksum& a, const Checksum& b) {
+	return a.algorithm == b.algorithm && a.value == b.value;
+}
+
+bool operator!=(const Checksum& a, const Checksum& b) {
+	return !(a == b);
+}
+
+std::string to_string(const Checksum& c) {
+	std::ostringstream os;
+	os << to_string(c.algorithm) << ':' << std::hex << c.value;
+	return os.str();
+}
+
+Checksum parse_checksum(const std::string& s) {
+	const size_t colon = s.find(':');
+	try {
+		size_t end = 0;
+		if (colon == std::string::npos) {
+			uint64_t value = std::stoull(s, &end);
+			if (end == s.size() && value <= UINT32_MAX)
+				return Checksum{Hash_algorithm::crc32, value};
+		} else {
+			Hash_algorithm a = parse_hash_algorithm(s.substr(0, colon));
+			uint64_t value = std::stoull(s.substr(colon + 1), &end, 16);
+			if (colon + 1 + end == s.size())
+				return Checksum{a, value};
+		}
+	} catch (const std::logic_error&) {
+		// Reported below
+	}
+	throw std::runtime_error{"invalid checksum \"" + s + '"'};
+}
+
+std::ostream& operator<<(std::ostream& os, const Checksum& c) {
+	return os << to_string(c);
+}
+
+std::istream& operator>>(std::istream& is, Checksum& c) {
+	std::string s;
+	if (!(is >> s))
+		return is;
+	try {
+		c = parse_checksum(s);
+	} catch (const std::runtime_error&) {
+		is.setstate(std::ios_base::failbit);
+	}
+	return is;
+}
+
+std::unique_ptr<Hasher> make_hasher(Hash_algorithm a) {
+	switch (a) {
+	case Hash_algorithm::crc32:		return std::make_unique<Crc32_hasher>();
+	case Hash_algorithm::crc32c:	return std::make_unique<Crc32c_hasher>();
+	case Hash_algorithm::xxh64:		return std::make_unique<Xxh64_hasher>();
+	}
+	throw std::runtime_error{"unknown hash algorithm " + std::to_string(static_cast<int>(a))};
+}
+
+Checksum checksum(Hash_algorithm a, const std::string& s) {
+	std::unique_ptr<Hasher> h = make_hasher(a);
+	h->update(s.data(), s.size());
+	return h->digest();
+}
+
+Checksum checksum_of_file(Hash_algorithm a, const fs::path& path) {
+	static Counter& files_hashed = metrics().counter("backup_files_hashed_total", "Files checksummed");
+	static Counter& bytes_hashed = metrics().counter("backup_bytes_hashed_total", "Bytes checksummed");
+	static Histogram& hash_latency = metrics().histogram("backup_hash_file_microseconds",
+		"Time to read and checksum a file");
+	Latency_timer timer{hash_latency};
+	constexpr size_t bufsize = 256 * 1024;
+	thread_local std::vector<char> buffer(bufsize);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error{
+			"can't open "
+			+ path.string()
+			+ " for reading"
+		};
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	std::unique_ptr<Hasher> h = make_hasher(a);
+	uint64_t total = 0;
+	for (;;) {
+		ssize_t n = read(fd, buffer.data(), buffer.size());
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			int err = errno;
+			close(fd);
+			throw std::runtime_error{"can't read " + path.string() + ' ' + std::to_string(err)};
+		}
+		if (n == 0)
+			break;
+		disk_read_limit().consume(n);
+		h->update(buffer.data(), n);
+		total += n;
+	}
+	close(fd);
+	files_hashed.add();
+	bytes_hashed.add(total);
+	return h->digest();
+}
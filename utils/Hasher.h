@@ -0,0 +1,55 @@
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+
+// Checksum algorithms, the values are part of the on-disk formats
+enum class Hash_algorithm : uint8_t {
+	crc32 = 0,		// Legacy table-driven CRC-32
+	crc32c = 1,		// CRC-32C (Castagnoli), SSE4.2 accelerated when available
+	xxh64 = 2		// 64-bit xxHash
+};
+
+std::string to_string(Hash_algorithm);
+// Accepts the names from to_string, and "auto" for best_hash_algorithm()
+Hash_algorithm parse_hash_algorithm(const std::string&);
+// Fastest algorithm without 32-bit collisions
+Hash_algorithm best_hash_algorithm();
+// Whether CRC-32C runs on the SSE4.2 crc32 instruction on this CPU
+bool hardware_crc32c();
+
+// A checksum tagged with the algorithm that produced it,
+// written as "algorithm:hex". Bare decimal numbers are read as
+// crc32 values, as written by older versions.
+struct Checksum {
+	Hash_algorithm algorithm = Hash_algorithm::crc32;
+	uint64_t value = 0;
+};
+
+bool operator==(const Checksum&, const Checksum&);
+bool operator!=(const Checksum&, const Checksum&);
+std::string to_string(const Checksum&);
+Checksum parse_checksum(const std::string&);
+std::ostream& operator<<(std::ostream&, const Checksum&);
+std::istream& operator>>(std::istream&, Checksum&);
+
+// Incremental checksum calculation
+class Hasher {
+public:
+	virtual ~Hasher() = default;
+	virtual void update(const void* data, size_t n) = 0;
+	virtual Checksum digest() const = 0;
+};
+
+std::unique_ptr<Hasher> make_hasher(Hash_algorithm);
+
+Checksum checksum(Hash_algorithm, const std::string&);
+Checksum checksum_of_file(Hash_algorithm, const std::filesystem::path&);
+
+#endif
@@ -0,0 +1,17 @@
+#include "Log.h"
+
+#include <atomic>
+
+namespace {
+
+std::atomic<bool> quiet_mode{false};
+
+}
+
+bool quiet() {
+	return quiet_mode.load(std::memory_order_relaxed);
+}
+
+void set_quiet(bool on) {
+	quiet_mode.store(on, std::memory_order_relaxed);
+}
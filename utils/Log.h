@@ -0,0 +1,24 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <ostream>
+#include <sstream>
+
+// Whether per-file progress lines are left out, for large trees
+// where printing one per file costs more than it tells
+bool quiet();
+void set_quiet(bool);
+
+// Print a per-file progress line unless quiet. The line is formatted first
+// and written at once, so lines of different threads don't interleave.
+template <typename... Args>
+void log_file(std::ostream& os, const Args&... args) {
+	if (quiet())
+		return;
+	std::ostringstream line;
+	(line << ... << args);
+	line << '\n';
+	os << line.str();
+}
+
+#endif
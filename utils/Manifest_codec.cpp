@@ -0,0 +1,143 @@
+#include "Manifest_codec.h"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+
+namespace {
+
+// Checksums of 32-bit algorithms fit in 4 bytes
+bool wide(Hash_algorithm a) {
+	return a == Hash_algorithm::xxh64;
+}
+
+void write_name(Payload_writer& w, std::string_view name) {
+	w.varint(name.size());
+	w.bytes(name.data(), name.size());
+}
+
+std::string_view read_name(Payload_reader& r) {
+	constexpr uint64_t max_name = 4096;
+	const uint64_t n = r.varint();
+	if (n > max_name)
+		throw std::runtime_error{"name too long in manifest"};
+	return r.view(n);
+}
+
+void check_name(std::string_view name) {
+	if (name.empty() || name == "." || name == ".."
+			|| name.find('/') != std::string_view::npos
+			|| name.find('\0') != std::string_view::npos)
+		throw std::runtime_error{"invalid name \"" + std::string{name} + "\" in manifest"};
+}
+
+}
+
+uint32_t Manifest_encoder::directory_id(std::string_view path) {
+	if (path.empty())
+		return 0;
+	if (const std::optional<Path_id> known = directories.find(path))
+		return *known + 1;
+	const size_t slash = path.rfind('/');
+	const uint32_t parent = slash == std::string_view::npos ? 0 : directory_id(path.substr(0, slash));
+	const std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+	new_directories.emplace_back(parent, std::string{name});
+	pending_bytes += name.size() + 8;
+	return directories.intern(path) + 1;
+}
+
+void Manifest_encoder::add(std::string_view path, const Checksum& checksum) {
+	if (checksum.algorithm != algorithm)
+		throw std::runtime_error{"checksum algorithm differs from hello"};
+	const size_t slash = path.rfind('/');
+	Entry e;
+	e.directory = slash == std::string_view::npos ? 0 : directory_id(path.substr(0, slash));
+	e.name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+	e.checksum = checksum.value;
+	pending_bytes += e.name.size() + 16;
+	entries.push_back(std::move(e));
+}
+
+std::string Manifest_encoder::encode_batch() {
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.directory != b.directory ? a.directory < b.directory : a.name < b.name;
+	});
+	Payload_writer w;
+	w.varint(new_directories.size());
+	for (const auto& [parent, name] : new_directories) {
+		w.varint(parent);
+		write_name(w, name);
+	}
+	w.varint(entries.size());
+	uint32_t directory = 0;
+	std::string_view previous;
+	for (const Entry& e : entries) {
+		if (e.directory != directory)
+			previous = {};
+		const size_t shared = std::mismatch(
+			previous.cbegin(), previous.cend(), e.name.cbegin(), e.name.cend()
+		).first - previous.cbegin();
+		w.varint(e.directory - directory);
+		w.varint(shared);
+		write_name(w, std::string_view{e.name}.substr(shared));
+		if (wide(algorithm))
+			w.u64(e.checksum);
+		else
+			w.u32(e.checksum);
+		directory = e.directory;
+		previous = e.name;
+	}
+	std::string frame = w.frame(Frame_type::manifest_batch);
+	new_directories.clear();
+	entries.clear();
+	pending_bytes = 0;
+	return frame;
+}
+
+void Manifest_decoder::decode_batch(std::string_view payload, std::vector<Manifest_entry>& out) {
+	Payload_reader r{payload};
+	const uint64_t directory_count = r.varint();
+	if (directory_count > payload.size())
+		throw std::runtime_error{"corrupt manifest batch"};
+	for (uint64_t i = 0; i < directory_count; ++i) {
+		const uint64_t parent = r.varint();
+		const std::string_view name = read_name(r);
+		if (parent >= directories.size())
+			throw std::runtime_error{"undefined directory in manifest"};
+		check_name(name);
+		std::string path{directories.view(parent)};
+		path += name;
+		path += '/';
+		// Defined twice, the numbering would no longer match the client's
+		const size_t known = directories.size();
+		if (directories.intern(path) != known)
+			throw std::runtime_error{"directory defined twice in manifest"};
+	}
+	const uint64_t entry_count = r.varint();
+	if (entry_count > payload.size())
+		throw std::runtime_error{"corrupt manifest batch"};
+	out.reserve(out.size() + entry_count);
+	uint64_t directory = 0;
+	std::string name;
+	for (uint64_t i = 0; i < entry_count; ++i) {
+		const uint64_t delta = r.varint();
+		if (delta > 0)
+			name.clear();
+		directory += delta;
+		if (directory >= directories.size())
+			throw std::runtime_error{"undefined directory in manifest"};
+		const uint64_t shared = r.varint();
+		if (shared > name.size())
+			throw std::runtime_error{"corrupt manifest batch"};
+		name.resize(shared);
+		name += read_name(r);
+		check_name(name);
+		Manifest_entry e;
+		e.path = directories.view(directory);
+		e.path += name;
+		e.checksum.algorithm = algorithm;
+		e.checksum.value = wide(algorithm) ? r.u64() : r.u32();
+		out.push_back(std::move(e));
+	}
+	r.finish();
+}
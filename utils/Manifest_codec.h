@@ -0,0 +1,64 @@
+#ifndef MANIFEST_CODEC_H
+#define MANIFEST_CODEC_H
+
+#include "Frame.h"
+#include "Path_pool.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compact manifest_batch payloads. Directories are defined once per
+// session in a dictionary shared by both ends, each as its parent's id
+// and its name. Entries of a batch are sorted by directory, so they
+// carry the delta of their directory id, and their names are front-coded
+// against the previous name in the same directory. Checksums take 4 or
+// 8 bytes depending on the session's algorithm.
+//
+// manifest_batch payload:
+//   varint new directories, then per directory: varint parent id, name
+//   varint entries, then per entry: varint directory id delta,
+//     varint shared prefix length, suffix, checksum
+// Names are a varint length and bytes. Id 0 is the top directory,
+// defined directories are numbered from 1 in order.
+class Manifest_encoder {
+public:
+	explicit Manifest_encoder(Hash_algorithm a) : algorithm{a} {}
+
+	// Path relative to the top directory, with '/' separators
+	void add(std::string_view path, const Checksum&);
+	size_t pending() const { return entries.size(); }
+	// Rough payload size of the pending batch
+	size_t pending_size() const { return pending_bytes; }
+	// Frame of the entries added since the last batch
+	std::string encode_batch();
+private:
+	struct Entry {
+		uint32_t directory;
+		std::string name;
+		uint64_t checksum;
+	};
+
+	uint32_t directory_id(std::string_view path);
+
+	Hash_algorithm algorithm;
+	Path_pool directories;	// Defined directories, by id less one
+	std::vector<std::pair<uint32_t, std::string>> new_directories;	// Parent id and name
+	std::vector<Entry> entries;
+	size_t pending_bytes = 0;
+};
+
+class Manifest_decoder {
+public:
+	explicit Manifest_decoder(Hash_algorithm a) : algorithm{a} { directories.intern(""); }
+
+	// Appends the entries of a batch. Names are checked to be plain
+	// file names, so the paths are normal and relative.
+	void decode_batch(std::string_view payload, std::vector<Manifest_entry>& out);
+private:
+	Hash_algorithm algorithm;
+	Path_pool directories;	// Paths with a trailing '/', by id
+};
+
+#endif
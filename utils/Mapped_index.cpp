@@ -0,0 +1,329 @@
+#include "Mapped_index.h"
+#include "Hasher.h"
+#include "Transfer.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char table_magic[8] = {'B', 'K', 'I', 'N', 'D', 'E', 'X', '1'};
+
+struct Table_header {
+	char magic[8];
+	uint64_t value_size;
+	uint64_t count;
+	uint64_t keys_size;
+};
+
+// Journal records: u8 op, u32 key length, key, value for puts,
+// then the CRC-32C of all of the above
+constexpr uint8_t op_erase = 0;
+constexpr uint8_t op_put = 1;
+// Buffered journal records are written once they reach this size
+constexpr size_t journal_flush_threshold = 64 * 1024;
+
+uint32_t crc32c_of(const char* data, size_t n) {
+	std::unique_ptr<Hasher> h = make_hasher(Hash_algorithm::crc32c);
+	h->update(data, n);
+	return h->digest().value;
+}
+
+void append(std::string& out, const void* data, size_t n) {
+	out.append(static_cast<const char*>(data), n);
+}
+
+// So a rename in it survives a crash
+void sync_directory(const fs::path& dir) {
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error{"can't open " + dir.string()};
+	const int status = fsync(fd);
+	close(fd);
+	if (status == -1)
+		throw std::runtime_error{"failed fsync() on " + dir.string() + ' ' + std::to_string(errno)};
+}
+
+}
+
+Mapped_index::Mapped_index(fs::path p, size_t size)
+	: path{std::move(p)}, journal_path{path}, value_size{size} {
+	journal_path += ".journal";
+	map_table();
+	count = table_count;
+	replay_journal();
+}
+
+Mapped_index::~Mapped_index() {
+	try {
+		flush();
+	} catch (const std::exception& e) {
+		std::cerr << "error: " << e.what() << '\n';
+	}
+	if (journal_fd != -1)
+		close(journal_fd);
+	unmap_table();
+}
+
+void Mapped_index::map_table() {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return;
+		throw std::runtime_error{"can't open " + path.string() + " for reading"};
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		close(fd);
+		throw std::runtime_error{"failed fstat() " + std::to_string(err)};
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		throw std::runtime_error{"failed mmap() " + std::to_string(errno)};
+	mapping = static_cast<const char*>(m);
+	mapping_size = st.st_size;
+
+	Table_header h;
+	if (mapping_size < sizeof(h))
+		throw std::runtime_error{path.string() + " is corrupt"};
+	std::memcpy(&h, mapping, sizeof(h));
+	if (std::memcmp(h.magic, table_magic, sizeof(table_magic)) != 0 || h.value_size != value_size)
+		throw std::runtime_error{path.string() + " is not an index of this kind"};
+	const uint64_t expected = sizeof(h) + h.count * (sizeof(Slot) + value_size) + h.keys_size;
+	if (h.count > mapping_size || expected != mapping_size)
+		throw std::runtime_error{path.string() + " is corrupt"};
+	table_count = h.count;
+	slots = reinterpret_cast<const Slot*>(mapping + sizeof(h));
+	values = reinterpret_cast<const char*>(slots + table_count);
+	keys = values + table_count * value_size;
+	for (size_t i = 0; i < table_count; ++i)
+		if (slots[i].key_offset + slots[i].key_length > h.keys_size)
+			throw std::runtime_error{path.string() + " is corrupt"};
+}
+
+void Mapped_index::unmap_table() {
+	if (mapping)
+		munmap(const_cast<char*>(mapping), mapping_size);
+	mapping = nullptr;
+	mapping_size = 0;
+	table_count = 0;
+}
+
+std::string_view Mapped_index::table_key(size_t i) const {
+	return {keys + slots[i].key_offset, slots[i].key_length};
+}
+
+std::string_view Mapped_index::table_value(size_t i) const {
+	return {values + i * value_size, value_size};
+}
+
+std::optional<std::string_view> Mapped_index::find_in_table(std::string_view key) const {
+	size_t lo = 0;
+	size_t hi = table_count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int c = table_key(mid).compare(key);
+		if (c == 0)
+			return table_value(mid);
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return std::nullopt;
+}
+
+std::optional<std::string_view> Mapped_index::find(std::string_view key) const {
+	auto it = changes.find(key);
+	if (it == changes.cend())
+		return find_in_table(key);
+	if (!it->second)
+		return std::nullopt;
+	return std::string_view{*it->second};
+}
+
+void Mapped_index::put(std::string_view key, std::string_view value) {
+	if (value.size() != value_size)
+		throw std::runtime_error{"index value of the wrong size"};
+	if (!find(key))
+		++count;
+	changes.insert_or_assign(std::string{key}, std::string{value});
+	journal(op_put, key, value);
+}
+
+void Mapped_index::erase(std::string_view key) {
+	if (!find(key))
+		return;
+	--count;
+	changes.insert_or_assign(std::string{key}, std::nullopt);
+	journal(op_erase, key, {});
+}
+
+void Mapped_index::for_each(const std::function<void(std::string_view, std::string_view)>& f) const {
+	// Merge the table with the changes, both sorted by key
+	size_t i = 0;
+	auto it = changes.cbegin();
+	while (i < table_count || it != changes.cend()) {
+		const int c = i == table_count ? 1
+			: it == changes.cend() ? -1
+			: table_key(i).compare(it->first);
+		if (c < 0) {
+			f(table_key(i), table_value(i));
+			++i;
+			continue;
+		}
+		if (it->second)
+			f(it->first, *it->second);
+		if (c == 0)
+			++i;
+		++it;
+	}
+}
+
+void Mapped_index::journal(uint8_t op, std::string_view key, std::string_view value) {
+	const size_t start = journal_buffer.size();
+	const uint32_t key_length = key.size();
+	append(journal_buffer, &op, sizeof(op));
+	append(journal_buffer, &key_length, sizeof(key_length));
+	journal_buffer += key;
+	journal_buffer += value;
+	const uint32_t crc = crc32c_of(journal_buffer.data() + start, journal_buffer.size() - start);
+	append(journal_buffer, &crc, sizeof(crc));
+	++journal_records;
+	if (journal_buffer.size() >= journal_flush_threshold) {
+		write_all(journal_fd, journal_buffer.data(), journal_buffer.size());
+		journal_buffer.clear();
+	}
+}
+
+void Mapped_index::replay_journal() {
+	journal_fd = open(journal_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (journal_fd == -1)
+		throw std::runtime_error{"can't open " + journal_path.string() + " for writing"};
+	std::string data;
+	{
+		std::vector<char> buf(1 << 16);
+		for (off_t offset = 0; ; ) {
+			const size_t n = read_at(journal_fd, buf.data(), buf.size(), offset);
+			data.append(buf.data(), n);
+			offset += n;
+			if (n < buf.size())
+				break;
+		}
+	}
+	size_t pos = 0;
+	for (;;) {
+		const size_t start = pos;
+		uint8_t op = 0;
+		uint32_t key_length = 0;
+		if (data.size() - pos < sizeof(op) + sizeof(key_length))
+			break;
+		std::memcpy(&op, data.data() + pos, sizeof(op));
+		std::memcpy(&key_length, data.data() + pos + sizeof(op), sizeof(key_length));
+		pos += sizeof(op) + sizeof(key_length);
+		const size_t length = key_length + (op == op_put ? value_size : 0);
+		uint32_t crc = 0;
+		if ((op != op_put && op != op_erase) || data.size() - pos < length + sizeof(crc))
+			break;
+		std::memcpy(&crc, data.data() + pos + length, sizeof(crc));
+		if (crc != crc32c_of(data.data() + start, pos + length - start))
+			break;
+		const std::string_view key{data.data() + pos, key_length};
+		const bool existed = find(key).has_value();
+		if (op == op_put) {
+			changes.insert_or_assign(std::string{key}, data.substr(pos + key_length, value_size));
+			count += !existed;
+		} else {
+			changes.insert_or_assign(std::string{key}, std::nullopt);
+			count -= existed;
+		}
+		pos += length + sizeof(crc);
+		++journal_records;
+	}
+	// Drop a torn record at the end, so new records follow whole ones
+	if (pos < data.size() && ftruncate(journal_fd, pos) == -1)
+		throw std::runtime_error{"failed ftruncate() " + std::to_string(errno)};
+}
+
+void Mapped_index::flush() {
+	if (!journal_buffer.empty()) {
+		write_all(journal_fd, journal_buffer.data(), journal_buffer.size());
+		journal_buffer.clear();
+	}
+	if (fdatasync(journal_fd) == -1)
+		throw std::runtime_error{"failed fdatasync() " + std::to_string(errno)};
+}
+
+void Mapped_index::compact() {
+	std::string slot_data;
+	std::string value_data;
+	std::string key_data;
+	slot_data.reserve(count * sizeof(Slot));
+	value_data.reserve(count * value_size);
+	uint64_t written = 0;
+	for_each([&](std::string_view key, std::string_view value) {
+		const Slot s{key_data.size(), static_cast<uint32_t>(key.size()), 0};
+		append(slot_data, &s, sizeof(s));
+		value_data += value;
+		key_data += key;
+		++written;
+	});
+	Table_header h{};
+	std::memcpy(h.magic, table_magic, sizeof(table_magic));
+	h.value_size = value_size;
+	h.count = written;
+	h.keys_size = key_data.size();
+
+	fs::path temp = path;
+	temp += ".tmp";
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		throw std::runtime_error{"can't open " + temp.string() + " for writing"};
+	try {
+		write_all(fd, reinterpret_cast<const char*>(&h), sizeof(h));
+		write_all(fd, slot_data.data(), slot_data.size());
+		write_all(fd, value_data.data(), value_data.size());
+		write_all(fd, key_data.data(), key_data.size());
+		if (fsync(fd) == -1)
+			throw std::runtime_error{"failed fsync() " + std::to_string(errno)};
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	// The journal only goes once the new table is in place for good,
+	// replaying it over the new table again is harmless
+	fs::rename(temp, path);
+	sync_directory(path.has_parent_path() ? path.parent_path() : fs::path{"."});
+	unmap_table();
+	changes.clear();
+	journal_buffer.clear();
+	journal_records = 0;
+	if (ftruncate(journal_fd, 0) == -1)
+		throw std::runtime_error{"failed ftruncate() " + std::to_string(errno)};
+	map_table();
+}
+
+void Mapped_index::checkpoint() {
+	constexpr size_t min_compaction_records = 4096;
+	if (journal_records >= min_compaction_records && journal_records >= table_count / 8)
+		compact();
+	else
+		flush();
+}
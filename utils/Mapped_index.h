@@ -0,0 +1,77 @@
+#ifndef MAPPED_INDEX_H
+#define MAPPED_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Persistent map from strings to fixed-size values.
+// The bulk of it is a table sorted by key, memory-mapped as it is,
+// so opening it costs nothing however many entries it holds.
+// Changes are appended to a journal beside it, replayed when opened,
+// and merged into a new table by compact(). A journal cut short by a
+// crash loses its last records only. Integers are in host byte order,
+// the files aren't meant to move between machines.
+class Mapped_index {
+public:
+	// Opens or creates the index at path, with path + ".journal"
+	Mapped_index(std::filesystem::path path, size_t value_size);
+	~Mapped_index();
+
+	Mapped_index(const Mapped_index&) = delete;
+	Mapped_index& operator=(const Mapped_index&) = delete;
+
+	std::optional<std::string_view> find(std::string_view key) const;
+	void put(std::string_view key, std::string_view value);
+	void erase(std::string_view key);
+	// Visits live entries in key order
+	void for_each(const std::function<void(std::string_view key, std::string_view value)>&) const;
+	size_t size() const { return count; }
+
+	// Make journaled changes durable
+	void flush();
+	// Write the merged table and empty the journal
+	void compact();
+	// Flush, and compact once the journal is large compared to the table
+	void checkpoint();
+private:
+	struct Slot {
+		uint64_t key_offset;
+		uint32_t key_length;
+		uint32_t reserved;
+	};
+
+	void map_table();
+	void unmap_table();
+	void replay_journal();
+	void journal(uint8_t op, std::string_view key, std::string_view value);
+	std::optional<std::string_view> find_in_table(std::string_view key) const;
+	std::string_view table_key(size_t i) const;
+	std::string_view table_value(size_t i) const;
+
+	std::filesystem::path path;
+	std::filesystem::path journal_path;
+	size_t value_size;
+
+	// The mapped table
+	const char* mapping = nullptr;
+	size_t mapping_size = 0;
+	size_t table_count = 0;
+	const Slot* slots = nullptr;
+	const char* values = nullptr;
+	const char* keys = nullptr;
+
+	// Changes since the table was written, erased keys map to nullopt
+	std::map<std::string, std::optional<std::string>, std::less<>> changes;
+	size_t count = 0;		// Live entries
+	int journal_fd = -1;
+	std::string journal_buffer;	// Records not yet written
+	size_t journal_records = 0;
+};
+
+#endif
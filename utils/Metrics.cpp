@@ -0,0 +1,180 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+std::atomic<size_t> next_shard{0};
+
+std::string bound(size_t bucket) {
+	return bucket < 64 ? std::to_string(uint64_t{1} << bucket) : "18446744073709551615";
+}
+
+}
+
+size_t metric_shard() {
+	// Handed out in turn, so up to metric_shards threads never share one
+	thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % metric_shards;
+	return shard;
+}
+
+uint64_t Counter::value() const {
+	uint64_t total = 0;
+	for (const Cell& c : cells)
+		total += c.value.load(std::memory_order_relaxed);
+	return total;
+}
+
+void Histogram::record(uint64_t value) {
+	const size_t bucket = value <= 1 ? 0 : std::bit_width(value - 1);
+	Shard& s = shards[metric_shard()];
+	s.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+	s.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+	Snapshot snap;
+	for (const Shard& s : shards) {
+		for (size_t i = 0; i < buckets; ++i)
+			snap.counts[i] += s.counts[i].load(std::memory_order_relaxed);
+		snap.sum += s.sum.load(std::memory_order_relaxed);
+	}
+	for (uint64_t c : snap.counts)
+		snap.count += c;
+	return snap;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+	if (count == 0)
+		return 0;
+	const uint64_t rank = std::max<uint64_t>(1, q * count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets; ++i)
+		if ((seen += counts[i]) >= rank)
+			return i < 64 ? uint64_t{1} << i : UINT64_MAX;
+	return UINT64_MAX;
+}
+
+Latency_timer::~Latency_timer() {
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+Counter& Metrics::counter(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock{m};
+	Entry<Counter>& e = counters[name];
+	if (!e.metric)
+		e = {help, std::make_unique<Counter>()};
+	return *e.metric;
+}
+
+Gauge& Metrics::gauge(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock{m};
+	Entry<Gauge>& e = gauges[name];
+	if (!e.metric)
+		e = {help, std::make_unique<Gauge>()};
+	return *e.metric;
+}
+
+Histogram& Metrics::histogram(const std::string& name, const std::string& help) {
+	std::lock_guard<std::mutex> lock{m};
+	Entry<Histogram>& e = histograms[name];
+	if (!e.metric)
+		e = {help, std::make_unique<Histogram>()};
+	return *e.metric;
+}
+
+std::string Metrics::prometheus() const {
+	std::lock_guard<std::mutex> lock{m};
+	std::string out;
+	auto header = [&](const std::string& name, const std::string& help, const char* type) {
+		out += "# HELP " + name + ' ' + help + '\n';
+		out += "# TYPE " + name + ' ' + type + '\n';
+	};
+	for (const auto& [name, e] : counters) {
+		header(name, e.help, "counter");
+		out += name + ' ' + std::to_string(e.metric->value()) + '\n';
+	}
+	for (const auto& [name, e] : gauges) {
+		header(name, e.help, "gauge");
+		out += name + ' ' + std::to_string(e.metric->value()) + '\n';
+	}
+	for (const auto& [name, e] : histograms) {
+		header(name, e.help, "histogram");
+		const Histogram::Snapshot snap = e.metric->snapshot();
+		// Buckets are cumulative, up to the last one anything fell in
+		size_t last = 0;
+		for (size_t i = 0; i < Histogram::buckets; ++i)
+			if (snap.counts[i] > 0)
+				last = i;
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i <= last && i < 64; ++i) {
+			cumulative += snap.counts[i];
+			out += name + "_bucket{le=\"" + bound(i) + "\"} " + std::to_string(cumulative) + '\n';
+		}
+		out += name + "_bucket{le=\"+Inf\"} " + std::to_string(snap.count) + '\n';
+		out += name + "_sum " + std::to_string(snap.sum) + '\n';
+		out += name + "_count " + std::to_string(snap.count) + '\n';
+	}
+	return out;
+}
+
+std::string Metrics::json() const {
+	using namespace std::chrono;
+	std::lock_guard<std::mutex> lock{m};
+	const auto now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+	const auto uptime = duration_cast<milliseconds>(steady_clock::now() - started).count();
+	std::string out = "{\"time_ms\":" + std::to_string(now) + ",\"uptime_ms\":" + std::to_string(uptime);
+	for (const auto& [name, e] : counters)
+		out += ",\"" + name + "\":" + std::to_string(e.metric->value());
+	for (const auto& [name, e] : gauges)
+		out += ",\"" + name + "\":" + std::to_string(e.metric->value());
+	for (const auto& [name, e] : histograms) {
+		const Histogram::Snapshot snap = e.metric->snapshot();
+		out += ",\"" + name + "\":{\"count\":" + std::to_string(snap.count)
+			+ ",\"sum\":" + std::to_string(snap.sum)
+			+ ",\"p50\":" + std::to_string(snap.quantile(0.5))
+			+ ",\"p90\":" + std::to_string(snap.quantile(0.9))
+			+ ",\"p99\":" + std::to_string(snap.quantile(0.99)) + '}';
+	}
+	return out + '}';
+}
+
+Metrics& metrics() {
+	static Metrics m;
+	return m;
+}
+
+Metrics_dump::Metrics_dump(std::filesystem::path f, std::chrono::milliseconds i)
+	: file{std::move(f)}, interval{i} {
+	if (!std::ofstream{file, std::ios::app})
+		throw std::runtime_error{"can't open metrics file " + file.string()};
+	worker = std::thread{[this]{ run(); }};
+}
+
+Metrics_dump::~Metrics_dump() {
+	{
+		std::lock_guard<std::mutex> lock{m};
+		stopping = true;
+	}
+	cv.notify_one();
+	worker.join();
+	write();
+}
+
+void Metrics_dump::run() {
+	std::unique_lock<std::mutex> lock{m};
+	while (!cv.wait_for(lock, interval, [this]{ return stopping; }))
+		write();
+}
+
+void Metrics_dump::write() const {
+	// Opened each time, so the file can be rotated underneath
+	std::ofstream out{file, std::ios::app};
+	if (!(out << metrics().json() << '\n'))
+		std::cerr << "can't write metrics to " << file << '\n';
+}
@@ -0,0 +1,135 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Counters and histograms of the hot paths. Each thread records into its own
+// shard with relaxed atomics, so recording never takes a lock or bounces
+// a cache line between threads; shards are only summed when read.
+constexpr size_t metric_shards = 16;
+
+// Shard of the calling thread
+size_t metric_shard();
+
+// Only ever increases, like bytes or files
+class Counter {
+public:
+	void add(uint64_t n = 1) {
+		cells[metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+	}
+	uint64_t value() const;
+private:
+	struct alignas(64) Cell {
+		std::atomic<uint64_t> value{0};
+	};
+	std::array<Cell, metric_shards> cells;
+};
+
+// Goes up and down, like queue depths. Changed where the queue is locked
+// anyway, so one atomic does.
+class Gauge {
+public:
+	void add(int64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+	void sub(int64_t n = 1) { v.fetch_sub(n, std::memory_order_relaxed); }
+	void set(int64_t n) { v.store(n, std::memory_order_relaxed); }
+	int64_t value() const { return v.load(std::memory_order_relaxed); }
+private:
+	std::atomic<int64_t> v{0};
+};
+
+// Distribution of values, like latencies in microseconds, in buckets
+// of powers of two: bucket i counts the values up to 2^i
+class Histogram {
+public:
+	static constexpr size_t buckets = 65;
+
+	void record(uint64_t value);
+	struct Snapshot {
+		std::array<uint64_t, buckets> counts{};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		// Upper bound of the bucket the given fraction of values is in
+		uint64_t quantile(double) const;
+	};
+	Snapshot snapshot() const;
+private:
+	struct alignas(64) Shard {
+		std::array<std::atomic<uint64_t>, buckets> counts{};
+		std::atomic<uint64_t> sum{0};
+	};
+	std::array<Shard, metric_shards> shards;
+};
+
+// Records the microseconds from its construction to its destruction
+class Latency_timer {
+public:
+	explicit Latency_timer(Histogram& h) : histogram{h}, start{std::chrono::steady_clock::now()} {}
+	~Latency_timer();
+
+	Latency_timer(const Latency_timer&) = delete;
+	Latency_timer& operator=(const Latency_timer&) = delete;
+private:
+	Histogram& histogram;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Named metrics of the process. Registering a name again returns the same
+// metric, which stays put, so users keep a reference to theirs in a static.
+class Metrics {
+public:
+	Counter& counter(const std::string& name, const std::string& help);
+	Gauge& gauge(const std::string& name, const std::string& help);
+	Histogram& histogram(const std::string& name, const std::string& help);
+
+	// Prometheus text exposition format
+	std::string prometheus() const;
+	// One line of JSON, with the time and the quantiles of histograms
+	std::string json() const;
+private:
+	template <typename T>
+	struct Entry {
+		std::string help;
+		std::unique_ptr<T> metric;
+	};
+
+	mutable std::mutex m;
+	std::map<std::string, Entry<Counter>> counters;
+	std::map<std::string, Entry<Gauge>> gauges;
+	std::map<std::string, Entry<Histogram>> histograms;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+};
+
+Metrics& metrics();
+
+// Appends metrics().json() to a file every interval, and once more when destroyed
+class Metrics_dump {
+public:
+	Metrics_dump(std::filesystem::path file, std::chrono::milliseconds interval);
+	~Metrics_dump();
+
+	Metrics_dump(const Metrics_dump&) = delete;
+	Metrics_dump& operator=(const Metrics_dump&) = delete;
+private:
+	void run();
+	void write() const;
+
+	std::filesystem::path file;
+	std::chrono::milliseconds interval;
+	std::mutex m;
+	std::condition_variable cv;
+	bool stopping = false;
+	std::thread worker;
+};
+
+#endif
@@ -13,6 +13,9 @@
 // Holds a configuration file's data
 struct Options {
 	std::unordered_multimap<std::string, std::string> data;
+	bool contains(const std::string& key) const {
+		return data.find(key) != data.cend();
+	}
 	std::vector<std::string> lookup(const std::string& key) const {
 		auto [beg, end] = data.equal_range(key);
 		if (beg == end)
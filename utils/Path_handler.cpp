@@ -1,13 +1,87 @@
 #include "Path_handler.h"
+#include "Walker.h"
+
 #include <filesystem>
+#include <thread>
 
 namespace fs = std::filesystem;
 
-void add_recursively(Path_handler& ph, const fs::path& path) {
-	for (fs::recursive_directory_iterator it{path};
-			it != fs::recursive_directory_iterator{};
-			++it) {
-		if (fs::is_regular_file(*it))
-			ph.add_file(*it);
+Path_handler::Path_handler(const std::vector<fs::path>& roots, const fs::path& directories)
+	: directories_path{directories} {
+	for (fs::path root : roots) {
+		root = root.lexically_normal();
+		if (!root.has_filename())
+			root = root.parent_path();	// Trailing separator
+		paths_path.push_back(std::move(root));
+	}
+	if (fs::exists(directories_path))
+		for (const std::string& name : read_file_rows(directories_path))
+			if (!name.empty())
+				directory_names.intern(name);
+	tokens.assign(directory_names.size(), unused);
+}
+
+uint32_t Path_handler::intern(std::string_view name) {
+	const size_t known = directory_names.size();
+	const uint32_t id = directory_names.intern(name);
+	if (id == known) {
+		tokens.push_back(unused);
+		if (!directories_file.is_open()) {
+			directories_file.open(directories_path, std::ios_base::app);
+			if (!directories_file)
+				throw std::runtime_error{"can't open " + directories_path.string() + " for writing"};
+		}
+		directories_file << name << '\n';
+	}
+	return id;
+}
+
+void Path_handler::add_file(const fs::path file) {
+	auto normalized_path = file.lexically_normal();
+	if (!path_inside_directories(normalized_path))
+		throw std::runtime_error{"path \"" + file.string() + "\" not under given directories"};
+	for (fs::path p{normalized_path.parent_path()}; p != p.root_path(); p = p.parent_path()) {
+		const uint32_t id = intern(p.filename().native());
+		if (tokens[id] == unused) {
+			tokens[id] = used_directories.size();
+			used_directories.push_back(id);
+		}
+	}
+	files.intern(normalized_path.native());
+}
+
+std::string Path_handler::translation_table() const {
+	std::ostringstream os;
+	for (size_t i = 0; i < used_directories.size(); ++i)
+		os << std::hex << i << '\t' << directory_names.view(used_directories[i]) << '\n';
+	return os.str();
+}
+
+std::string Path_handler::compressed_entry(size_t n) const {
+	const fs::path file = entry(n);
+	std::vector<uint32_t> file_tokens;
+	for (fs::path p{file.parent_path()}; p != p.root_path(); p = p.parent_path())
+		file_tokens.push_back(tokens[*directory_names.find(p.filename().native())]);
+	std::ostringstream os;
+	for (auto it = file_tokens.crbegin(); it != file_tokens.crend(); ++it)
+		os << std::hex << *it << ' ';
+	os << file.filename();
+	return os.str();
+}
+
+bool Path_handler::path_inside_directories(const fs::path& file) const {
+	for (const fs::path& path : paths_path) {
+		auto [beg, end] = std::mismatch(
+				path.begin(), path.end(),
+				file.begin(), file.end()
+		);
+		if (beg == path.end())
+			return true;
 	}
+	return false;
+}
+
+void add_recursively(Path_handler& ph, const fs::path& path) {
+	for (const Walked_file& f : walk({path}, std::thread::hardware_concurrency()).files)
+		ph.add_file(f.path);
 }
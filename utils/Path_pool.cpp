@@ -0,0 +1,68 @@
+#include "Path_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t arena_block_size = 1 << 20;
+
+size_t hash_of(std::string_view s) {
+	return std::hash<std::string_view>{}(s);
+}
+
+}
+
+const char* Path_pool::store(std::string_view s) {
+	if (blocks.empty() || block_size - block_used < s.size()) {
+		block_size = std::max(arena_block_size, s.size());
+		blocks.push_back(std::make_unique<char[]>(block_size));
+		block_used = 0;
+	}
+	char* p = blocks.back().get() + block_used;
+	std::memcpy(p, s.data(), s.size());
+	block_used += s.size();
+	return p;
+}
+
+void Path_pool::grow_table() {
+	std::vector<Path_id> bigger(std::max<size_t>(table.size() * 2, 1024), empty);
+	const size_t mask = bigger.size() - 1;
+	for (Path_id id = 0; id < starts.size(); ++id) {
+		size_t i = hash_of(view(id)) & mask;
+		while (bigger[i] != empty)
+			i = (i + 1) & mask;
+		bigger[i] = id;
+	}
+	table = std::move(bigger);
+}
+
+std::optional<Path_id> Path_pool::find(std::string_view s) const {
+	if (table.empty())
+		return std::nullopt;
+	const size_t mask = table.size() - 1;
+	for (size_t i = hash_of(s) & mask; table[i] != empty; i = (i + 1) & mask)
+		if (view(table[i]) == s)
+			return table[i];
+	return std::nullopt;
+}
+
+Path_id Path_pool::intern(std::string_view s) {
+	// Kept at most three quarters full
+	if ((starts.size() + 1) * 4 > table.size() * 3)
+		grow_table();
+	const size_t mask = table.size() - 1;
+	size_t i = hash_of(s) & mask;
+	for (; table[i] != empty; i = (i + 1) & mask)
+		if (view(table[i]) == s)
+			return table[i];
+	if (starts.size() >= empty)
+		throw std::runtime_error{"too many paths"};
+	const Path_id id = starts.size();
+	starts.push_back(store(s));
+	lengths.push_back(s.size());
+	table[i] = id;
+	return id;
+}
@@ -0,0 +1,47 @@
+#ifndef PATH_POOL_H
+#define PATH_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+using Path_id = uint32_t;
+
+// Interns paths in an arena, handing out dense 32-bit ids in the order
+// paths were first seen, so per-path data can live in vectors indexed by id.
+// A path costs its bytes plus about 17 bytes of bookkeeping,
+// instead of a heap allocation per copy.
+class Path_pool {
+public:
+	Path_pool() = default;
+	Path_pool(Path_pool&&) = default;
+	Path_pool& operator=(Path_pool&&) = default;
+
+	// Id of the path, adding it if new
+	Path_id intern(std::string_view);
+	std::optional<Path_id> find(std::string_view) const;
+	std::string_view view(Path_id id) const { return {starts[id], lengths[id]}; }
+	std::filesystem::path path(Path_id id) const { return std::filesystem::path{view(id)}; }
+	size_t size() const { return starts.size(); }
+private:
+	static constexpr Path_id empty = UINT32_MAX;
+
+	const char* store(std::string_view);
+	void grow_table();
+
+	// Arena of path bytes, never moved once written
+	std::vector<std::unique_ptr<char[]>> blocks;
+	size_t block_used = 0;
+	size_t block_size = 0;
+
+	std::vector<const char*> starts;
+	std::vector<uint32_t> lengths;
+	// Open addressing by hash, holding ids
+	std::vector<Path_id> table;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "Rate_limiter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+constexpr size_t min_slice = 4 * 1024;
+constexpr size_t max_slice = 1024 * 1024;
+
+// Sixteen slices a second, so waits stay short
+size_t slice_of(uint64_t rate) {
+	return std::clamp<uint64_t>(rate / 16, min_slice, max_slice);
+}
+
+// What the bucket holds at most, a quarter second's worth
+double burst_of(uint64_t rate) {
+	return std::max<double>(rate / 4, 2 * slice_of(rate));
+}
+
+// "HH:MM" as minutes after midnight
+int parse_time(const std::string& s, const std::string& line) {
+	int hours = 0, minutes = 0;
+	char colon = 0;
+	std::istringstream is{s};
+	if (!(is >> hours >> colon >> minutes) || colon != ':' || !is.eof()
+			|| hours < 0 || hours > 24 || minutes < 0 || minutes > 59 || hours * 60 + minutes > 24 * 60)
+		throw std::runtime_error{"invalid time in rate schedule \"" + line + '"'};
+	return hours * 60 + minutes;
+}
+
+}
+
+uint64_t parse_rate(const std::string& s) {
+	if (s.empty() || !std::isdigit(static_cast<unsigned char>(s[0])))
+		throw std::runtime_error{"invalid rate \"" + s + '"'};
+	size_t end = 0;
+	uint64_t rate = 0;
+	try {
+		rate = std::stoull(s, &end);
+	} catch (const std::logic_error&) {
+		throw std::runtime_error{"invalid rate \"" + s + '"'};
+	}
+	if (end == s.size())
+		return rate;
+	if (end + 1 != s.size())
+		throw std::runtime_error{"invalid rate \"" + s + '"'};
+	switch (std::toupper(static_cast<unsigned char>(s[end]))) {
+	case 'K': return rate << 10;
+	case 'M': return rate << 20;
+	case 'G': return rate << 30;
+	default: throw std::runtime_error{"invalid rate \"" + s + '"'};
+	}
+}
+
+Rate_schedule::Rate_schedule(const std::vector<std::string>& lines) {
+	bool have_otherwise = false;
+	for (const std::string& line : lines) {
+		std::istringstream is{line};
+		std::string first, second, rest;
+		is >> first >> second >> rest;
+		if (first.empty() || !rest.empty())
+			throw std::runtime_error{"invalid rate schedule \"" + line + '"'};
+		if (second.empty()) {
+			if (have_otherwise)
+				throw std::runtime_error{"more than one rate without hours"};
+			otherwise = parse_rate(first);
+			have_otherwise = true;
+			continue;
+		}
+		const size_t dash = first.find('-');
+		if (dash == std::string::npos)
+			throw std::runtime_error{"invalid hours in rate schedule \"" + line + '"'};
+		windows.push_back(Window{
+			parse_time(first.substr(0, dash), line),
+			parse_time(first.substr(dash + 1), line),
+			parse_rate(second)
+		});
+	}
+}
+
+uint64_t Rate_schedule::rate_at(std::chrono::system_clock::time_point t) const {
+	if (windows.empty())
+		return otherwise;
+	const std::time_t time = std::chrono::system_clock::to_time_t(t);
+	std::tm local{};
+	localtime_r(&time, &local);
+	const int now = local.tm_hour * 60 + local.tm_min;
+	constexpr int day = 24 * 60;
+	const Window* best = nullptr;
+	int best_length = day + 1;
+	for (const Window& w : windows) {
+		// From equal to to is the whole day
+		const int length = w.from < w.to ? w.to - w.from : day - (w.from - w.to);
+		const bool in = w.from < w.to ? w.from <= now && now < w.to
+			: w.from > w.to ? now >= w.from || now < w.to
+			: true;
+		if (in && length < best_length) {
+			best = &w;
+			best_length = length;
+		}
+	}
+	return best ? best->rate : otherwise;
+}
+
+bool Rate_schedule::limits() const {
+	return otherwise > 0
+		|| std::any_of(windows.begin(), windows.end(), [](const Window& w){ return w.rate > 0; });
+}
+
+void Rate_limiter::set_schedule(Rate_schedule s) {
+	std::lock_guard<std::mutex> lock{m};
+	limited = s.limits();
+	schedule = std::move(s);
+	next_check = {};
+}
+
+size_t Rate_limiter::slice() {
+	if (!limited.load(std::memory_order_relaxed))
+		return 0;
+	std::lock_guard<std::mutex> lock{m};
+	const uint64_t r = rate_now(std::chrono::steady_clock::now());
+	return r == 0 ? 0 : slice_of(r);
+}
+
+void Rate_limiter::take(size_t n) {
+	std::chrono::duration<double> wait{0};
+	{
+		std::lock_guard<std::mutex> lock{m};
+		const auto now = std::chrono::steady_clock::now();
+		const uint64_t r = rate_now(now);
+		if (r == 0) {
+			// Unlimited for now, starting from empty once limited again
+			tokens = 0;
+			refilled = now;
+			return;
+		}
+		const std::chrono::duration<double> elapsed = now - refilled;
+		tokens = std::min(burst_of(r), tokens + r * elapsed.count());
+		refilled = now;
+		tokens -= n;
+		if (tokens < 0)
+			wait = std::chrono::duration<double>{-tokens / r};
+	}
+	if (wait.count() > 0)
+		std::this_thread::sleep_for(wait);
+}
+
+uint64_t Rate_limiter::rate_now(std::chrono::steady_clock::time_point now) {
+	if (now >= next_check) {
+		rate = schedule.rate_at(std::chrono::system_clock::now());
+		next_check = now + std::chrono::seconds{1};
+	}
+	return rate;
+}
+
+Rate_limiter& network_limit() {
+	static Rate_limiter l;
+	return l;
+}
+
+Rate_limiter& disk_read_limit() {
+	static Rate_limiter l;
+	return l;
+}
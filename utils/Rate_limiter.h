@@ -0,0 +1,70 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Bytes per second, plain or with a K, M or G suffix of powers of 1024
+uint64_t parse_rate(const std::string&);
+
+// Rates by local time of day. Each line is a rate, optionally after the
+// hours it applies in, like "08:00-18:00 2M"; hours may wrap past midnight.
+// Of the windows the time is in, the shortest applies, otherwise the line
+// without one, whatever order the lines are in. A rate of 0 is unlimited.
+class Rate_schedule {
+public:
+	Rate_schedule() = default;
+	explicit Rate_schedule(const std::vector<std::string>& lines);
+
+	uint64_t rate_at(std::chrono::system_clock::time_point) const;
+	// Whether it ever limits
+	bool limits() const;
+private:
+	struct Window {
+		int from;	// Minutes after midnight
+		int to;
+		uint64_t rate;
+	};
+	std::vector<Window> windows;
+	uint64_t otherwise = 0;
+};
+
+// Token bucket shared by the threads doing one kind of I/O. Bytes are
+// accounted once they're done, and whoever takes the bucket below empty
+// sleeps off the debt, so the threads are held to the rate together.
+// The schedule is looked at again every second.
+class Rate_limiter {
+public:
+	void set_schedule(Rate_schedule);
+	// Account for n bytes, sleeping while over the rate
+	void consume(size_t n) {
+		if (limited.load(std::memory_order_relaxed))
+			take(n);
+	}
+	// Most bytes worth doing at once for the rate to stay smooth,
+	// 0 when not limited
+	size_t slice();
+private:
+	void take(size_t n);
+	// Current rate, with m held
+	uint64_t rate_now(std::chrono::steady_clock::time_point);
+
+	std::atomic<bool> limited{false};
+	std::mutex m;
+	Rate_schedule schedule;
+	uint64_t rate = 0;
+	std::chrono::steady_clock::time_point next_check;
+	double tokens = 0;
+	std::chrono::steady_clock::time_point refilled;
+};
+
+// Limits of the whole process, not limiting until given a schedule
+Rate_limiter& network_limit();
+Rate_limiter& disk_read_limit();
+
+#endif
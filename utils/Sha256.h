@@ -0,0 +1,39 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Strong content hash, used to identify chunks of files
+using Digest = std::array<uint8_t, 32>;
+
+struct Digest_hash {
+	size_t operator()(const Digest& d) const {
+		size_t h = 0;
+		std::memcpy(&h, d.data(), sizeof(h));
+		return h;
+	}
+};
+
+std::string to_hex(const Digest&);
+
+class Sha256 {
+public:
+	Sha256();
+	void update(const void* data, size_t n);
+	Digest digest();
+private:
+	void transform(const unsigned char* block);
+
+	uint32_t state[8];
+	unsigned char buffer[64];
+	size_t buffered = 0;
+	uint64_t total = 0;
+};
+
+Digest sha256(const void* data, size_t n);
+
+#endif
@@ -0,0 +1,51 @@
+#include "Thread_pool.h"
+
+#include <iostream>
+#include <stdexcept>
+
+Thread_pool::Thread_pool(size_t threads) {
+	if (threads == 0)
+		threads = 1;
+	for (size_t i = 0; i < threads; ++i)
+		workers.emplace_back([this]{ work(); });
+}
+
+Thread_pool::~Thread_pool() {
+	{
+		std::lock_guard<std::mutex> lock{m};
+		stopping = true;
+	}
+	cv.notify_all();
+	for (std::thread& t : workers)
+		t.join();
+}
+
+void Thread_pool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock{m};
+		jobs.push(std::move(job));
+	}
+	cv.notify_one();
+}
+
+void Thread_pool::work() {
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock{m};
+			cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+			// Drain remaining jobs before stopping
+			if (jobs.empty())
+				return;
+			job = std::move(jobs.front());
+			jobs.pop();
+		}
+		try {
+			job();
+		} catch (const std::exception& e) {
+			std::cerr << "error: " << e.what() << '\n';
+		} catch (...) {
+			std::cerr << "unknown error!\n";
+		}
+	}
+}
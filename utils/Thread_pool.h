@@ -0,0 +1,32 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run submitted jobs in FIFO order
+class Thread_pool {
+public:
+	explicit Thread_pool(size_t threads);
+	~Thread_pool();
+
+	Thread_pool(const Thread_pool&) = delete;
+	Thread_pool& operator=(const Thread_pool&) = delete;
+
+	void submit(std::function<void()> job);
+	size_t size() const { return workers.size(); }
+private:
+	void work();
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> jobs;
+	std::mutex m;
+	std::condition_variable cv;
+	bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "Transfer.h"
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t fallback_bufsize = 64 * 1024;
+
+bool unsupported(int err) {
+	return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+size_t send_buffered(int sock, int file_fd, off_t offset, size_t count) {
+	std::vector<char> buf(fallback_bufsize);
+	size_t sent = 0;
+	while (sent < count) {
+		ssize_t n = pread(file_fd, buf.data(), std::min(buf.size(), count - sent), offset + sent);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			throw std::runtime_error{"failed pread() " + std::to_string(errno)};
+		if (n == 0)
+			break;
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t s = send(sock, buf.data() + done, n - done, MSG_NOSIGNAL);
+			if (s == -1 && errno == EINTR)
+				continue;
+			if (s == -1)
+				throw std::runtime_error{"failed send() " + std::to_string(errno)};
+			done += s;
+		}
+		sent += n;
+	}
+	return sent;
+}
+
+}
+
+size_t send_file_contents(int sock, int file_fd, off_t offset, size_t count) {
+	size_t sent = 0;
+	while (sent < count) {
+		off_t pos = offset + sent;
+		ssize_t n = sendfile(sock, file_fd, &pos, count - sent);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && unsupported(errno))
+			return sent + send_buffered(sock, file_fd, offset + sent, count - sent);
+		if (n == -1)
+			throw std::runtime_error{"failed sendfile() " + std::to_string(errno)};
+		if (n == 0)
+			break;	// File shrank
+		sent += n;
+	}
+	return sent;
+}
+
+Splice_pipe::Splice_pipe() {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		spliceable = false;
+		return;
+	}
+	read_end = fds[0];
+	write_end = fds[1];
+	// A larger pipe moves more per splice call
+	constexpr int wanted_capacity = 1024 * 1024;
+	int c = fcntl(write_end, F_SETPIPE_SZ, wanted_capacity);
+	if (c == -1)
+		c = fcntl(write_end, F_GETPIPE_SZ);
+	capacity = c > 0 ? c : fallback_bufsize;
+}
+
+Splice_pipe::~Splice_pipe() {
+	if (read_end != -1)
+		close(read_end);
+	if (write_end != -1)
+		close(write_end);
+}
+
+ssize_t Splice_pipe::to_file(int sock, int file_fd, off_t offset, size_t count) {
+	if (!spliceable)
+		return buffered_to_file(sock, file_fd, offset, count);
+	ssize_t in = splice(sock, nullptr, write_end, nullptr, std::min(count, capacity),
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (in == -1 && unsupported(errno)) {
+		spliceable = false;
+		return buffered_to_file(sock, file_fd, offset, count);
+	}
+	if (in <= 0)
+		return in;
+	// Always drain the pipe, so it's empty between calls
+	for (ssize_t left = in; left > 0; ) {
+		loff_t at = offset;
+		ssize_t out = splice(read_end, nullptr, file_fd, &at, left, SPLICE_F_MOVE);
+		if (out == -1 && errno == EINTR)
+			continue;
+		if (out == -1 && unsupported(errno)) {
+			// Destination can't be spliced into, copy what's already in the pipe
+			std::vector<char> buf(left);
+			for (ssize_t got = 0; got < left; ) {
+				ssize_t n = read(read_end, buf.data() + got, left - got);
+				if (n <= 0)
+					throw std::runtime_error{"failed to drain splice pipe"};
+				got += n;
+			}
+			write_at(file_fd, buf.data(), left, offset);
+			spliceable = false;
+			break;
+		}
+		if (out <= 0)
+			throw std::runtime_error{"failed splice() " + std::to_string(errno)};
+		left -= out;
+		offset += out;
+	}
+	return in;
+}
+
+ssize_t Splice_pipe::buffered_to_file(int sock, int file_fd, off_t offset, size_t count) {
+	fallback.resize(fallback_bufsize);
+	ssize_t n = read(sock, fallback.data(), std::min(count, fallback.size()));
+	if (n > 0)
+		write_at(file_fd, fallback.data(), n, offset);
+	return n;
+}
+
+void copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t count) {
+	while (count > 0) {
+		ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, count, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (unsupported(errno) || errno == EXDEV))
+			break;
+		if (n == -1)
+			throw std::runtime_error{"failed copy_file_range() " + std::to_string(errno)};
+		if (n == 0)
+			throw std::runtime_error{"source file shrank while copying"};
+		count -= n;
+	}
+	std::vector<char> buf(std::min(count, fallback_bufsize));
+	while (count > 0) {
+		ssize_t n = pread(in_fd, buf.data(), std::min(buf.size(), count), in_offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			throw std::runtime_error{"failed pread() " + std::to_string(errno)};
+		if (n == 0)
+			throw std::runtime_error{"source file shrank while copying"};
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t w = pwrite(out_fd, buf.data() + done, n - done, out_offset + done);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				throw std::runtime_error{"failed pwrite() " + std::to_string(errno)};
+			done += w;
+		}
+		in_offset += n;
+		out_offset += n;
+		count -= n;
+	}
+}
+
+size_t read_at(int fd, char* data, size_t count, off_t offset) {
+	size_t total = 0;
+	while (total < count) {
+		ssize_t n = pread(fd, data + total, count - total, offset + total);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			throw std::runtime_error{"failed pread() " + std::to_string(errno)};
+		if (n == 0)
+			break;
+		total += n;
+	}
+	return total;
+}
+
+void write_all(int fd, const char* data, size_t count) {
+	while (count > 0) {
+		ssize_t n = write(fd, data, count);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error{"failed write() " + std::to_string(errno)};
+		data += n;
+		count -= n;
+	}
+}
+
+void write_at(int fd, const char* data, size_t count, off_t offset) {
+	while (count > 0) {
+		ssize_t n = pwrite(fd, data, count, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error{"failed pwrite() " + std::to_string(errno)};
+		data += n;
+		offset += n;
+		count -= n;
+	}
+}
+
+void send_all(int sock, const char* data, size_t count) {
+	while (count > 0) {
+		ssize_t n = send(sock, data, count, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error{"failed send() " + std::to_string(errno)};
+		data += n;
+		count -= n;
+	}
+}
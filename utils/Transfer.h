@@ -0,0 +1,52 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+#include <cstddef>
+#include <vector>
+
+// Send count bytes of a file starting at offset to a blocking socket.
+// Uses sendfile(2), so the data never passes through user space,
+// and falls back to buffered reads where sendfile is unsupported.
+// Returns the number of bytes sent, less than count if the file shrank.
+size_t send_file_contents(int sock, int file_fd, off_t offset, size_t count);
+
+// Moves data from a socket into a file with splice(2) through a pipe,
+// falling back to buffered read/write where splicing is unsupported
+class Splice_pipe {
+public:
+	Splice_pipe();
+	~Splice_pipe();
+
+	Splice_pipe(const Splice_pipe&) = delete;
+	Splice_pipe& operator=(const Splice_pipe&) = delete;
+
+	// Move at most count bytes from a non-blocking socket to a file at offset.
+	// Same return convention as read(2): bytes moved, 0 at end of stream,
+	// -1 with errno set (EAGAIN if no data is available yet).
+	ssize_t to_file(int sock, int file_fd, off_t offset, size_t count);
+private:
+	ssize_t buffered_to_file(int sock, int file_fd, off_t offset, size_t count);
+
+	int read_end = -1;
+	int write_end = -1;
+	size_t capacity = 0;
+	bool spliceable = true;
+	std::vector<char> fallback;	// Buffer when splicing is unsupported
+};
+
+// Copy count bytes between files at the given offsets with copy_file_range(2),
+// which may share extents instead of copying, or with buffered reads otherwise
+void copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t count);
+
+// Read count bytes of a file at offset, retrying short reads.
+// Returns the number of bytes read, less than count at the end of the file.
+size_t read_at(int fd, char* data, size_t count, off_t offset);
+// Write the whole buffer to a file descriptor, retrying short writes
+void write_all(int fd, const char* data, size_t count);
+// Same at an offset of a file, leaving its position alone
+void write_at(int fd, const char* data, size_t count, off_t offset);
+// Same for a blocking socket, without raising SIGPIPE
+void send_all(int sock, const char* data, size_t count);
+
+#endif
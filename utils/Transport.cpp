@@ -0,0 +1,203 @@
+#include "Transport.h"
+#include "Metrics.h"
+#include "Rate_limiter.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+Counter& bytes_sent = metrics().counter("backup_socket_bytes_sent_total", "Bytes sent over frame streams");
+Counter& sends = metrics().counter("backup_socket_sends_total", "System calls sending them");
+
+// Writes below this are copied together rather than queued on their own
+constexpr size_t small_write = 16 * 1024;
+constexpr size_t max_iov = 64;
+constexpr size_t max_spares = 4;
+// Zero-copy buffers kept for the kernel before waiting on it
+constexpr size_t max_unacked = 64 * 1024 * 1024;
+// Completions wait for the peer's acknowledgements, which a stalled connection never sends
+constexpr int completion_timeout_ms = 2000;
+
+void set_option(int sock, int level, int name, int value, const char* what) {
+	if (setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+		throw std::runtime_error{std::string{"failed setsockopt() "} + what + ' ' + std::to_string(errno)};
+}
+
+}
+
+void tune_socket(int sock, const Socket_tuning& tuning) {
+	if (tuning.send_buffer > 0)
+		set_option(sock, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer, "SO_SNDBUF");
+	if (tuning.receive_buffer > 0)
+		set_option(sock, SOL_SOCKET, SO_RCVBUF, tuning.receive_buffer, "SO_RCVBUF");
+	set_option(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+}
+
+void set_cork(int sock, bool on) {
+	set_option(sock, IPPROTO_TCP, TCP_CORK, on, "TCP_CORK");
+}
+
+Send_queue::Send_queue(int s, size_t zerocopy_threshold) : sock{s}, threshold{zerocopy_threshold} {
+	// Kernels without it just send as usual
+	int on = 1;
+	zerocopy = threshold > 0 && setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+Send_queue::~Send_queue() {
+	while (!unacked.empty() && reap(true))
+		;
+}
+
+void Send_queue::append(const char* data, size_t n) {
+	if (n == 0)
+		return;
+	if (!tail_open) {
+		buffers.push_back(Buffer{spare()});
+		tail_open = true;
+	}
+	buffers.back().data.append(data, n);
+	queued += n;
+}
+
+void Send_queue::push(std::string s) {
+	if (s.size() < small_write) {
+		append(s);
+		return;
+	}
+	queued += s.size();
+	buffers.push_back(Buffer{std::move(s)});
+	tail_open = false;
+}
+
+std::string Send_queue::spare() {
+	if (spares.empty())
+		return {};
+	std::string s = std::move(spares.back());
+	spares.pop_back();
+	return s;
+}
+
+void Send_queue::flush() {
+	while (!buffers.empty()) {
+		// Sent a slice at a time when the rate is limited
+		const size_t slice = network_limit().slice();
+		iovec iov[max_iov];
+		size_t count = 0;
+		size_t total = 0;
+		bool large = false;
+		for (size_t i = 0; i < buffers.size() && count < max_iov && (slice == 0 || total < slice); ++i) {
+			std::string& d = buffers[i].data;
+			const size_t skip = i == 0 ? sent_of_front : 0;
+			size_t length = d.size() - skip;
+			if (slice > 0)
+				length = std::min(length, slice - total);
+			iov[count++] = iovec{d.data() + skip, length};
+			total += length;
+			large = large || d.size() >= threshold;
+		}
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		const bool zc = zerocopy && large;
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && zc && errno == ENOBUFS) {
+			// Out of memory for completions, wait for some or send as usual
+			if (unacked.empty() || !reap(true))
+				zerocopy = false;
+			continue;
+		}
+		if (n == -1)
+			throw std::runtime_error{"failed sendmsg() " + std::to_string(errno)};
+		if (zc) {
+			for (size_t i = 0; i < count; ++i) {
+				buffers[i].zerocopy = true;
+				buffers[i].last_send = next_send;
+			}
+			++next_send;
+		}
+		queued -= n;
+		bytes_sent.add(n);
+		sends.add();
+		network_limit().consume(n);
+		for (size_t left = n; left > 0; ) {
+			Buffer& b = buffers.front();
+			const size_t rest = b.data.size() - sent_of_front;
+			if (left < rest) {
+				sent_of_front += left;
+				break;
+			}
+			left -= rest;
+			sent_of_front = 0;
+			retire(std::move(b));
+			buffers.pop_front();
+		}
+	}
+	tail_open = false;
+	if (!unacked.empty())
+		reap(false);
+	while (unacked_bytes > max_unacked)
+		if (!reap(true))
+			throw std::runtime_error{"zero-copy sends don't complete"};
+}
+
+void Send_queue::retire(Buffer&& b) {
+	if (b.zerocopy) {
+		unacked_bytes += b.data.size();
+		unacked.emplace_back(b.last_send, std::move(b.data));
+	} else if (spares.size() < max_spares) {
+		b.data.clear();
+		spares.push_back(std::move(b.data));
+	}
+}
+
+bool Send_queue::reap(bool wait) {
+	bool released = false;
+	for (bool polled = !wait; !unacked.empty(); ) {
+		char control[128];
+		msghdr msg{};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (polled || (errno != EAGAIN && errno != EWOULDBLOCK))
+				break;
+			// Completions are reported as errors, so no events need asking for
+			pollfd p{sock, 0, 0};
+			poll(&p, 1, completion_timeout_ms);
+			polled = true;
+			continue;
+		}
+		for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+					&& !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+				continue;
+			sock_extended_err ee;
+			std::memcpy(&ee, CMSG_DATA(c), sizeof(ee));
+			if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno != 0)
+				continue;
+			// Copied anyway, as over loopback, so not worth the bookkeeping
+			if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zerocopy = false;
+			// Sends ee_info through ee_data completed, TCP completes them in order
+			while (!unacked.empty() && static_cast<int32_t>(unacked.front().first - ee.ee_data) <= 0) {
+				unacked_bytes -= unacked.front().second.size();
+				unacked.pop_front();
+				released = true;
+			}
+		}
+	}
+	return released;
+}
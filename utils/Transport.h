@@ -0,0 +1,72 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Socket options of the transfer path
+struct Socket_tuning {
+	int send_buffer = 0;		// SO_SNDBUF in bytes, 0 leaves it to the kernel's autotuning
+	int receive_buffer = 0;		// SO_RCVBUF likewise
+	bool cork = true;			// Send only full segments during bulk sends (TCP_CORK)
+	size_t zerocopy_threshold = 0;	// Send buffers at least this large with MSG_ZEROCOPY, 0 never
+};
+
+// Set the buffer sizes, before connecting or listening for them to count
+// towards the window scale, and TCP_NODELAY: frames are coalesced before
+// they are sent, so Nagle's algorithm could only delay them
+void tune_socket(int sock, const Socket_tuning&);
+void set_cork(int sock, bool);
+
+// Bytes waiting to be sent over a blocking socket. Small writes are copied
+// together, large buffers queued as they are, and everything goes out with
+// one sendmsg per flush where the socket takes it, partial writes resumed.
+// Buffers sent with MSG_ZEROCOPY are kept until the kernel is done with them.
+class Send_queue {
+public:
+	Send_queue(int sock, size_t zerocopy_threshold);
+	// Waits for zero-copy sends still using buffers
+	~Send_queue();
+
+	Send_queue(const Send_queue&) = delete;
+	Send_queue& operator=(const Send_queue&) = delete;
+
+	void append(const char* data, size_t n);
+	void append(const std::string& s) { append(s.data(), s.size()); }
+	// Queue a buffer, copied only if it's small
+	void push(std::string);
+	// An empty buffer, reusing the memory of one already sent
+	std::string spare();
+	size_t size() const { return queued; }
+	void flush();
+private:
+	struct Buffer {
+		std::string data;
+		bool zerocopy = false;	// Part of a zero-copy send
+		uint32_t last_send = 0;	// Id of the last zero-copy send of it
+	};
+
+	void retire(Buffer&&);
+	// Release buffers whose zero-copy sends completed, waiting a while
+	// for some if asked to. Returns whether any were released.
+	bool reap(bool wait);
+
+	int sock;
+	size_t threshold;
+	bool zerocopy = false;
+	std::deque<Buffer> buffers;
+	size_t sent_of_front = 0;	// Bytes of the first buffer already sent
+	size_t queued = 0;
+	bool tail_open = false;		// Whether small writes may go in the last buffer
+	std::vector<std::string> spares;
+
+	uint32_t next_send = 0;		// Zero-copy sends are numbered from 0 by the kernel
+	std::deque<std::pair<uint32_t, std::string>> unacked;
+	size_t unacked_bytes = 0;
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include "Walker.h"
+
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Record layout of getdents64, which glibc doesn't declare
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Directories queued with their descriptor open. Past this many,
+// subdirectories are read depth-first on the spot instead.
+constexpr size_t max_open_directories = 256;
+constexpr size_t dirents_bufsize = 32 * 1024;
+// Files a worker gathers before handing them to the visitor
+constexpr size_t visit_batch = 256;
+
+struct Directory_job {
+	int fd;
+	fs::path path;
+};
+
+class Walk {
+public:
+	Walk(size_t threads, bool stat_files, const File_visitor* visit);
+	// Closes the directories still queued, as when a root can't be opened
+	~Walk();
+	void add_root(const fs::path&);
+	Walk_result run();
+private:
+	struct Queue {
+		std::mutex m;
+		std::deque<Directory_job> jobs;
+	};
+	struct Found_file {
+		std::string path;
+		struct stat st;
+	};
+
+	void work(size_t id);
+	// From the back of the worker's own queue, or the front of another's
+	bool take(size_t id, Directory_job&);
+	void push(size_t id, Directory_job);
+	void read_directory(size_t id, const Directory_job&);
+	void found_file(size_t id, const fs::path& dir, const char* name, const struct stat&);
+	// Hand a worker's gathered files to the visitor
+	void flush(size_t id);
+
+	size_t threads;
+	bool stat_files;
+	const File_visitor* visit;
+	std::mutex visit_mutex;
+	std::unique_ptr<Queue[]> queues;
+	std::vector<Walk_result> results;	// One per worker
+	std::vector<std::vector<Found_file>> batches;	// One per worker, when visiting
+	std::atomic<size_t> open_directories{0};
+	// Guards the counts, which idle workers wait on
+	std::mutex idle_mutex;
+	std::condition_variable idle;
+	size_t pending = 0;		// Jobs queued or being read
+	size_t queued = 0;		// Jobs queued
+};
+
+Walk::Walk(size_t n, bool s, const File_visitor* v)
+	: threads{std::max<size_t>(n, 1)}, stat_files{s}, visit{v},
+		queues{new Queue[threads]}, results(threads), batches(visit ? threads : 0) {}
+
+Walk::~Walk() {
+	for (size_t i = 0; i < threads; ++i)
+		for (const Directory_job& job : queues[i].jobs)
+			close(job.fd);
+}
+
+void Walk::add_root(const fs::path& root) {
+	int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error{"can't open directory " + root.string() + ' ' + std::to_string(errno)};
+	++open_directories;
+	push(0, Directory_job{fd, root});
+}
+
+void Walk::push(size_t id, Directory_job job) {
+	{
+		// Counted before the lock is released, so that whoever takes
+		// the job finds it counted, and idle workers can't miss it
+		std::lock_guard<std::mutex> idle_lock{idle_mutex};
+		{
+			std::lock_guard<std::mutex> lock{queues[id].m};
+			queues[id].jobs.push_back(std::move(job));
+		}
+		++pending;
+		++queued;
+	}
+	idle.notify_one();
+}
+
+bool Walk::take(size_t id, Directory_job& job) {
+	for (size_t i = 0; i < threads; ++i) {
+		Queue& q = queues[(id + i) % threads];
+		std::lock_guard<std::mutex> lock{q.m};
+		if (q.jobs.empty())
+			continue;
+		if (i == 0) {
+			job = std::move(q.jobs.back());
+			q.jobs.pop_back();
+		} else {
+			job = std::move(q.jobs.front());
+			q.jobs.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void Walk::work(size_t id) {
+	for (Directory_job job; ; ) {
+		if (take(id, job)) {
+			{
+				std::lock_guard<std::mutex> lock{idle_mutex};
+				--queued;
+			}
+			read_directory(id, job);
+			bool done = false;
+			{
+				std::lock_guard<std::mutex> lock{idle_mutex};
+				done = --pending == 0;
+			}
+			if (done)
+				idle.notify_all();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock{idle_mutex};
+		idle.wait(lock, [this]{ return queued > 0 || pending == 0; });
+		if (pending == 0) {
+			lock.unlock();
+			if (visit)
+				flush(id);
+			return;
+		}
+	}
+}
+
+void Walk::found_file(size_t id, const fs::path& dir, const char* name, const struct stat& st) {
+	if (!visit) {
+		results[id].files.push_back(Walked_file{dir / name, st});
+		return;
+	}
+	// Joined like fs::path's operator/ would
+	std::string path = dir.native();
+	if (!path.empty() && path.back() != '/')
+		path += '/';
+	path += name;
+	batches[id].push_back(Found_file{std::move(path), st});
+	if (batches[id].size() >= visit_batch)
+		flush(id);
+}
+
+void Walk::flush(size_t id) {
+	std::vector<Found_file>& batch = batches[id];
+	if (batch.empty())
+		return;
+	{
+		std::lock_guard<std::mutex> lock{visit_mutex};
+		for (const Found_file& f : batch)
+			(*visit)(f.path, f.st);
+	}
+	batch.clear();
+}
+
+void Walk::read_directory(size_t id, const Directory_job& job) {
+	Walk_result& result = results[id];
+	std::vector<char> buf(dirents_bufsize);
+	for (;;) {
+		long n = syscall(SYS_getdents64, job.fd, buf.data(), buf.size());
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			std::cerr << "can't read directory " << job.path << ' ' << errno << '\n';
+			break;
+		}
+		if (n == 0)
+			break;
+		for (long pos = 0; pos < n; ) {
+			const linux_dirent64* d = reinterpret_cast<const linux_dirent64*>(buf.data() + pos);
+			pos += d->d_reclen;
+			const char* name = d->d_name;
+			if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0)
+				continue;
+
+			struct stat st{};
+			bool directory = d->d_type == DT_DIR;
+			bool file = d->d_type == DT_REG;
+			if (d->d_type == DT_UNKNOWN) {
+				// Some file systems don't fill in d_type
+				if (fstatat(job.fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+					continue;
+				directory = S_ISDIR(st.st_mode);
+				file = S_ISREG(st.st_mode);
+				if (S_ISLNK(st.st_mode) && fstatat(job.fd, name, &st, 0) == 0)
+					file = S_ISREG(st.st_mode);
+			} else if (d->d_type == DT_LNK) {
+				if (fstatat(job.fd, name, &st, 0) == -1)
+					continue;	// Dangling
+				file = S_ISREG(st.st_mode);
+			} else if (file && stat_files && fstatat(job.fd, name, &st, 0) == -1) {
+				continue;	// Removed meanwhile
+			}
+
+			if (file) {
+				found_file(id, job.path, name, st);
+			} else if (directory) {
+				fs::path path = job.path / name;
+				int fd = openat(job.fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (fd == -1) {
+					std::cerr << "can't open directory " << path << ' ' << errno << '\n';
+					continue;
+				}
+				result.directories.push_back(path);
+				if (++open_directories <= max_open_directories) {
+					push(id, Directory_job{fd, std::move(path)});
+				} else {
+					read_directory(id, Directory_job{fd, std::move(path)});
+				}
+			}
+		}
+	}
+	close(job.fd);
+	--open_directories;
+}
+
+Walk_result Walk::run() {
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threads; ++i)
+		workers.emplace_back([this, i]{ work(i); });
+	work(0);
+	for (std::thread& t : workers)
+		t.join();
+
+	Walk_result all;
+	for (Walk_result& r : results) {
+		all.files.insert(all.files.end(),
+			std::make_move_iterator(r.files.begin()), std::make_move_iterator(r.files.end()));
+		all.directories.insert(all.directories.end(),
+			std::make_move_iterator(r.directories.begin()), std::make_move_iterator(r.directories.end()));
+	}
+	return all;
+}
+
+}
+
+Walk_result walk(const std::vector<fs::path>& roots, size_t threads, bool stat_files) {
+	Walk w{threads, stat_files, nullptr};
+	for (const fs::path& root : roots)
+		w.add_root(root);
+	return w.run();
+}
+
+Walk_result walk(const std::vector<fs::path>& roots, size_t threads, bool stat_files,
+		const File_visitor& visit) {
+	Walk w{threads, stat_files, &visit};
+	for (const fs::path& root : roots)
+		w.add_root(root);
+	return w.run();
+}
@@ -0,0 +1,37 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+struct Walked_file {
+	std::filesystem::path path;
+	struct stat st;		// Only filled in when asked for
+};
+
+struct Walk_result {
+	std::vector<Walked_file> files;
+	std::vector<std::filesystem::path> directories;	// Below the roots
+};
+
+// Walks the trees under roots on several threads, which steal
+// subtrees from each other. Entries are read with getdents64, whose
+// d_type spares a stat per entry, and subdirectories are opened relative
+// to their parent with openat. Symbolic links count as what they point
+// to, but linked directories aren't entered. Unreadable directories are
+// skipped with a warning. Results come in no particular order.
+Walk_result walk(const std::vector<std::filesystem::path>& roots, size_t threads, bool stat_files = false);
+
+// Called with each file found, one call at a time, from the walking threads
+using File_visitor = std::function<void(std::string_view path, const struct stat&)>;
+// Hands the files to visit as they're found instead of keeping them,
+// so only directories are in the result
+Walk_result walk(const std::vector<std::filesystem::path>& roots, size_t threads, bool stat_files,
+	const File_visitor& visit);
+
+#endif